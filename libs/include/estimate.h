@@ -0,0 +1,178 @@
+/** Checkpoint cost estimation interface functions.
+ *  @file estimate.h
+ */
+
+#ifndef LIBESTIMATE_H
+#define LIBESTIMATE_H
+
+#include <sys/types.h>
+
+/*
+ * Memory excluded from checkpoints by a process
+ *
+ * libkrgcheckpoint publishes what a process excluded with cr_exclude_on()
+ * in POSIX shared memory object CHKPT_EXCLUDED_SHM (formatted with the
+ * pid), so that it can be estimated from outside, up to 100 ms after a
+ * change. The object is written and closed at once, so that it is neither
+ * mapped nor open in checkpoint images. start_time (field 22 of /proc/<pid>/stat) tells a stale object
+ * of a previous process with the same pid, and the device and inode of
+ * /proc/<pid>/exe one of a process which called exec. Stale objects of
+ * processes killed or which called exec are removed by estimations.
+ */
+#define CHKPT_EXCLUDED_SHM "/krgcr-excluded.%d"
+#define CHKPT_EXCLUDED_MAGIC 0x4b524745U	/* "KRGE" */
+
+struct chkpt_excluded_info {
+	unsigned int magic;
+	pid_t pid;
+	unsigned long long start_time;
+	unsigned long long exe_dev;
+	unsigned long long exe_ino;
+	unsigned long long nr_regions;
+	unsigned long long bytes;
+};
+
+/*
+ * chkpt_process_start_time
+ *
+ * Return the start time of process pid, as given by /proc/<pid>/stat, 0
+ * on failure
+ */
+unsigned long long chkpt_process_start_time(pid_t pid);
+
+/*
+ * chkpt_excluded_identify
+ *
+ * Fill the magic, the pid, the start time and the program of process pid
+ * in info
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_excluded_identify(pid_t pid, struct chkpt_excluded_info *info);
+
+/* Memory of a process, in bytes */
+struct chkpt_memory {
+	unsigned long long resident;
+	unsigned long long anonymous;	/* private data, saved in the image */
+	unsigned long long swap;	/* swapped out, saved in the image too */
+	unsigned long long excluded;	/* published by the process */
+};
+
+/*
+ * chkpt_process_memory
+ *
+ * Fill mem with the memory of process pid, read from
+ * /proc/<pid>/smaps_rollup, or /proc/<pid>/smaps on older kernels
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_process_memory(pid_t pid, struct chkpt_memory *mem);
+
+/*
+ * Throughput history of a storage root
+ *
+ * <root>/CHKPT_THROUGHPUT_FILE keeps the size and the duration of the
+ * last CHKPT_THROUGHPUT_SAMPLES checkpoints written in root.
+ */
+#define CHKPT_THROUGHPUT_FILE "throughput"
+#define CHKPT_THROUGHPUT_SAMPLES 16
+
+/*
+ * chkpt_throughput_record
+ *
+ * Record a checkpoint of bytes written in root in duration_ms
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_throughput_record(const char *root, unsigned long long bytes,
+			    unsigned int duration_ms);
+
+/*
+ * chkpt_throughput_get
+ *
+ * Set *bytes_per_s to the throughput of the checkpoints recorded in root
+ *
+ * Return 0 on success, -1 on failure (ENOENT if nothing is recorded)
+ */
+int chkpt_throughput_get(const char *root, unsigned long long *bytes_per_s);
+
+/* Predicted cost of a checkpoint */
+struct chkpt_estimate {
+	int nr_processes;
+	struct chkpt_memory memory;	/* sum over the processes */
+	unsigned long long bytes;	/* of the image */
+};
+
+/*
+ * chkpt_estimate_app
+ *
+ * Fill est with the predicted image size of the application of process
+ * pid: the private memory of its processes, less what they excluded
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_estimate_app(pid_t pid, struct chkpt_estimate *est);
+
+/*
+ * chkpt_estimate_duration
+ *
+ * Return the time in ms to write bytes in root according to its history,
+ * -1 if root has no history
+ */
+long chkpt_estimate_duration(const char *root, unsigned long long bytes);
+
+/*
+ * Dirty memory rate of an application
+ *
+ * The soft-dirty bits of the processes are cleared through
+ * /proc/<pid>/clear_refs, and those set again since are counted from
+ * /proc/<pid>/pagemap in the private writable mappings, which are saved in
+ * images: this is what an incremental checkpoint would save. It needs a
+ * kernel with CONFIG_MEM_SOFT_DIRTY, and the right to ptrace the
+ * processes.
+ */
+struct chkpt_dirty {
+	pid_t pid;			/* root process of the application */
+	unsigned long long start_ms;	/* CLOCK_MONOTONIC of the last reset */
+
+	/* last sample */
+	int nr_processes;
+	unsigned long long bytes;	/* dirtied since the previous sample */
+	unsigned long long interval_ms;
+	unsigned long long bytes_per_s;
+};
+
+/*
+ * chkpt_dirty_start
+ *
+ * Clear the soft-dirty bits of the application of process pid, and
+ * initialize dirty to sample it
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_dirty_start(pid_t pid, struct chkpt_dirty *dirty);
+
+/*
+ * chkpt_dirty_sample
+ *
+ * Count the memory dirtied by the application since chkpt_dirty_start() or
+ * the previous sample, and clear the soft-dirty bits for the next one.
+ * Processes started meanwhile count for what they dirtied since they were
+ * created.
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_dirty_sample(struct chkpt_dirty *dirty);
+
+/*
+ * chkpt_process_dirty
+ *
+ * Set *bytes to the private writable memory of process pid with its
+ * soft-dirty bit set, and clear the bits if reset is set
+ *
+ * Return 0 on success, -1 on failure (ENOTSUP if the kernel does not
+ * track soft-dirty bits)
+ */
+int chkpt_process_dirty(pid_t pid, int reset, unsigned long long *bytes);
+
+#endif /* LIBESTIMATE_H */
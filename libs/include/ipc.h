@@ -1,6 +1,9 @@
 #ifndef LIBIPC_H
 #define LIBIPC_H
 
+#include <sys/types.h>
+#include <pthread.h>
+
 int ipc_msgq_checkpoint(int msqid, int fd);
 
 int ipc_msgq_restart(int fd);
@@ -13,4 +16,177 @@ int ipc_shm_checkpoint(int shmid, int fd);
 
 int ipc_shm_restart(int fd);
 
+/* System V IPC objects, as listed in /proc/sysvipc */
+enum ipc_obj_type {
+	IPC_OBJ_MSG,
+	IPC_OBJ_SEM,
+	IPC_OBJ_SHM,
+	IPC_OBJ_NR_TYPES
+};
+
+struct ipc_obj {
+	enum ipc_obj_type type;
+	int id;
+	key_t key;
+	uid_t uid;
+	unsigned long long size;	/* bytes queued, semaphores, bytes */
+	char file[32];			/* image file, relative to its directory */
+};
+
+/*
+ * ipc_obj_type_str
+ *
+ * Return the name of the type: "msg", "sem" or "shm"
+ */
+const char *ipc_obj_type_str(enum ipc_obj_type type);
+
+/*
+ * ipc_list_objects
+ *
+ * Fill *objs with the objects of the given type owned by uid, or by anyone
+ * if uid is (uid_t)-1. *objs must be freed by caller.
+ *
+ * Return the number of objects, -1 on failure
+ */
+int ipc_list_objects(enum ipc_obj_type type, uid_t uid, struct ipc_obj **objs);
+
+/*
+ * ipc_obj_checkpoint
+ *
+ * Checkpoint obj in fd with the function of its type
+ *
+ * Return 0 on success, -1 on failure
+ */
+int ipc_obj_checkpoint(const struct ipc_obj *obj, int fd);
+
+/*
+ * ipc_obj_restart
+ *
+ * Restore an object of the given type from fd with the function of the
+ * type
+ *
+ * Return 0 on success, -1 on failure
+ */
+int ipc_obj_restart(enum ipc_obj_type type, int fd);
+
+/*
+ * Index of a directory of images
+ *
+ * <dir>/IPC_INDEX_FILE has a line "<type> <id> <key> <file>" per object
+ * checkpointed in dir.
+ */
+#define IPC_INDEX_FILE "index"
+
+/*
+ * ipc_index_write
+ *
+ * Write the index of the nr objects of objs in dir, replacing any previous
+ * one at once
+ *
+ * Return 0 on success, -1 on failure
+ */
+int ipc_index_write(const char *dir, const struct ipc_obj *objs, int nr);
+
+/*
+ * ipc_index_read
+ *
+ * Fill *objs with the objects listed in the index of dir, uid and size
+ * being unknown. *objs must be freed by caller.
+ *
+ * Return the number of objects, -1 on failure (EINVAL if the index is
+ * malformed)
+ */
+int ipc_index_read(const char *dir, struct ipc_obj **objs);
+
+/*
+ * Streams of images
+ *
+ * Images can be written to, and read from, a pipe or a socket rather than
+ * files. A stream carries several objects at once as records, each made
+ * of a struct ipc_stream_record and of length bytes:
+ *
+ *   IPC_STREAM_BEGIN   object number stream is of type, id and key, given
+ *                      as 3 32-bit integers
+ *   IPC_STREAM_DATA    the next bytes of the image of object stream
+ *   IPC_STREAM_END     the image of object stream is complete
+ *   IPC_STREAM_ABORT   the image of object stream is not valid
+ *
+ * Integers are in network byte order. Images go through pipes to and from
+ * the kernel: callers should ignore SIGPIPE.
+ */
+#define IPC_STREAM_MAGIC 0x4b495053U	/* "KIPS" */
+
+enum ipc_stream_kind {
+	IPC_STREAM_BEGIN,
+	IPC_STREAM_DATA,
+	IPC_STREAM_END,
+	IPC_STREAM_ABORT,
+};
+
+struct ipc_stream_record {
+	unsigned int magic;
+	unsigned short kind;
+	unsigned short reserved;
+	unsigned int stream;
+	unsigned int length;
+};
+
+struct ipc_stream {
+	int fd;
+	pthread_mutex_t lock;		/* records are written whole */
+	unsigned int next_stream;
+};
+
+/*
+ * ipc_stream_target
+ *
+ * Return 1 if target names a stream: "-" for the standard input or
+ * output, "fd:<N>" for an inherited file descriptor, "unix:<path>" for a
+ * unix socket. Return 0 otherwise.
+ */
+int ipc_stream_target(const char *target);
+
+/*
+ * ipc_stream_open
+ *
+ * Initialize s on target, for writing if output is set
+ *
+ * Return 0 on success, -1 on failure
+ */
+int ipc_stream_open(struct ipc_stream *s, const char *target, int output);
+
+/*
+ * ipc_stream_close
+ *
+ * Close the stream
+ *
+ * Return 0 on success, -1 on failure
+ */
+int ipc_stream_close(struct ipc_stream *s);
+
+/*
+ * ipc_stream_checkpoint
+ *
+ * Checkpoint obj in s. Several threads may checkpoint objects in the same
+ * stream at once.
+ *
+ * Return 0 on success, -1 on failure
+ */
+int ipc_stream_checkpoint(struct ipc_stream *s, const struct ipc_obj *obj);
+
+/* Called for each object of a stream once restored, error being 0 or errno */
+typedef void (*ipc_stream_report_t)(const struct ipc_obj *obj, int error,
+				    void *arg);
+
+/*
+ * ipc_stream_restart
+ *
+ * Restore all the objects of s, at once if they were written at once, and
+ * call report for each of them
+ *
+ * Return the number of objects that failed, -1 if the stream is invalid
+ */
+int ipc_stream_restart(struct ipc_stream *s, ipc_stream_report_t report,
+		       void *arg);
+
 #endif
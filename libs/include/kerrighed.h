@@ -15,6 +15,8 @@ extern "C" {
 #include "proc.h"
 #include "hotplug.h"
 #include "ipc.h"
+#include "storage.h"
+#include "estimate.h"
 
 void __attribute__ ((constructor)) init_krg_lib(void);
 
@@ -236,4 +236,27 @@ void close_kerrighed_services(int fd) ;
  */
 int call_opened_kerrighed_services(int fd, int service_id, void * data) ;
 
+
+
+/** Read exactly len bytes, unless the end of file is reached first.
+ *
+ *  @param fd : the file descriptor to read from
+ *  @param buf : where the bytes are written
+ *  @param len : the number of bytes to read
+ *  @return len, the number of bytes read if the end of file was reached
+ *          first (errno is then EIO), or -1 on error
+ */
+ssize_t krg_read_full(int fd, void *buf, size_t len) ;
+
+
+
+/** Write exactly len bytes.
+ *
+ *  @param fd : the file descriptor to write to
+ *  @param buf : the bytes to write
+ *  @param len : the number of bytes to write
+ *  @return len, or -1 on error
+ */
+ssize_t krg_write_full(int fd, const void *buf, size_t len) ;
+
 #endif // LIBKERRIGHED_TOOL_H
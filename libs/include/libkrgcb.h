@@ -7,6 +7,8 @@
 #ifndef LIBKRG_CB_H
 #define LIBKRG_CB_H
 
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,15 +16,52 @@ extern "C" {
 /* callback function type */
 typedef int (*cr_cb_callback_t)(void *);
 
-/* library init/exit function */
+/* hooks */
+enum cr_cb_hook {
+	CR_CB_CHECKPOINT = 1,
+	CR_CB_RESTART = 2,
+	CR_CB_CONTINUE = 3
+};
+
+/* callback flags */
+#define CR_CB_THREAD (1 << 0)	/* run out of thread context */
+#define CR_CB_INDEPENDENT (1 << 1)	/* with CR_CB_THREAD: may run
+					 * concurrently with other callbacks
+					 * of the hook, on a small pool */
+
+/* callbacks of a hook run by decreasing priority, then in registration
+ * order */
+#define CR_CB_DEFAULT_PRIORITY 0
+
+/* library init/exit function, init does nothing if the library is
+ * already initialized */
 int cr_callback_init(void);
+
+/* init flags
+ * CR_CB_INIT_SIGNALFD: block the signals of libkrgcb in the calling thread
+ * and consume them from a dedicated thread through signalfd, so that all
+ * callbacks run out of signal handler context. Call it before creating
+ * other threads, which inherit the blocked signals. Also enabled by
+ * KRGCB_DISPATCH=signalfd in the environment. */
+#define CR_CB_INIT_SIGNALFD (1 << 0)
+
+int cr_callback_init_flags(int flags);
 void cr_callback_exit(void);
 
-/* library execute cb functions */
+/* library execute cb functions
+ * checkpoint callbacks are acknowledged on a unix socket of the calling
+ * thread by processes of the local node using this version of the
+ * library, on a SysV message queue otherwise or if KRGCB_CHANNEL=msgq is
+ * set. A process dying before acknowledging fails with ESRCH. */
 int cr_execute_chkpt_callbacks(long pid, short from_appid);
 int cr_execute_restart_callbacks(long pid);
 int cr_execute_continue_callbacks(long pid, short from_appid);
 
+/* same as cr_execute_chkpt_callbacks, failing with ETIMEDOUT if callbacks
+ * are not acknowledged within timeout ms (no deadline if timeout <= 0) */
+int cr_execute_chkpt_callbacks_timeout(long pid, short from_appid,
+				       int timeout);
+
 /* register checkpoint, restart and continue callbacks out of signal
  * handler context */
 int cr_register_chkpt_callback(cr_cb_callback_t func, void *arg);
@@ -35,6 +74,91 @@ int cr_register_chkpt_thread_callback(cr_cb_callback_t func, void *arg);
 int cr_register_restart_thread_callback(cr_cb_callback_t func, void *arg);
 int cr_register_continue_thread_callback(cr_cb_callback_t func, void *arg);
 
+/* size of the report of a process, see cr_callback_report() */
+#define CR_CB_REPORT_SIZE 256
+
+/* outcome of the checkpoint callbacks of one process */
+struct cr_cb_result {
+	pid_t pid;
+	int result;		/* 0 on success, -1 on failure */
+	int error;		/* errno of a failed delivery, ETIMEDOUT, or 0
+				 * if callbacks failed */
+	unsigned int elapsed_ms;
+	/* reported by the process: sum of the durations of its callbacks,
+	 * and the slowest one, given by its address in the process */
+	unsigned int callbacks_us;
+	unsigned int slowest_us;
+	unsigned long long slowest_func;
+	/* lines written by its callbacks with cr_callback_report() */
+	char report[CR_CB_REPORT_SIZE];
+};
+
+/* same as cr_execute_chkpt_callbacks_timeout, filling result if not NULL */
+int cr_execute_chkpt_callbacks_report(long pid, short from_appid,
+				      int timeout, struct cr_cb_result *result);
+
+/* execute checkpoint callbacks in every process of the application of
+ * root pid which installed libkrgcb handlers, concurrently. *results
+ * gets one entry per process and must be freed by caller. Return the
+ * number of processes, -1 on failure */
+int cr_execute_app_chkpt_callbacks(long pid, short from_appid, int timeout,
+				   struct cr_cb_result **results);
+int cr_execute_app_continue_callbacks(long pid, short from_appid);
+
+/* in a callback, tell whether the requester delivers the callbacks to
+ * all the processes of the application itself, in which case they must
+ * not be relayed to children */
+int cr_callback_fanned_out(void);
+
+/* in a checkpoint callback out of thread context, add a line to the
+ * report sent back to the requester with the acknowledgement, truncated
+ * to CR_CB_REPORT_SIZE bytes in all */
+int cr_callback_report(const char *format, ...)
+	__attribute__ ((format (printf, 1, 2)));
+
+/* register a callback of hook with priority, out of signal handler
+ * context unless flags has CR_CB_THREAD */
+int cr_register_callback(enum cr_cb_hook hook, cr_cb_callback_t func,
+			 void *arg, int priority, int flags);
+
+/* unregister the first callback of hook registered with func and arg;
+ * fails with ENOENT if there is none */
+int cr_unregister_callback(enum cr_cb_hook hook, cr_cb_callback_t func,
+			   void *arg);
+
+/* checkpoint callbacks func running longer than budget_ms (0: unbounded)
+ * make the checkpoint fail */
+int cr_set_callback_budget(cr_cb_callback_t func, unsigned int budget_ms);
+
+/* latency statistics of a registered callback
+ * hist[0] counts durations below 1 us, hist[i] durations in
+ * [2^(i-1), 2^i) us, the last bucket longer ones as well */
+#define CR_CB_HIST_BUCKETS 32
+
+struct cr_cb_stats {
+	enum cr_cb_hook hook;
+	cr_cb_callback_t func;
+	void *arg;
+	int priority;
+	int flags;
+	unsigned long count;
+	unsigned long long total_us;
+	unsigned int max_us;
+	unsigned int last_us;
+	unsigned long hist[CR_CB_HIST_BUCKETS];
+};
+
+/* fill *stats with the statistics of all registered callbacks, to be
+ * freed by caller. Return the number of callbacks, -1 on failure */
+int cr_callback_get_stats(struct cr_cb_stats **stats);
+void cr_callback_reset_stats(void);
+
+/* write the statistics to fd in a stable text format: a version line
+ * "krgcb-stats 1 pid <pid> buckets <n>", a comment line, then one line
+ * per callback: hook func arg priority context count total_us max_us
+ * last_us and the n histogram buckets */
+int cr_callback_dump_stats(int fd);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
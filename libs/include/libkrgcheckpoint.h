@@ -14,6 +14,21 @@ extern "C" {
 int cr_disable(void);
 int cr_enable(void);
 
+/* nestable sections of the calling thread during which checkpoint is
+ * disabled: only the outermost cr_section_begin() and cr_section_end()
+ * call cr_disable() and cr_enable() */
+int cr_section_begin(void);
+int cr_section_end(void);
+
+/* batch mode: the cr_enable() of an outermost cr_section_end() is
+ * deferred, so that back to back sections of a thread share a single
+ * disabled period, lasting at most max_sections sections or max_us
+ * microseconds (both checked when a section ends). max_sections == 0
+ * leaves batch mode. A thread leaving sections for a while must call
+ * cr_section_flush() so as not to delay checkpoints. */
+int cr_section_batch(unsigned int max_sections, unsigned int max_us);
+int cr_section_flush(void);
+
 typedef int (*cr_mm_excl_callback_t)(void *);
 
 int cr_exclude_on(void *data, size_t datasize,
@@ -21,6 +36,43 @@ int cr_exclude_on(void *data, size_t datasize,
 
 int cr_exclude_off(void *data);
 
+/* memory excluded from checkpoints, carved out of arenas registered once
+ * with cr_exclude_on(). The content of an arena is not restored on
+ * restart, but allocations remain valid: the restart callback of the
+ * arena is expected to rebuild what is needed. */
+struct cr_excl_arena;
+
+/* default size of the arenas of cr_excl_malloc() */
+#define CR_EXCL_ARENA_SIZE (64UL << 20)
+
+struct cr_excl_arena *cr_excl_arena_create(size_t size,
+					   cr_mm_excl_callback_t func,
+					   void *arg);
+int cr_excl_arena_destroy(struct cr_excl_arena *arena);
+void *cr_excl_arena_malloc(struct cr_excl_arena *arena, size_t size);
+
+/* allocate from shared arenas, without restart callback */
+void *cr_excl_malloc(size_t size);
+
+/* free memory got from cr_excl_malloc() or cr_excl_arena_malloc() */
+void cr_excl_free(void *ptr);
+
+/* memory shrink before checkpoints: out of thread context, after the
+ * other checkpoint callbacks, droppable caches are released in the order
+ * they were registered, then free heap memory is given back with
+ * malloc_trim(). What each step reclaimed is reported to the checkpointer
+ * (see cr_callback_report()). */
+int cr_shrink_init(void);
+
+/* droppable cache hook: release what can be rebuilt later, return the
+ * number of bytes released */
+typedef size_t (*cr_cache_drop_t)(void *arg);
+
+/* also calls cr_shrink_init() */
+int cr_register_droppable_cache(const char *name, cr_cache_drop_t func,
+				void *arg);
+int cr_unregister_droppable_cache(cr_cache_drop_t func, void *arg);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
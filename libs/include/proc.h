@@ -42,6 +42,92 @@ struct checkpoint_info application_checkpoint_from_pid(pid_t pid,
 int application_restart(long app_id, int chkpt_sn, int flags,
 			struct cr_subst_files_array *substitution);
 
+/*
+ * Placement of the processes of a restarted application
+ *
+ * PLACEMENT_PACK puts every process on the first node of the set (the
+ * local node when no set is given), PLACEMENT_SPREAD and PLACEMENT_NODES
+ * distribute them round-robin over the online nodes or over the given
+ * node list.
+ */
+enum krg_placement_policy {
+	PLACEMENT_NONE,
+	PLACEMENT_PACK,
+	PLACEMENT_SPREAD,
+	PLACEMENT_NODES,
+};
+
+struct krg_placement {
+	enum krg_placement_policy policy;
+	int nr_nodes;
+	int *nodes;
+};
+
+/*
+ * application_get_chkpt_pids
+ *
+ * Fill *pids with the pids of the processes (not threads) saved in
+ * version chkpt_sn of application app_id. *pids must be freed by caller.
+ *
+ * Return the number of pids, -1 on failure
+ */
+int application_get_chkpt_pids(long app_id, int chkpt_sn, pid_t **pids);
+
+/*
+ * application_get_pids
+ *
+ * Fill *pids with the pids of the running processes (not threads) of the
+ * application of process id, or of application id if from_appid. They are
+ * the root process, whose pid is the application identifier, the
+ * processes of the session it leads, and all their descendants. Given a
+ * process, the root is its last checkpointable ancestor, or its session
+ * leader for an orphan. *pids must be freed by caller.
+ *
+ * Return the number of pids, -1 on failure
+ */
+int application_get_pids(long id, int from_appid, pid_t **pids);
+
+/*
+ * application_get_appid
+ *
+ * Find the identifier of the running application process pid belongs
+ * to, as application_get_pids() does.
+ *
+ * Return the application identifier, -1 on failure
+ */
+long application_get_appid(pid_t pid);
+
+/*
+ * migrate_processes
+ *
+ * Migrate pids[i] to nodes[i], issuing the migrations concurrently.
+ *
+ * Return the number of processes that failed to migrate, -1 on failure
+ */
+int migrate_processes(const pid_t *pids, const int *nodes, int nr_pids);
+
+/*
+ * application_place
+ *
+ * Migrate the given processes according to placement. Processes are
+ * expected to be frozen (see restart -U).
+ *
+ * Return the number of processes that failed to migrate, -1 on failure
+ */
+int application_place(const pid_t *pids, int nr_pids,
+		      const struct krg_placement *placement);
+
+/*
+ * krg_placement_parse
+ *
+ * Fill placement from str: "pack[:nodes]", "spread[:nodes]" or "nodes",
+ * where nodes is a list such as 1,3,5-7. Nodes are appended to
+ * placement->nodes, which must be freed by caller.
+ *
+ * Return 0 on success, -1 on failure
+ */
+int krg_placement_parse(const char *str, struct krg_placement *placement);
+
 int application_set_userdata(__u64 data);
 int application_get_userdata_from_appid(long app_id, __u64 *data);
 int application_get_userdata_from_pid(pid_t pid, __u64 *data);
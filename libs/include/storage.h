@@ -0,0 +1,318 @@
+/** Checkpoint storage interface functions.
+ *  @file storage.h
+ */
+
+#ifndef LIBSTORAGE_H
+#define LIBSTORAGE_H
+
+#include <sys/types.h>
+#include <limits.h>
+
+/* Where a checkpoint version currently lives */
+enum chkpt_location {
+	CHKPT_LOCATION_UNKNOWN,
+	CHKPT_LOCATION_LOCAL,		/* only in CHKPT_DIR */
+	CHKPT_LOCATION_DRAINING,	/* being copied to the shared tier */
+	CHKPT_LOCATION_SHARED,		/* in CHKPT_DIR and in the shared tier */
+	CHKPT_LOCATION_EVICTED,		/* in the shared tier, CHKPT_DIR links to it */
+};
+
+/*
+ * chkpt_location_str
+ *
+ * Return the name of the location
+ */
+const char *chkpt_location_str(enum chkpt_location loc);
+
+/*
+ * chkpt_version_dir
+ *
+ * Write in path the directory of version chkpt_sn of application app_id
+ *
+ * Return 0 on success, -1 if path is too small
+ */
+int chkpt_version_dir(char *path, size_t size, long app_id, int chkpt_sn);
+
+/*
+ * chkpt_get_location
+ *
+ * Return the location of a checkpoint version. If shared_path is not NULL,
+ * the path of the copy in the shared tier (if any) is written in it.
+ */
+enum chkpt_location chkpt_get_location(long app_id, int chkpt_sn,
+				       char *shared_path, size_t size);
+
+/*
+ * chkpt_set_location
+ *
+ * Record the location of a checkpoint version
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_set_location(long app_id, int chkpt_sn, enum chkpt_location loc,
+		       const char *shared_path);
+
+/*
+ * chkpt_copy_fd
+ *
+ * Copy size bytes from in_fd to out_fd, using copy_file_range(2) or
+ * sendfile(2) when available. bwlimit is in bytes per second, 0 means
+ * no limit.
+ *
+ * Return the number of bytes copied, -1 on failure
+ */
+ssize_t chkpt_copy_fd(int in_fd, int out_fd, size_t size,
+		      unsigned long bwlimit);
+
+/*
+ * chkpt_copy_dir
+ *
+ * Copy the regular files of directory src into directory dst, which must
+ * exist. Copies are synced to disk.
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_copy_dir(const char *src, const char *dst, unsigned long bwlimit);
+
+/*
+ * chkpt_remove_dir
+ *
+ * Remove the regular files of directory path, then the directory itself
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_remove_dir(const char *path);
+
+/*
+ * chkpt_drain_version
+ *
+ * Copy version chkpt_sn of application app_id to
+ * <shared_root>/<app_id>/v<chkpt_sn>. If evict is not 0, the local copy is
+ * then replaced by a symbolic link to the shared one.
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_drain_version(long app_id, int chkpt_sn, const char *shared_root,
+			unsigned long bwlimit, int evict);
+
+/*
+ * Index of the versions of an application
+ *
+ * CHKPT_DIR/<app_id>/versions lists the versions written by checkpoint,
+ * krgcr-import and chkpt_fetch_replica(), so that the newest ones are
+ * found without scanning the directory. The directory is scanned too when
+ * it changed after the index, for versions written by other means.
+ */
+
+/*
+ * chkpt_index_add
+ *
+ * Record version chkpt_sn of application app_id in its index, along with
+ * the versions of CHKPT_DIR/<app_id> missing from it
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_index_add(long app_id, int chkpt_sn);
+
+/*
+ * chkpt_index_versions
+ *
+ * Fill *versions with the versions of application app_id, newest first,
+ * scanning CHKPT_DIR/<app_id> if it has no index or changed after it.
+ * *versions must be freed by caller.
+ *
+ * Return the number of versions, -1 on failure
+ */
+int chkpt_index_versions(long app_id, int **versions);
+
+/*
+ * Storage roots
+ *
+ * Checkpoints may be spread over several file systems (storage roots).
+ * CHKPT_DIR stays the namespace used by the kernel and the tools: an
+ * application placed on a root has CHKPT_DIR/<app_id> linking to
+ * <root>/<app_id>, and the placement is recorded in CHKPT_ROOTS_INDEX.
+ *
+ * Roots are read from CHKPT_ROOTS_CONF, lines being one of:
+ *   root <path>
+ *   policy round-robin|most-free
+ *   pin <app_id> <path>
+ * Environment variables KRG_CHKPT_ROOTS (colon separated list of roots)
+ * and KRG_CHKPT_POLICY override the roots and the policy of the file.
+ */
+#define CHKPT_ROOTS_CONF "/etc/kerrighed/chkpt_roots"
+#define CHKPT_ROOTS_INDEX CHKPT_DIR "/roots.index"
+#define CHKPT_MAX_ROOTS 16
+
+enum chkpt_root_policy {
+	CHKPT_ROOT_ROUND_ROBIN,
+	CHKPT_ROOT_MOST_FREE,
+};
+
+struct chkpt_root_pin {
+	long app_id;
+	int root;
+};
+
+struct chkpt_roots {
+	enum chkpt_root_policy policy;
+	int nr_roots;
+	char root[CHKPT_MAX_ROOTS][PATH_MAX];
+	int nr_pins;
+	struct chkpt_root_pin *pins;
+};
+
+/*
+ * chkpt_roots_load
+ *
+ * Fill roots from configuration file conf (CHKPT_ROOTS_CONF if NULL) and
+ * from the environment. A missing file is not an error: roots is then
+ * empty and checkpoints stay in CHKPT_DIR.
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_roots_load(struct chkpt_roots *roots, const char *conf);
+
+/*
+ * chkpt_roots_pin
+ *
+ * Pin application app_id to root path, adding path to the roots if needed
+ *
+ * Return 0 on success, -1 on failure
+ */
+int chkpt_roots_pin(struct chkpt_roots *roots, long app_id, const char *path);
+
+void chkpt_roots_free(struct chkpt_roots *roots);
+
+/*
+ * chkpt_root_select
+ *
+ * Choose the root of a new application: its pinned root if any, otherwise
+ * according to the policy of roots.
+ *
+ * Return the index of the root in roots, -1 on failure
+ */
+int chkpt_root_select(const struct chkpt_roots *roots, long app_id);
+
+/*
+ * chkpt_place_app
+ *
+ * Make sure that the checkpoints of application app_id go to a root.
+ * Nothing is done if the application is already placed. If
+ * CHKPT_DIR/<app_id> already holds checkpoints, they are moved to the
+ * selected root.
+ *
+ * Return 0 on success, -1 on failure or if roots is empty
+ */
+int chkpt_place_app(const struct chkpt_roots *roots, long app_id);
+
+/*
+ * chkpt_resolve_version
+ *
+ * Write in path the real directory of version chkpt_sn of application
+ * app_id, looking up its root in CHKPT_ROOTS_INDEX
+ *
+ * Return 0 on success, -1 if the version does not exist
+ */
+int chkpt_resolve_version(long app_id, int chkpt_sn, char *path, size_t size);
+
+/*
+ * Replication of checkpoint versions to the stores of other nodes
+ *
+ * A transport is given by a specification "<type>:<address>" where
+ * <address> contains a "%d" replaced by the node identifier:
+ *   dir:/net/node%d/var/chkpt-replicas
+ *            the store of each node is a directory reachable from here
+ *   unix:/var/run/krgcr-replica.%d.sock
+ *            the store of each node is served by krgcr-replicate --serve
+ *
+ * Other transports can be plugged with chkpt_transport_register().
+ */
+#define CHKPT_REPLICA_DEFAULT "unix:/var/run/krgcr-replica.%d.sock"
+
+struct chkpt_transport;
+
+struct chkpt_transport_ops {
+	const char *type;
+
+	/* start sending version chkpt_sn of app_id to the store of node */
+	void *(*open)(const struct chkpt_transport *t, int node,
+		      long app_id, int chkpt_sn);
+	/* send size bytes of fd as file name of the version */
+	int (*send)(void *stream, const char *name, int fd, size_t size);
+	/* make the version valid in the store, or drop it if !commit */
+	int (*close)(void *stream, int commit);
+	/* copy the version from the store of node into directory dst */
+	int (*fetch)(const struct chkpt_transport *t, int node,
+		     long app_id, int chkpt_sn, const char *dst);
+};
+
+struct chkpt_transport {
+	const struct chkpt_transport_ops *ops;
+	char spec[PATH_MAX];
+	char address[PATH_MAX];
+};
+
+/*
+ * chkpt_transport_register
+ *
+ * Make a new type of transport available to chkpt_transport_init
+ *
+ * Return 0 on success, -1 if too many transports are registered
+ */
+int chkpt_transport_register(const struct chkpt_transport_ops *ops);
+
+/*
+ * chkpt_transport_init
+ *
+ * Initialize t from specification spec
+ *
+ * Return 0 on success, -1 on failure (unknown type, bad address)
+ */
+int chkpt_transport_init(struct chkpt_transport *t, const char *spec);
+
+/*
+ * chkpt_select_replica_nodes
+ *
+ * Fill *nodes with at most k online nodes other than the local one,
+ * nearest first. *nodes must be freed by caller.
+ *
+ * Return the number of nodes, -1 on failure
+ */
+int chkpt_select_replica_nodes(int k, int **nodes);
+
+/*
+ * chkpt_replicate_version
+ *
+ * Push version chkpt_sn of application app_id to the stores of the
+ * given nodes, in parallel, and record the valid replicas in
+ * CHKPT_DIR/<app_id>/v<chkpt_sn>.replicas. Versions may go through
+ * sockets: callers should ignore SIGPIPE.
+ *
+ * Return the number of valid replicas, -1 on failure
+ */
+int chkpt_replicate_version(const struct chkpt_transport *t, long app_id,
+			    int chkpt_sn, const int *nodes, int nr_nodes);
+
+/*
+ * chkpt_fetch_replica
+ *
+ * Copy version chkpt_sn of application app_id into CHKPT_DIR from the
+ * nearest online node holding a valid replica. Requests may go through
+ * sockets: callers should ignore SIGPIPE.
+ *
+ * Return the node the version was fetched from, -1 on failure
+ */
+int chkpt_fetch_replica(const struct chkpt_transport *t, long app_id,
+			int chkpt_sn);
+
+/*
+ * chkpt_replica_serve
+ *
+ * Serve the store root on the unix socket listen_fd. SIGPIPE is ignored,
+ * so that a client leaving does not kill the server. Never returns but
+ * on failure.
+ */
+int chkpt_replica_serve(int listen_fd, const char *root);
+
+#endif /* LIBSTORAGE_H */
@@ -0,0 +1,657 @@
+/* Checkpoint cost estimation interface functions.
+ * @file libestimate.c
+ *
+ * Copyright (C) 2010, Kerlabs
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <proc.h>
+#include <estimate.h>
+
+/* The history file is rewritten with its last samples past this size */
+#define THROUGHPUT_FILE_MAX 4096
+
+/* pagemap entries read at once */
+#define PAGEMAP_BATCH 4096
+
+#define PM_SOFT_DIRTY (1ULL << 55)
+#define PM_SWAP (1ULL << 62)
+#define PM_PRESENT (1ULL << 63)
+
+static int read_proc_stat(pid_t pid, pid_t *ppid,
+			  unsigned long long *start_time)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long value;
+	ssize_t len;
+	int fd, field;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	/* the command may contain spaces and parentheses */
+	p = strrchr(buf, ')');
+	if (!p)
+		return -1;
+
+	/* field 3 is the state, then numbers */
+	p += 2;
+	for (field = 3; field <= 22; field++) {
+		while (*p == ' ')
+			p++;
+		value = strtoull(p, &p, 10);
+		if (field == 4 && ppid)
+			*ppid = value;
+		if (field == 3)
+			/* skip the state letter */
+			p++;
+		if (!*p)
+			return -1;
+	}
+
+	if (start_time)
+		*start_time = value;
+
+	return 0;
+}
+
+unsigned long long chkpt_process_start_time(pid_t pid)
+{
+	unsigned long long start_time;
+
+	if (read_proc_stat(pid, NULL, &start_time))
+		return 0;
+
+	return start_time;
+}
+
+int chkpt_excluded_identify(pid_t pid, struct chkpt_excluded_info *info)
+{
+	char path[64];
+	struct stat buf;
+
+	memset(info, 0, sizeof(*info));
+	info->magic = CHKPT_EXCLUDED_MAGIC;
+	info->pid = pid;
+
+	info->start_time = chkpt_process_start_time(pid);
+	if (!info->start_time)
+		return -1;
+
+	/* may be denied for processes of other users */
+	snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+	if (!stat(path, &buf)) {
+		info->exe_dev = buf.st_dev;
+		info->exe_ino = buf.st_ino;
+	}
+
+	return 0;
+}
+
+static int read_excluded_info(pid_t pid, struct chkpt_excluded_info *info)
+{
+	char name[64];
+	ssize_t r;
+	int fd;
+
+	snprintf(name, sizeof(name), CHKPT_EXCLUDED_SHM, pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		return -1;
+
+	r = pread(fd, info, sizeof(*info), 0);
+	close(fd);
+	if (r != sizeof(*info) || info->magic != CHKPT_EXCLUDED_MAGIC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Whether info was published by the program process pid runs now */
+static int excluded_info_current(pid_t pid,
+				 const struct chkpt_excluded_info *info)
+{
+	struct chkpt_excluded_info now;
+
+	if (chkpt_excluded_identify(pid, &now))
+		return 0;
+
+	if (info->pid != pid || info->start_time != now.start_time)
+		return 0;
+
+	return !info->exe_ino || !now.exe_ino
+		|| (info->exe_dev == now.exe_dev
+		    && info->exe_ino == now.exe_ino);
+}
+
+/*
+ * Objects are removed by the processes when they exit normally only.
+ * Objects being created, not written yet, are left alone.
+ */
+static void remove_stale_excluded(void)
+{
+	struct chkpt_excluded_info info;
+	struct dirent *ent;
+	char name[64];
+	pid_t pid;
+	DIR *dir;
+
+	dir = opendir("/dev/shm");
+	if (!dir)
+		return;
+
+	while ((ent = readdir(dir)) != NULL) {
+		/* CHKPT_EXCLUDED_SHM is an absolute name */
+		if (sscanf(ent->d_name, CHKPT_EXCLUDED_SHM + 1, &pid) != 1)
+			continue;
+
+		if (kill(pid, 0) && errno == ESRCH)
+			;	/* killed */
+		else if (read_excluded_info(pid, &info)
+			 || excluded_info_current(pid, &info))
+			continue;
+
+		snprintf(name, sizeof(name), CHKPT_EXCLUDED_SHM, pid);
+		shm_unlink(name);
+	}
+	closedir(dir);
+}
+
+/* Max number of ancestors looked up for the exclusions of a process */
+#define EXCLUDED_MAX_DEPTH 8
+
+static int read_excluded(pid_t pid, unsigned long long *bytes)
+{
+	struct chkpt_excluded_info info;
+
+	if (read_excluded_info(pid, &info)
+	    || !excluded_info_current(pid, &info))
+		return -1;
+
+	*bytes = info.bytes;
+
+	return 0;
+}
+
+/*
+ * A process publishes its exclusions once it changes them: until then,
+ * it has those its parent had when it forked, approximated with those
+ * its parent has now.
+ */
+static void find_excluded(pid_t pid, struct chkpt_memory *mem)
+{
+	int depth;
+
+	for (depth = 0; depth < EXCLUDED_MAX_DEPTH; depth++) {
+		if (!read_excluded(pid, &mem->excluded))
+			return;
+		if (read_proc_stat(pid, &pid, NULL) || pid <= 1)
+			return;
+	}
+}
+
+int chkpt_process_memory(pid_t pid, struct chkpt_memory *mem)
+{
+	char path[64], line[256];
+	unsigned long long kb;
+	FILE *file;
+
+	memset(mem, 0, sizeof(*mem));
+
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+	file = fopen(path, "r");
+	if (!file) {
+		snprintf(path, sizeof(path), "/proc/%d/smaps", pid);
+		file = fopen(path, "r");
+	}
+	if (!file)
+		return -1;
+
+	/* smaps has one such line per mapping, smaps_rollup the sums */
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "Rss: %llu kB", &kb) == 1)
+			mem->resident += kb << 10;
+		else if (sscanf(line, "Anonymous: %llu kB", &kb) == 1)
+			mem->anonymous += kb << 10;
+		else if (sscanf(line, "Swap: %llu kB", &kb) == 1)
+			mem->swap += kb << 10;
+	}
+	fclose(file);
+
+	find_excluded(pid, mem);
+
+	return 0;
+}
+
+int chkpt_estimate_app(pid_t pid, struct chkpt_estimate *est)
+{
+	struct chkpt_memory mem;
+	unsigned long long saved;
+	pid_t *pids;
+	int i, nr;
+
+	memset(est, 0, sizeof(*est));
+
+	remove_stale_excluded();
+
+	nr = application_get_pids(pid, 0, &pids);
+	if (nr < 0)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		/* exited meanwhile */
+		if (chkpt_process_memory(pids[i], &mem))
+			continue;
+
+		est->nr_processes++;
+		est->memory.resident += mem.resident;
+		est->memory.anonymous += mem.anonymous;
+		est->memory.swap += mem.swap;
+		est->memory.excluded += mem.excluded;
+
+		/* excluded regions may not be resident at all */
+		saved = mem.anonymous + mem.swap;
+		est->bytes += saved > mem.excluded ? saved - mem.excluded : 0;
+	}
+	free(pids);
+
+	return 0;
+}
+
+static int throughput_file(char *path, size_t size, const char *root)
+{
+	int r;
+
+	r = snprintf(path, size, "%s/%s", root, CHKPT_THROUGHPUT_FILE);
+	if (r < 0 || r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read the last samples of the history, return their number */
+static int read_samples(const char *path, unsigned long long *bytes,
+			unsigned int *duration_ms)
+{
+	unsigned long long b;
+	unsigned int ms;
+	int nr = 0;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	while (fscanf(file, "%llu %u", &b, &ms) == 2) {
+		if (nr == CHKPT_THROUGHPUT_SAMPLES) {
+			memmove(bytes, bytes + 1, (nr - 1) * sizeof(*bytes));
+			memmove(duration_ms, duration_ms + 1,
+				(nr - 1) * sizeof(*duration_ms));
+			nr--;
+		}
+		bytes[nr] = b;
+		duration_ms[nr] = ms;
+		nr++;
+	}
+	fclose(file);
+
+	return nr;
+}
+
+/* Keep the last samples only */
+static int compact_history(const char *path)
+{
+	unsigned long long bytes[CHKPT_THROUGHPUT_SAMPLES];
+	unsigned int duration_ms[CHKPT_THROUGHPUT_SAMPLES];
+	char tmp[PATH_MAX];
+	FILE *file;
+	int i, nr, r;
+
+	nr = read_samples(path, bytes, duration_ms);
+	if (nr < 0)
+		return -1;
+
+	r = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (r < 0 || r >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	file = fopen(tmp, "w");
+	if (!file)
+		return -1;
+
+	for (i = 0; i < nr; i++)
+		fprintf(file, "%llu %u\n", bytes[i], duration_ms[i]);
+
+	r = 0;
+	if (fclose(file))
+		r = -1;
+	if (!r)
+		r = rename(tmp, path);
+	if (r)
+		unlink(tmp);
+
+	return r;
+}
+
+int chkpt_throughput_record(const char *root, unsigned long long bytes,
+			    unsigned int duration_ms)
+{
+	char path[PATH_MAX], line[64];
+	struct stat buf;
+	int fd, len, r;
+
+	if (throughput_file(path, sizeof(path), root))
+		return -1;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if (fd == -1)
+		return -1;
+
+	/* a single short write is never interleaved with another one */
+	len = snprintf(line, sizeof(line), "%llu %u\n", bytes, duration_ms);
+	r = write(fd, line, len) == len ? 0 : -1;
+
+	if (!r && !fstat(fd, &buf) && buf.st_size > THROUGHPUT_FILE_MAX)
+		compact_history(path);
+
+	if (close(fd))
+		r = -1;
+
+	return r;
+}
+
+int chkpt_throughput_get(const char *root, unsigned long long *bytes_per_s)
+{
+	unsigned long long bytes[CHKPT_THROUGHPUT_SAMPLES], total_bytes = 0;
+	unsigned int duration_ms[CHKPT_THROUGHPUT_SAMPLES];
+	unsigned long long total_ms = 0;
+	char path[PATH_MAX];
+	int i, nr;
+
+	if (throughput_file(path, sizeof(path), root))
+		return -1;
+
+	nr = read_samples(path, bytes, duration_ms);
+	if (nr < 0)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		total_bytes += bytes[i];
+		total_ms += duration_ms[i];
+	}
+
+	if (!total_bytes) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* checkpoints faster than the clock still count */
+	if (!total_ms)
+		total_ms = 1;
+
+	*bytes_per_s = total_bytes * 1000 / total_ms;
+
+	return 0;
+}
+
+long chkpt_estimate_duration(const char *root, unsigned long long bytes)
+{
+	unsigned long long bytes_per_s;
+
+	if (chkpt_throughput_get(root, &bytes_per_s) || !bytes_per_s)
+		return -1;
+
+	return bytes * 1000 / bytes_per_s;
+}
+
+/* Count the soft-dirty pages of [start, end) */
+static int count_dirty_pages(int fd, unsigned long start, unsigned long end,
+			     unsigned long long *entries,
+			     unsigned long long *nr_pages)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned long page = start / page_size, last = end / page_size;
+	size_t nr, i;
+	ssize_t r;
+
+	while (page < last) {
+		nr = last - page;
+		if (nr > PAGEMAP_BATCH)
+			nr = PAGEMAP_BATCH;
+
+		r = pread(fd, entries, nr * sizeof(*entries),
+			  (off_t)page * sizeof(*entries));
+		if (r < 0)
+			return -1;
+		/* unmapped meanwhile */
+		if (r < sizeof(*entries))
+			break;
+
+		nr = r / sizeof(*entries);
+		for (i = 0; i < nr; i++)
+			if ((entries[i] & PM_SOFT_DIRTY)
+			    && (entries[i] & (PM_PRESENT|PM_SWAP)))
+				(*nr_pages)++;
+
+		page += nr;
+	}
+
+	return 0;
+}
+
+/*
+ * Without CONFIG_MEM_SOFT_DIRTY, clearing the bits succeeds but they are
+ * never set: check that a page written by ourselves gets it.
+ */
+static int soft_dirty_supported(void)
+{
+	static int supported = -1;
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned long long entry;
+	char *page;
+	int fd;
+
+	if (supported >= 0)
+		return supported;
+
+	page = mmap(NULL, page_size, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED)
+		return 0;
+	*page = 1;
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd != -1) {
+		if (pread(fd, &entry, sizeof(entry),
+			  (off_t)((unsigned long)page / page_size)
+			  * sizeof(entry)) == sizeof(entry))
+			supported = !!(entry & PM_SOFT_DIRTY);
+		close(fd);
+	}
+	munmap(page, page_size);
+
+	return supported > 0;
+}
+
+static int clear_soft_dirty(pid_t pid)
+{
+	char path[64];
+	int fd, r;
+
+	snprintf(path, sizeof(path), "/proc/%d/clear_refs", pid);
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return -1;
+
+	r = write(fd, "4", 1) == 1 ? 0 : -1;
+
+	if (close(fd))
+		r = -1;
+
+	return r;
+}
+
+int chkpt_process_dirty(pid_t pid, int reset, unsigned long long *bytes)
+{
+	unsigned long long *entries, nr_pages = 0;
+	char path[64], line[PATH_MAX + 128], perms[5];
+	unsigned long start, end;
+	FILE *maps;
+	int fd, r = 0;
+
+	if (!soft_dirty_supported()) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	entries = malloc(PAGEMAP_BATCH * sizeof(*entries));
+	if (!entries) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	maps = fopen(path, "r");
+	if (!maps) {
+		r = -1;
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		r = -1;
+		goto out_maps;
+	}
+
+	while (fgets(line, sizeof(line), maps)) {
+		if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3)
+			continue;
+		/* shared mappings are not saved with the process */
+		if (perms[1] != 'w' || perms[3] != 'p')
+			continue;
+
+		r = count_dirty_pages(fd, start, end, entries, &nr_pages);
+		if (r)
+			break;
+	}
+
+	close(fd);
+
+	if (!r && reset)
+		r = clear_soft_dirty(pid);
+
+	if (!r)
+		*bytes = nr_pages * sysconf(_SC_PAGESIZE);
+
+out_maps:
+	fclose(maps);
+out:
+	free(entries);
+
+	return r;
+}
+
+static unsigned long long monotonic_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Count and reset the dirty memory of the processes of the application */
+static int app_dirty(struct chkpt_dirty *dirty, unsigned long long *bytes)
+{
+	unsigned long long process_bytes;
+	pid_t *pids;
+	int i, nr;
+
+	nr = application_get_pids(dirty->pid, 0, &pids);
+	if (nr < 0)
+		return -1;
+
+	*bytes = 0;
+	dirty->nr_processes = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (chkpt_process_dirty(pids[i], 1, &process_bytes)) {
+			/* exited meanwhile */
+			if (errno == ENOENT || errno == ESRCH)
+				continue;
+			free(pids);
+			return -1;
+		}
+
+		dirty->nr_processes++;
+		*bytes += process_bytes;
+	}
+	free(pids);
+
+	if (!dirty->nr_processes) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	return 0;
+}
+
+int chkpt_dirty_start(pid_t pid, struct chkpt_dirty *dirty)
+{
+	unsigned long long bytes;
+
+	memset(dirty, 0, sizeof(*dirty));
+	dirty->pid = pid;
+
+	if (app_dirty(dirty, &bytes))
+		return -1;
+
+	dirty->start_ms = monotonic_ms();
+
+	return 0;
+}
+
+int chkpt_dirty_sample(struct chkpt_dirty *dirty)
+{
+	unsigned long long bytes, now;
+
+	if (app_dirty(dirty, &bytes))
+		return -1;
+
+	now = monotonic_ms();
+
+	dirty->bytes = bytes;
+	dirty->interval_ms = now - dirty->start_ms;
+	dirty->bytes_per_s = dirty->interval_ms ?
+		bytes * 1000 / dirty->interval_ms : 0;
+	dirty->start_ms = now;
+
+	return 0;
+}
@@ -4,7 +4,16 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
 
 #include <kerrighed_tools.h>
 #include <ipc.h>
@@ -50,3 +59,623 @@ int ipc_shm_restart(int fd)
 {
 	return call_kerrighed_services(KSYS_IPC_SHM_RESTART, &fd);
 }
+
+/* Bytes of an image sent in a record */
+#define STREAM_CHUNK (64 << 10)
+
+static const char *type_names[IPC_OBJ_NR_TYPES] = {
+	"msg",
+	"sem",
+	"shm",
+};
+
+const char *ipc_obj_type_str(enum ipc_obj_type type)
+{
+	if (type < 0 || type >= IPC_OBJ_NR_TYPES)
+		return "unknown";
+
+	return type_names[type];
+}
+
+/* Fill obj from a line of /proc/sysvipc/<type>, return 0 on success */
+static int parse_sysvipc(enum ipc_obj_type type, const char *line,
+			 struct ipc_obj *obj)
+{
+	unsigned int uid;
+	int key, r;
+
+	switch (type) {
+	case IPC_OBJ_MSG:
+		/* key msqid perms cbytes qnum lspid lrpid uid ... */
+		r = sscanf(line, "%d %d %*o %llu %*u %*d %*d %u", &key,
+			   &obj->id, &obj->size, &uid);
+		break;
+	case IPC_OBJ_SEM:
+		/* key semid perms nsems uid ... */
+		r = sscanf(line, "%d %d %*o %llu %u", &key, &obj->id,
+			   &obj->size, &uid);
+		break;
+	case IPC_OBJ_SHM:
+		/* key shmid perms size cpid lpid nattch uid ... */
+		r = sscanf(line, "%d %d %*o %llu %*d %*d %*u %u", &key,
+			   &obj->id, &obj->size, &uid);
+		break;
+	default:
+		return -1;
+	}
+
+	if (r != 4)
+		return -1;
+
+	obj->type = type;
+	obj->key = key;
+	obj->uid = uid;
+	snprintf(obj->file, sizeof(obj->file), "%s_%d.bin",
+		 type_names[type], obj->id);
+
+	return 0;
+}
+
+int ipc_list_objects(enum ipc_obj_type type, uid_t uid, struct ipc_obj **objs)
+{
+	struct ipc_obj *array = NULL, *tmp, obj;
+	char path[64], line[256];
+	int nr = 0, size = 0;
+	FILE *file;
+
+	if (type < 0 || type >= IPC_OBJ_NR_TYPES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/proc/sysvipc/%s", type_names[type]);
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	/* the first line names the columns */
+	while (fgets(line, sizeof(line), file)) {
+		if (parse_sysvipc(type, line, &obj))
+			continue;
+		if (uid != (uid_t)-1 && obj.uid != uid)
+			continue;
+
+		if (nr == size) {
+			size += 32;
+			tmp = realloc(array, size * sizeof(*array));
+			if (!tmp) {
+				fclose(file);
+				free(array);
+				errno = ENOMEM;
+				return -1;
+			}
+			array = tmp;
+		}
+		array[nr++] = obj;
+	}
+	fclose(file);
+
+	*objs = array;
+
+	return nr;
+}
+
+int ipc_obj_checkpoint(const struct ipc_obj *obj, int fd)
+{
+	switch (obj->type) {
+	case IPC_OBJ_MSG:
+		return ipc_msgq_checkpoint(obj->id, fd);
+	case IPC_OBJ_SEM:
+		return ipc_sem_checkpoint(obj->id, fd);
+	case IPC_OBJ_SHM:
+		return ipc_shm_checkpoint(obj->id, fd);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+int ipc_obj_restart(enum ipc_obj_type type, int fd)
+{
+	switch (type) {
+	case IPC_OBJ_MSG:
+		return ipc_msgq_restart(fd);
+	case IPC_OBJ_SEM:
+		return ipc_sem_restart(fd);
+	case IPC_OBJ_SHM:
+		return ipc_shm_restart(fd);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+int ipc_index_write(const char *dir, const struct ipc_obj *objs, int nr)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *file;
+	int i, r;
+
+	r = snprintf(path, sizeof(path), "%s/%s", dir, IPC_INDEX_FILE);
+	if (r < 0 || r >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	r = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (r < 0 || r >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	file = fopen(tmp, "w");
+	if (!file)
+		return -1;
+
+	for (i = 0; i < nr; i++)
+		fprintf(file, "%s %d %d %s\n", type_names[objs[i].type],
+			objs[i].id, (int)objs[i].key, objs[i].file);
+
+	r = 0;
+	if (fflush(file) || fsync(fileno(file)))
+		r = -1;
+	if (fclose(file))
+		r = -1;
+	if (!r)
+		r = rename(tmp, path);
+	if (r)
+		unlink(tmp);
+
+	return r;
+}
+
+int ipc_index_read(const char *dir, struct ipc_obj **objs)
+{
+	struct ipc_obj *array = NULL, *tmp, obj;
+	char path[PATH_MAX], line[128], type[8];
+	int nr = 0, size = 0, key, r;
+	FILE *file;
+
+	r = snprintf(path, sizeof(path), "%s/%s", dir, IPC_INDEX_FILE);
+	if (r < 0 || r >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	while (fgets(line, sizeof(line), file)) {
+		memset(&obj, 0, sizeof(obj));
+		if (sscanf(line, "%7s %d %d %31s", type, &obj.id, &key,
+			   obj.file) != 4)
+			goto err_inval;
+
+		for (obj.type = 0; obj.type < IPC_OBJ_NR_TYPES; obj.type++)
+			if (!strcmp(type, type_names[obj.type]))
+				break;
+		/* image files are in dir */
+		if (obj.type == IPC_OBJ_NR_TYPES || strchr(obj.file, '/'))
+			goto err_inval;
+		obj.key = key;
+
+		if (nr == size) {
+			size += 32;
+			tmp = realloc(array, size * sizeof(*array));
+			if (!tmp) {
+				fclose(file);
+				free(array);
+				errno = ENOMEM;
+				return -1;
+			}
+			array = tmp;
+		}
+		array[nr++] = obj;
+	}
+	fclose(file);
+
+	*objs = array;
+
+	return nr;
+
+err_inval:
+	fclose(file);
+	free(array);
+	errno = EINVAL;
+	return -1;
+}
+
+int ipc_stream_target(const char *target)
+{
+	return !strcmp(target, "-") || !strncmp(target, "fd:", 3)
+		|| !strncmp(target, "unix:", 5);
+}
+
+static int connect_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int ipc_stream_open(struct ipc_stream *s, const char *target, int output)
+{
+	char *end;
+	long fd;
+
+	if (!strcmp(target, "-")) {
+		s->fd = output ? STDOUT_FILENO : STDIN_FILENO;
+	} else if (!strncmp(target, "fd:", 3)) {
+		errno = 0;
+		fd = strtol(target + 3, &end, 10);
+		if (errno || *end || end == target + 3 || fd < 0
+		    || fd > INT_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (fcntl(fd, F_GETFD) == -1)
+			return -1;
+		s->fd = fd;
+	} else if (!strncmp(target, "unix:", 5)) {
+		s->fd = connect_unix(target + 5);
+		if (s->fd == -1)
+			return -1;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	s->next_stream = 0;
+
+	return 0;
+}
+
+int ipc_stream_close(struct ipc_stream *s)
+{
+	pthread_mutex_destroy(&s->lock);
+
+	return close(s->fd);
+}
+
+static int write_record(struct ipc_stream *s, enum ipc_stream_kind kind,
+			unsigned int stream, const void *data,
+			unsigned int length)
+{
+	struct ipc_stream_record rec;
+	int r;
+
+	rec.magic = htonl(IPC_STREAM_MAGIC);
+	rec.kind = htons(kind);
+	rec.reserved = 0;
+	rec.stream = htonl(stream);
+	rec.length = htonl(length);
+
+	r = 0;
+	pthread_mutex_lock(&s->lock);
+	if (krg_write_full(s->fd, &rec, sizeof(rec)) != sizeof(rec)
+	    || (length && krg_write_full(s->fd, data, length) != length))
+		r = -1;
+	pthread_mutex_unlock(&s->lock);
+
+	return r;
+}
+
+struct stream_job {
+	struct ipc_obj obj;
+	unsigned int stream;
+	int fd;			/* end of the pipe of the kernel */
+	int pipe_fd;		/* our end, -1 once closed */
+	pthread_t thread;
+	int r;
+	int error;
+	int failure;		/* of the stream, whatever the restore */
+};
+
+static void *checkpoint_thread(void *arg)
+{
+	struct stream_job *job = arg;
+
+	job->r = ipc_obj_checkpoint(&job->obj, job->fd);
+	job->error = errno;
+	/* end of file for the reader */
+	close(job->fd);
+
+	return NULL;
+}
+
+int ipc_stream_checkpoint(struct ipc_stream *s, const struct ipc_obj *obj)
+{
+	struct stream_job job = { .r = 0 };
+	unsigned int begin[3];
+	int pipefd[2], error = 0;
+	ssize_t n;
+	char *buf;
+
+	buf = malloc(STREAM_CHUNK);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (pipe(pipefd)) {
+		free(buf);
+		return -1;
+	}
+
+	job.obj = *obj;
+	job.stream = __sync_fetch_and_add(&s->next_stream, 1);
+	job.fd = pipefd[1];
+
+	begin[0] = htonl(obj->type);
+	begin[1] = htonl(obj->id);
+	begin[2] = htonl(obj->key);
+	if (write_record(s, IPC_STREAM_BEGIN, job.stream, begin,
+			 sizeof(begin))) {
+		error = errno;
+		close(pipefd[1]);
+		goto out;
+	}
+
+	if (pthread_create(&job.thread, NULL, checkpoint_thread, &job)) {
+		error = EAGAIN;
+		close(pipefd[1]);
+		goto abort;
+	}
+
+	for (;;) {
+		n = read(pipefd[0], buf, STREAM_CHUNK);
+		if (!n)
+			break;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			error = errno;
+			break;
+		}
+		if (write_record(s, IPC_STREAM_DATA, job.stream, buf, n)) {
+			error = errno;
+			break;
+		}
+	}
+
+	/* on error, the kernel gets EPIPE */
+	close(pipefd[0]);
+	pipefd[0] = -1;
+	pthread_join(job.thread, NULL);
+	if (!error && job.r)
+		error = job.error;
+
+abort:
+	if (write_record(s, error ? IPC_STREAM_ABORT : IPC_STREAM_END,
+			 job.stream, NULL, 0) && !error)
+		error = errno;
+out:
+	if (pipefd[0] != -1)
+		close(pipefd[0]);
+	free(buf);
+
+	errno = error;
+	return error ? -1 : 0;
+}
+
+static void *restart_thread(void *arg)
+{
+	struct stream_job *job = arg;
+
+	job->r = ipc_obj_restart(job->obj.type, job->fd);
+	job->error = errno;
+	close(job->fd);
+
+	return NULL;
+}
+
+static struct stream_job *find_job(struct stream_job **jobs, int nr,
+				   unsigned int stream)
+{
+	int i;
+
+	/* latest objects are the most likely */
+	for (i = nr - 1; i >= 0; i--)
+		if (jobs[i]->stream == stream)
+			return jobs[i];
+
+	return NULL;
+}
+
+static int begin_job(struct stream_job ***jobs, int *nr, unsigned int stream,
+		     const unsigned int *begin)
+{
+	struct stream_job *job, **tmp;
+	int pipefd[2];
+
+	if (find_job(*jobs, *nr, stream) || ntohl(begin[0]) >= IPC_OBJ_NR_TYPES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	tmp = realloc(*jobs, (*nr + 1) * sizeof(*tmp));
+	if (!tmp) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*jobs = tmp;
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	job->stream = stream;
+	job->obj.type = ntohl(begin[0]);
+	job->obj.id = (int)ntohl(begin[1]);
+	job->obj.key = (key_t)ntohl(begin[2]);
+	snprintf(job->obj.file, sizeof(job->obj.file), "%s_%d.bin",
+		 type_names[job->obj.type], job->obj.id);
+
+	if (pipe(pipefd)) {
+		free(job);
+		return -1;
+	}
+	job->fd = pipefd[0];
+	job->pipe_fd = pipefd[1];
+
+	if (pthread_create(&job->thread, NULL, restart_thread, job)) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(job);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	(*jobs)[(*nr)++] = job;
+
+	return 0;
+}
+
+/* Copy length bytes to job, dropped if its restore already gave up */
+static int feed_job(int fd, struct stream_job *job, unsigned int length,
+		    char *buf)
+{
+	unsigned int len;
+
+	while (length) {
+		len = length < STREAM_CHUNK ? length : STREAM_CHUNK;
+		if (krg_read_full(fd, buf, len) != len)
+			return -1;
+		length -= len;
+
+		if (job->pipe_fd != -1
+		    && krg_write_full(job->pipe_fd, buf, len) != len) {
+			close(job->pipe_fd);
+			job->pipe_fd = -1;
+		}
+	}
+
+	return 0;
+}
+
+int ipc_stream_restart(struct ipc_stream *s, ipc_stream_report_t report,
+		       void *arg)
+{
+	struct stream_job **jobs = NULL, *job;
+	struct ipc_stream_record rec;
+	unsigned int begin[3], length;
+	int i, nr = 0, nr_failed = 0, error = 0;
+	ssize_t r;
+	char *buf;
+
+	buf = malloc(STREAM_CHUNK);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* the stream may only end between two records */
+	while ((r = krg_read_full(s->fd, &rec, sizeof(rec))) == sizeof(rec)) {
+		length = ntohl(rec.length);
+		if (ntohl(rec.magic) != IPC_STREAM_MAGIC) {
+			error = EINVAL;
+			break;
+		}
+
+		if (ntohs(rec.kind) == IPC_STREAM_BEGIN) {
+			if (length != sizeof(begin)) {
+				error = EINVAL;
+				break;
+			}
+			if (krg_read_full(s->fd, begin, sizeof(begin))
+			    != sizeof(begin)) {
+				error = errno;
+				break;
+			}
+			if (begin_job(&jobs, &nr, ntohl(rec.stream), begin)) {
+				error = errno;
+				break;
+			}
+			continue;
+		}
+
+		job = find_job(jobs, nr, ntohl(rec.stream));
+		if (!job) {
+			error = EINVAL;
+			break;
+		}
+
+		switch (ntohs(rec.kind)) {
+		case IPC_STREAM_DATA:
+			if (feed_job(s->fd, job, length, buf))
+				error = errno;
+			break;
+		case IPC_STREAM_ABORT:
+			job->failure = ECANCELED;
+			/* fall through */
+		case IPC_STREAM_END:
+			if (job->pipe_fd != -1) {
+				close(job->pipe_fd);
+				job->pipe_fd = -1;
+			}
+			break;
+		default:
+			error = EINVAL;
+		}
+		if (error)
+			break;
+	}
+	if (r && r != sizeof(rec) && !error)
+		error = errno;
+
+	/* restores of incomplete images get end of file too */
+	for (i = 0; i < nr; i++) {
+		if (jobs[i]->pipe_fd != -1) {
+			close(jobs[i]->pipe_fd);
+			jobs[i]->pipe_fd = -1;
+			jobs[i]->failure = EIO;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		job = jobs[i];
+		pthread_join(job->thread, NULL);
+		if (job->failure)
+			job->error = job->failure;
+		else if (!job->r)
+			job->error = 0;
+
+		if (job->error)
+			nr_failed++;
+		if (report)
+			report(&job->obj, job->error, arg);
+		free(job);
+	}
+	free(jobs);
+	free(buf);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return nr_failed;
+}
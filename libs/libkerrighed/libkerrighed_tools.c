@@ -15,6 +15,7 @@
 
 #include <types.h>
 #include <kerrighed.h>
+#include <kerrighed_tools.h>
 #include <version.h>
 
 int check_abi_version(void)
@@ -103,3 +104,46 @@ int call_kerrighed_services(int service_id, void * data)
 	return res;
 }
 
+
+/** Read exactly len bytes, unless the end of file is reached first.
+ *  Interrupted reads are restarted.
+ */
+ssize_t krg_read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = read(fd, (char *)buf + done, len - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (!r) {
+			errno = EIO;
+			break;
+		}
+		done += r;
+	}
+
+	return done;
+}
+
+/** Write exactly len bytes. Interrupted writes are restarted.
+ */
+ssize_t krg_write_full(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = write(fd, (const char *)buf + done, len - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		done += r;
+	}
+
+	return done;
+}
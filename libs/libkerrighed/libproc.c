@@ -5,6 +5,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <sys/syscall.h>
 #include <errno.h>
 #include <unistd.h>
@@ -12,11 +14,16 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include <types.h>
 #include <krgnodemask.h>
+#include <hotplug.h>
 #include <migration.h>
 #include <checkpoint.h>
+#include <capabilities.h>
+#include <capability.h>
 #include <kerrighed_tools.h>
 #include <proc.h>
 
@@ -214,6 +221,543 @@ err_inval:
 	goto error;
 }
 
+/* Max number of concurrent migrations issued by migrate_processes() */
+#define MIGRATION_MAX_THREADS 16
+
+static int is_thread_group_leader(pid_t pid)
+{
+	FILE *file;
+	char path[64], line[128];
+	pid_t tgid = pid;
+
+	sprintf(path, "/proc/%d/status", pid);
+	file = fopen(path, "r");
+	if (!file)
+		/* let the migration report the error */
+		return 1;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "Tgid: %d", &tgid) == 1)
+			break;
+	}
+	fclose(file);
+
+	return tgid == pid;
+}
+
+static int compare_pids(const void *a, const void *b)
+{
+	return *(const pid_t *)a - *(const pid_t *)b;
+}
+
+int application_get_chkpt_pids(long app_id, int chkpt_sn, pid_t **pids)
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[256];
+	pid_t pid, *array = NULL, *tmp;
+	int nr = 0, size = 0;
+
+	snprintf(path, sizeof(path), "%s/%ld/v%d", CHKPT_DIR, app_id,
+		 chkpt_sn);
+
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (sscanf(ent->d_name, "task_%d.bin", &pid) != 1)
+			continue;
+
+		if (!is_thread_group_leader(pid))
+			continue;
+
+		if (nr == size) {
+			size += 32;
+			tmp = realloc(array, size * sizeof(pid_t));
+			if (!tmp)
+				goto err_nomem;
+			array = tmp;
+		}
+		array[nr++] = pid;
+	}
+	closedir(dir);
+
+	qsort(array, nr, sizeof(pid_t), compare_pids);
+	*pids = array;
+
+	return nr;
+
+err_nomem:
+	closedir(dir);
+	free(array);
+	errno = ENOMEM;
+	return -1;
+}
+
+struct app_proc {
+	pid_t pid;
+	pid_t ppid;
+	pid_t sid;
+	int in_app;
+};
+
+/* Read the parent and the session of pid */
+static int read_proc_ids(pid_t pid, pid_t *ppid, pid_t *sid)
+{
+	char path[64], buf[1024], *p;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	/* the command may contain spaces and parentheses */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 1, " %*c %d %*d %d", ppid, sid) != 2)
+		return -1;
+
+	return 0;
+}
+
+static struct app_proc *find_app_proc(struct app_proc *procs, int nr,
+				      pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (procs[i].pid == pid)
+			return &procs[i];
+
+	return NULL;
+}
+
+static int is_checkpointable(pid_t pid)
+{
+	krg_cap_t caps;
+
+	if (krg_pid_capget(pid, &caps))
+		return 0;
+
+	return !!cap_raised(caps.krg_cap_effective, CAP_CHECKPOINTABLE);
+}
+
+/* Fill *procs with the processes running on the cluster */
+static int read_app_procs(struct app_proc **procs)
+{
+	struct app_proc *array = NULL, *tmp;
+	int nr = 0, max = 0;
+	struct dirent *ent;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (!isdigit(ent->d_name[0]))
+			continue;
+
+		if (nr == max) {
+			max = max ? 2 * max : 256;
+			tmp = realloc(array, max * sizeof(*array));
+			if (!tmp) {
+				closedir(dir);
+				free(array);
+				errno = ENOMEM;
+				return -1;
+			}
+			array = tmp;
+		}
+
+		array[nr].pid = atoi(ent->d_name);
+		if (read_proc_ids(array[nr].pid, &array[nr].ppid,
+				  &array[nr].sid))
+			continue;	/* exited meanwhile */
+		nr++;
+	}
+	closedir(dir);
+
+	*procs = array;
+	return nr;
+}
+
+/*
+ * Find the root process of the application of process id, or of
+ * application id if from_appid, and return the application identifier.
+ * *root is NULL when the root of an application given by id is gone.
+ */
+static pid_t find_app_root(struct app_proc *procs, int nr, long id,
+			   int from_appid, struct app_proc **root)
+{
+	struct app_proc *parent;
+	pid_t app_id;
+
+	*root = find_app_proc(procs, nr, id);
+	if (!from_appid) {
+		if (!*root) {
+			errno = ESRCH;
+			return -1;
+		}
+
+		/*
+		 * The root is the session leader started by krgcr-run, or
+		 * else the last checkpointable ancestor.
+		 */
+		while ((*root)->sid != (*root)->pid) {
+			parent = find_app_proc(procs, nr, (*root)->ppid);
+			if (!parent || parent->pid <= 1
+			    || !is_checkpointable(parent->pid))
+				break;
+			*root = parent;
+		}
+	}
+	app_id = *root ? (*root)->pid : id;
+
+	/* an orphan reparented to init: the root led its session */
+	if (!from_appid && (*root)->sid != (*root)->pid
+	    && (*root)->ppid <= 1) {
+		parent = find_app_proc(procs, nr, (*root)->sid);
+		if (!parent || is_checkpointable(parent->pid)) {
+			app_id = (*root)->sid;
+			*root = parent;
+		}
+	}
+
+	return app_id;
+}
+
+long application_get_appid(pid_t pid)
+{
+	struct app_proc *procs, *root;
+	pid_t app_id;
+	int nr;
+
+	nr = read_app_procs(&procs);
+	if (nr < 0)
+		return -1;
+
+	app_id = find_app_root(procs, nr, pid, 0, &root);
+	free(procs);
+
+	return app_id;
+}
+
+int application_get_pids(long id, int from_appid, pid_t **pids)
+{
+	struct app_proc *procs, *root, *parent;
+	int nr, nr_pids = 0, i, changed;
+	pid_t app_id, session;
+
+	nr = read_app_procs(&procs);
+	if (nr < 0)
+		return -1;
+
+	app_id = find_app_root(procs, nr, id, from_appid, &root);
+	if (app_id < 0) {
+		free(procs);
+		return -1;
+	}
+
+	/*
+	 * Orphans were reparented to init, but stay in the session created
+	 * for the application, even once its root exited.
+	 */
+	session = !root || root->sid == root->pid ? app_id : 0;
+
+	for (i = 0; i < nr; i++)
+		procs[i].in_app = procs[i].pid == app_id
+			|| (session && procs[i].sid == session);
+
+	/* descendants of the processes found so far */
+	do {
+		changed = 0;
+		for (i = 0; i < nr; i++) {
+			if (procs[i].in_app)
+				continue;
+			parent = find_app_proc(procs, nr, procs[i].ppid);
+			if (parent && parent->in_app) {
+				procs[i].in_app = 1;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	for (i = 0; i < nr; i++)
+		if (procs[i].in_app)
+			procs[nr_pids++].pid = procs[i].pid;
+
+	if (!nr_pids) {
+		free(procs);
+		errno = ESRCH;
+		return -1;
+	}
+
+	*pids = malloc(nr_pids * sizeof(**pids));
+	if (!*pids) {
+		free(procs);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < nr_pids; i++)
+		(*pids)[i] = procs[i].pid;
+	free(procs);
+
+	qsort(*pids, nr_pids, sizeof(pid_t), compare_pids);
+
+	return nr_pids;
+}
+
+struct migration_batch {
+	const pid_t *pids;
+	const int *nodes;
+	int nr_pids;
+	int next;
+	int nr_failed;
+};
+
+static void *migration_worker(void *arg)
+{
+	struct migration_batch *batch = arg;
+	migration_infos_t migration_infos;
+	int fd, i, r;
+
+	fd = open_kerrighed_services();
+
+	while ((i = __sync_fetch_and_add(&batch->next, 1)) < batch->nr_pids) {
+		migration_infos.process_to_migrate = batch->pids[i];
+		migration_infos.destination_node_id = batch->nodes[i];
+
+		if (fd == -1)
+			r = -1;
+		else
+			r = call_opened_kerrighed_services(
+				fd, KSYS_PROCESS_MIGRATION, &migration_infos);
+		if (r)
+			__sync_fetch_and_add(&batch->nr_failed, 1);
+	}
+
+	if (fd != -1)
+		close_kerrighed_services(fd);
+
+	return NULL;
+}
+
+int migrate_processes(const pid_t *pids, const int *nodes, int nr_pids)
+{
+	struct migration_batch batch;
+	pthread_t threads[MIGRATION_MAX_THREADS];
+	int i, nr_threads;
+
+	batch.pids = pids;
+	batch.nodes = nodes;
+	batch.nr_pids = nr_pids;
+	batch.next = 0;
+	batch.nr_failed = 0;
+
+	nr_threads = nr_pids;
+	if (nr_threads > MIGRATION_MAX_THREADS)
+		nr_threads = MIGRATION_MAX_THREADS;
+
+	/* the calling thread takes its share of the migrations too */
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, migration_worker, &batch))
+			break;
+	}
+	nr_threads = i;
+
+	migration_worker(&batch);
+
+	for (i = 1; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	return batch.nr_failed;
+}
+
+static int get_placement_nodes(const struct krg_placement *placement,
+			       int **nodes)
+{
+	struct krg_nodes *status;
+	int *array, node, nr = 0;
+
+	if (placement->nr_nodes && placement->nodes) {
+		array = malloc(placement->nr_nodes * sizeof(int));
+		if (!array)
+			goto err_nomem;
+
+		memcpy(array, placement->nodes,
+		       placement->nr_nodes * sizeof(int));
+		*nodes = array;
+		return placement->nr_nodes;
+	}
+
+	if (placement->policy == PLACEMENT_NODES)
+		goto err_inval;
+
+	if (placement->policy == PLACEMENT_PACK) {
+		array = malloc(sizeof(int));
+		if (!array)
+			goto err_nomem;
+
+		array[0] = get_node_id();
+		if (array[0] < 0) {
+			free(array);
+			return -1;
+		}
+		*nodes = array;
+		return 1;
+	}
+
+	if (kerrighed_max_nodes == -1 && krg_hotplug_init())
+		return -1;
+
+	status = krg_nodes_status();
+	if (!status)
+		return -1;
+
+	array = malloc(kerrighed_max_nodes * sizeof(int));
+	if (!array) {
+		krg_nodes_destroy(status);
+		goto err_nomem;
+	}
+
+	node = krg_nodes_next_online(status, -1);
+	while (node != -1) {
+		array[nr++] = node;
+		node = krg_nodes_next_online(status, node);
+	}
+	krg_nodes_destroy(status);
+
+	if (!nr) {
+		free(array);
+		goto err_inval;
+	}
+
+	*nodes = array;
+	return nr;
+
+err_inval:
+	errno = EINVAL;
+	return -1;
+err_nomem:
+	errno = ENOMEM;
+	return -1;
+}
+
+int application_place(const pid_t *pids, int nr_pids,
+		      const struct krg_placement *placement)
+{
+	int *nodes, *targets;
+	int i, nr_nodes, r;
+
+	if (placement->policy == PLACEMENT_NONE || !nr_pids)
+		return 0;
+
+	nr_nodes = get_placement_nodes(placement, &nodes);
+	if (nr_nodes < 0)
+		return -1;
+
+	targets = malloc(nr_pids * sizeof(int));
+	if (!targets) {
+		free(nodes);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < nr_pids; i++) {
+		if (placement->policy == PLACEMENT_PACK)
+			targets[i] = nodes[0];
+		else
+			targets[i] = nodes[i % nr_nodes];
+	}
+
+	r = migrate_processes(pids, targets, nr_pids);
+
+	free(targets);
+	free(nodes);
+
+	return r;
+}
+
+static int parse_node_list(const char *str, struct krg_placement *placement)
+{
+	const char *ptr = str;
+	char *endptr;
+	long first, last, node;
+	int *nodes;
+
+	while (*ptr) {
+		first = strtol(ptr, &endptr, 10);
+		if (endptr == ptr || first < 0)
+			goto err_inval;
+
+		last = first;
+		if (*endptr == '-') {
+			ptr = endptr + 1;
+			last = strtol(ptr, &endptr, 10);
+			if (endptr == ptr || last < first)
+				goto err_inval;
+		}
+
+		for (node = first; node <= last; node++) {
+			nodes = realloc(placement->nodes,
+					(placement->nr_nodes + 1) * sizeof(int));
+			if (!nodes) {
+				errno = ENOMEM;
+				return -1;
+			}
+
+			placement->nodes = nodes;
+			placement->nodes[placement->nr_nodes++] = node;
+		}
+
+		if (*endptr == ',')
+			endptr++;
+		else if (*endptr)
+			goto err_inval;
+		ptr = endptr;
+	}
+
+	return 0;
+
+err_inval:
+	errno = EINVAL;
+	return -1;
+}
+
+int krg_placement_parse(const char *str, struct krg_placement *placement)
+{
+	const char *nodes = NULL;
+
+	if (!strncmp(str, "pack", 4)) {
+		placement->policy = PLACEMENT_PACK;
+		nodes = str + 4;
+	} else if (!strncmp(str, "spread", 6)) {
+		placement->policy = PLACEMENT_SPREAD;
+		nodes = str + 6;
+	} else {
+		placement->policy = PLACEMENT_NODES;
+		return parse_node_list(str, placement);
+	}
+
+	if (*nodes == ':')
+		return parse_node_list(nodes + 1, placement);
+	else if (*nodes) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
 int application_set_userdata(__u64 data)
 {
 	int r = call_kerrighed_services(KSYS_APP_SET_USERDATA, &data);
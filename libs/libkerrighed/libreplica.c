@@ -0,0 +1,994 @@
+/* Checkpoint replication related interface functions.
+ * @file libreplica.c
+ *
+ * Copyright (C) 2010, Kerlabs
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+
+#include <types.h>
+#include <kerrighed_tools.h>
+#include <hotplug.h>
+#include <proc.h>
+#include <storage.h>
+
+#define CHKPT_MAX_TRANSPORTS 8
+
+#define REPLICA_MAGIC 0x4b524352	/* "KRCR" */
+
+enum replica_op {
+	REPLICA_PUT = 1,	/* client -> server: one file of the version */
+	REPLICA_COMMIT,		/* client -> server: version is complete */
+	REPLICA_ABORT,		/* client -> server: drop the version */
+	REPLICA_GET,		/* client -> server: send me the version */
+	REPLICA_END,		/* server -> client: status in size */
+};
+
+struct replica_msg {
+	uint32_t magic;
+	uint32_t op;
+	int64_t app_id;
+	int32_t chkpt_sn;
+	uint32_t name_len;
+	uint64_t size;
+};
+
+/*****************************************************************************/
+/*                                                                           */
+/*                                  HELPERS                                  */
+/*                                                                           */
+/*****************************************************************************/
+
+static int store_path(char *path, size_t size, const char *root,
+		      long app_id, int chkpt_sn, const char *suffix)
+{
+	int r;
+
+	r = snprintf(path, size, "%s/%ld/v%d%s", root, app_id, chkpt_sn,
+		     suffix);
+	if (r < 0 || r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* create <root>/<app_id>/v<chkpt_sn>.tmp, removing any leftover */
+static int store_create_tmp(char *tmp, size_t size, const char *root,
+			    long app_id, int chkpt_sn)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%ld", root, app_id);
+	if (mkdir(path, 0700) && errno != EEXIST)
+		return -1;
+
+	if (store_path(tmp, size, root, app_id, chkpt_sn, ".tmp"))
+		return -1;
+
+	chkpt_remove_dir(tmp);
+
+	return mkdir(tmp, 0700);
+}
+
+static int store_commit_tmp(const char *root, long app_id, int chkpt_sn)
+{
+	char tmp[PATH_MAX], path[PATH_MAX];
+
+	if (store_path(tmp, sizeof(tmp), root, app_id, chkpt_sn, ".tmp")
+	    || store_path(path, sizeof(path), root, app_id, chkpt_sn, ""))
+		return -1;
+
+	/* a new replica of the same version replaces the old one */
+	chkpt_remove_dir(path);
+
+	return rename(tmp, path);
+}
+
+static int node_address(const struct chkpt_transport *t, int node,
+			char *buf, size_t size)
+{
+	int r;
+
+	/* address has been checked to hold a single %d */
+	r = snprintf(buf, size, t->address, node);
+	if (r < 0 || r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int join_path(char *path, size_t size, const char *dir,
+		     const char *name)
+{
+	int r;
+
+	r = snprintf(path, size, "%s/%s", dir, name);
+	if (r < 0 || r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_file_name(const char *name)
+{
+	return name[0] && name[0] != '.' && !strchr(name, '/');
+}
+
+/*****************************************************************************/
+/*                                                                           */
+/*                              DIR TRANSPORT                                */
+/*                                                                           */
+/*****************************************************************************/
+
+struct dir_stream {
+	char root[PATH_MAX];
+	char tmp[PATH_MAX];
+	long app_id;
+	int chkpt_sn;
+};
+
+static void *dir_open(const struct chkpt_transport *t, int node,
+		      long app_id, int chkpt_sn)
+{
+	struct dir_stream *stream;
+
+	stream = malloc(sizeof(*stream));
+	if (!stream)
+		return NULL;
+
+	stream->app_id = app_id;
+	stream->chkpt_sn = chkpt_sn;
+
+	if (node_address(t, node, stream->root, sizeof(stream->root))
+	    || store_create_tmp(stream->tmp, sizeof(stream->tmp),
+				stream->root, app_id, chkpt_sn)) {
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+static int dir_send(void *_stream, const char *name, int fd, size_t size)
+{
+	struct dir_stream *stream = _stream;
+	char path[PATH_MAX];
+	int out_fd, r = -1;
+
+	if (join_path(path, sizeof(path), stream->tmp, name))
+		return -1;
+
+	out_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (out_fd == -1)
+		return -1;
+
+	if (chkpt_copy_fd(fd, out_fd, size, 0) == size)
+		r = fsync(out_fd);
+
+	if (close(out_fd))
+		r = -1;
+
+	return r;
+}
+
+static int dir_close(void *_stream, int commit)
+{
+	struct dir_stream *stream = _stream;
+	int r = 0;
+
+	if (commit)
+		r = store_commit_tmp(stream->root, stream->app_id,
+				     stream->chkpt_sn);
+	else
+		chkpt_remove_dir(stream->tmp);
+
+	free(stream);
+
+	return r;
+}
+
+static int dir_fetch(const struct chkpt_transport *t, int node,
+		     long app_id, int chkpt_sn, const char *dst)
+{
+	char root[PATH_MAX], path[PATH_MAX];
+	struct stat buf;
+
+	if (node_address(t, node, root, sizeof(root))
+	    || store_path(path, sizeof(path), root, app_id, chkpt_sn, ""))
+		return -1;
+
+	if (stat(path, &buf))
+		return -1;
+
+	return chkpt_copy_dir(path, dst, 0);
+}
+
+static const struct chkpt_transport_ops dir_transport_ops = {
+	.type = "dir",
+	.open = dir_open,
+	.send = dir_send,
+	.close = dir_close,
+	.fetch = dir_fetch,
+};
+
+/*****************************************************************************/
+/*                                                                           */
+/*                             UNIX TRANSPORT                                */
+/*                                                                           */
+/*****************************************************************************/
+
+struct unix_stream {
+	int sock;
+	long app_id;
+	int chkpt_sn;
+};
+
+static int unix_connect(const struct chkpt_transport *t, int node)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (node_address(t, node, addr.sun_path, sizeof(addr.sun_path)))
+		return -1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1)
+		return -1;
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static int send_msg(int sock, enum replica_op op, long app_id, int chkpt_sn,
+		    const char *name, uint64_t size)
+{
+	struct replica_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = REPLICA_MAGIC;
+	msg.op = op;
+	msg.app_id = app_id;
+	msg.chkpt_sn = chkpt_sn;
+	msg.name_len = name ? strlen(name) : 0;
+	msg.size = size;
+
+	if (krg_write_full(sock, &msg, sizeof(msg)) != sizeof(msg))
+		return -1;
+
+	if (msg.name_len
+	    && krg_write_full(sock, name, msg.name_len) != msg.name_len)
+		return -1;
+
+	return 0;
+}
+
+static int recv_msg(int sock, struct replica_msg *msg, char *name,
+		    size_t size)
+{
+	if (krg_read_full(sock, msg, sizeof(*msg)) != sizeof(*msg))
+		return -1;
+
+	if (msg->magic != REPLICA_MAGIC || msg->name_len >= size) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (krg_read_full(sock, name, msg->name_len) != msg->name_len)
+		return -1;
+	name[msg->name_len] = '\0';
+
+	return 0;
+}
+
+/* send size bytes of fd on sock without copying them in userspace */
+static int send_payload(int sock, int fd, uint64_t size)
+{
+	ssize_t r;
+
+	while (size) {
+		r = sendfile(sock, fd, NULL, size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (!r)
+				errno = EIO;
+			return -1;
+		}
+		size -= r;
+	}
+
+	return 0;
+}
+
+static int recv_payload(int sock, const char *path, uint64_t size)
+{
+	char buf[65536];
+	size_t len;
+	int fd, r = 0;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1)
+		return -1;
+
+	while (size && !r) {
+		len = size < sizeof(buf) ? size : sizeof(buf);
+		if (krg_read_full(sock, buf, len) != len
+		    || krg_write_full(fd, buf, len) != len)
+			r = -1;
+		size -= len;
+	}
+
+	if (!r)
+		r = fsync(fd);
+	if (close(fd))
+		r = -1;
+
+	return r;
+}
+
+static void *unix_open(const struct chkpt_transport *t, int node,
+		       long app_id, int chkpt_sn)
+{
+	struct unix_stream *stream;
+
+	stream = malloc(sizeof(*stream));
+	if (!stream)
+		return NULL;
+
+	stream->app_id = app_id;
+	stream->chkpt_sn = chkpt_sn;
+	stream->sock = unix_connect(t, node);
+	if (stream->sock == -1) {
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+static int unix_send(void *_stream, const char *name, int fd, size_t size)
+{
+	struct unix_stream *stream = _stream;
+
+	if (send_msg(stream->sock, REPLICA_PUT, stream->app_id,
+		     stream->chkpt_sn, name, size))
+		return -1;
+
+	return send_payload(stream->sock, fd, size);
+}
+
+static int unix_close(void *_stream, int commit)
+{
+	struct unix_stream *stream = _stream;
+	struct replica_msg msg;
+	char name[NAME_MAX + 1];
+	int r;
+
+	r = send_msg(stream->sock, commit ? REPLICA_COMMIT : REPLICA_ABORT,
+		     stream->app_id, stream->chkpt_sn, NULL, 0);
+
+	/* the replica is valid once the server says so */
+	if (!r && commit) {
+		r = recv_msg(stream->sock, &msg, name, sizeof(name));
+		if (!r && (msg.op != REPLICA_END || msg.size)) {
+			errno = EIO;
+			r = -1;
+		}
+	}
+
+	close(stream->sock);
+	free(stream);
+
+	return r;
+}
+
+static int unix_fetch(const struct chkpt_transport *t, int node,
+		      long app_id, int chkpt_sn, const char *dst)
+{
+	struct replica_msg msg;
+	char name[NAME_MAX + 1], path[PATH_MAX];
+	int sock, r;
+
+	sock = unix_connect(t, node);
+	if (sock == -1)
+		return -1;
+
+	r = send_msg(sock, REPLICA_GET, app_id, chkpt_sn, NULL, 0);
+
+	while (!r) {
+		r = recv_msg(sock, &msg, name, sizeof(name));
+		if (r)
+			break;
+
+		if (msg.op == REPLICA_END) {
+			if (msg.size) {
+				errno = ENOENT;
+				r = -1;
+			}
+			break;
+		}
+
+		if (msg.op != REPLICA_PUT || !valid_file_name(name)) {
+			errno = EPROTO;
+			r = -1;
+			break;
+		}
+
+		r = join_path(path, sizeof(path), dst, name);
+		if (!r)
+			r = recv_payload(sock, path, msg.size);
+	}
+
+	close(sock);
+
+	return r;
+}
+
+static const struct chkpt_transport_ops unix_transport_ops = {
+	.type = "unix",
+	.open = unix_open,
+	.send = unix_send,
+	.close = unix_close,
+	.fetch = unix_fetch,
+};
+
+/*****************************************************************************/
+/*                                                                           */
+/*                              REPLICA SERVER                               */
+/*                                                                           */
+/*****************************************************************************/
+
+struct replica_conn {
+	int sock;
+	const char *root;
+};
+
+static int serve_get(int sock, const char *root, long app_id, int chkpt_sn)
+{
+	char dir_path[PATH_MAX], path[PATH_MAX];
+	struct dirent *ent;
+	struct stat buf;
+	DIR *dir;
+	int fd, r = 0;
+
+	if (store_path(dir_path, sizeof(dir_path), root, app_id, chkpt_sn, ""))
+		return send_msg(sock, REPLICA_END, app_id, chkpt_sn, NULL, 1);
+
+	dir = opendir(dir_path);
+	if (!dir)
+		return send_msg(sock, REPLICA_END, app_id, chkpt_sn, NULL, 1);
+
+	while (!r && (ent = readdir(dir)) != NULL) {
+		if (join_path(path, sizeof(path), dir_path, ent->d_name))
+			continue;
+
+		fd = open(path, O_RDONLY);
+		if (fd == -1)
+			continue;
+
+		if (!fstat(fd, &buf) && S_ISREG(buf.st_mode)) {
+			r = send_msg(sock, REPLICA_PUT, app_id, chkpt_sn,
+				     ent->d_name, buf.st_size);
+			if (!r)
+				r = send_payload(sock, fd, buf.st_size);
+		}
+		close(fd);
+	}
+	closedir(dir);
+
+	if (r)
+		return r;
+
+	return send_msg(sock, REPLICA_END, app_id, chkpt_sn, NULL, 0);
+}
+
+static void *serve_conn(void *arg)
+{
+	struct replica_conn *conn = arg;
+	struct replica_msg msg;
+	char name[NAME_MAX + 1], tmp[PATH_MAX], path[PATH_MAX];
+	int r, receiving = 0;
+	long app_id = 0;
+	int chkpt_sn = 0;
+
+	while (!recv_msg(conn->sock, &msg, name, sizeof(name))) {
+		r = 0;
+
+		if (receiving && (msg.app_id != app_id
+				  || msg.chkpt_sn != chkpt_sn))
+			break;
+
+		switch (msg.op) {
+		case REPLICA_PUT:
+			if (!valid_file_name(name))
+				goto out;
+
+			if (!receiving) {
+				app_id = msg.app_id;
+				chkpt_sn = msg.chkpt_sn;
+				if (store_create_tmp(tmp, sizeof(tmp),
+						     conn->root, app_id,
+						     chkpt_sn))
+					goto out;
+				receiving = 1;
+			}
+
+			if (join_path(path, sizeof(path), tmp, name)
+			    || recv_payload(conn->sock, path, msg.size))
+				goto out;
+			break;
+		case REPLICA_COMMIT:
+			if (receiving)
+				r = store_commit_tmp(conn->root, app_id,
+						     chkpt_sn);
+			else
+				r = -1;
+			receiving = 0;
+
+			send_msg(conn->sock, REPLICA_END, msg.app_id,
+				 msg.chkpt_sn, NULL, r ? 1 : 0);
+			break;
+		case REPLICA_GET:
+			if (serve_get(conn->sock, conn->root, msg.app_id,
+				      msg.chkpt_sn))
+				goto out;
+			break;
+		case REPLICA_ABORT:
+		default:
+			goto out;
+		}
+	}
+
+out:
+	/* an incomplete version is never left in the store */
+	if (receiving)
+		chkpt_remove_dir(tmp);
+
+	close(conn->sock);
+	free(conn);
+
+	return NULL;
+}
+
+int chkpt_replica_serve(int listen_fd, const char *root)
+{
+	struct replica_conn *conn;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int sock;
+
+	/* a client leaving in the middle of a transfer is reported as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+		sock = accept(listen_fd, NULL, NULL);
+		if (sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		conn = malloc(sizeof(*conn));
+		if (!conn) {
+			close(sock);
+			continue;
+		}
+		conn->sock = sock;
+		conn->root = root;
+
+		/* parallel streams are served concurrently */
+		if (pthread_create(&thread, &attr, serve_conn, conn))
+			serve_conn(conn);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return -1;
+}
+
+/*****************************************************************************/
+/*                                                                           */
+/*                              EXPORTED FUNCTIONS                           */
+/*                                                                           */
+/*****************************************************************************/
+
+static const struct chkpt_transport_ops *transports[CHKPT_MAX_TRANSPORTS] = {
+	&dir_transport_ops,
+	&unix_transport_ops,
+};
+static int nr_transports = 2;
+
+int chkpt_transport_register(const struct chkpt_transport_ops *ops)
+{
+	if (nr_transports == CHKPT_MAX_TRANSPORTS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	transports[nr_transports++] = ops;
+
+	return 0;
+}
+
+int chkpt_transport_init(struct chkpt_transport *t, const char *spec)
+{
+	const char *address, *ptr;
+	size_t len;
+	int i, nr_conv = 0;
+
+	address = strchr(spec, ':');
+	if (!address || strlen(spec) >= sizeof(t->spec))
+		goto err_inval;
+
+	len = address - spec;
+	address++;
+
+	/* address is used as a format string: only one %d is allowed */
+	for (ptr = strchr(address, '%'); ptr; ptr = strchr(ptr + 2, '%')) {
+		if (ptr[1] != 'd')
+			goto err_inval;
+		nr_conv++;
+	}
+	if (nr_conv != 1)
+		goto err_inval;
+
+	for (i = 0; i < nr_transports; i++) {
+		if (strlen(transports[i]->type) == len
+		    && !strncmp(transports[i]->type, spec, len)) {
+			t->ops = transports[i];
+			strcpy(t->spec, spec);
+			strcpy(t->address, address);
+			return 0;
+		}
+	}
+
+err_inval:
+	errno = EINVAL;
+	return -1;
+}
+
+/* sort nodes by distance to local node, nearest first */
+static void sort_nodes(int *nodes, int nr, int local)
+{
+	int i, j, node;
+
+	for (i = 1; i < nr; i++) {
+		node = nodes[i];
+		for (j = i; j > 0 && abs(nodes[j - 1] - local)
+			     > abs(node - local); j--)
+			nodes[j] = nodes[j - 1];
+		nodes[j] = node;
+	}
+}
+
+static int get_online_nodes(int **nodes)
+{
+	struct krg_nodes *status;
+	int *array, node, nr = 0;
+
+	if (kerrighed_max_nodes == -1 && krg_hotplug_init())
+		return -1;
+
+	status = krg_nodes_status();
+	if (!status)
+		return -1;
+
+	array = malloc(kerrighed_max_nodes * sizeof(int));
+	if (!array) {
+		krg_nodes_destroy(status);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	node = krg_nodes_next_online(status, -1);
+	while (node != -1) {
+		array[nr++] = node;
+		node = krg_nodes_next_online(status, node);
+	}
+	krg_nodes_destroy(status);
+
+	*nodes = array;
+
+	return nr;
+}
+
+int chkpt_select_replica_nodes(int k, int **nodes)
+{
+	int *online, local, i, nr, nr_online;
+
+	local = get_node_id();
+	if (local < 0)
+		return -1;
+
+	nr_online = get_online_nodes(&online);
+	if (nr_online < 0)
+		return -1;
+
+	for (i = 0, nr = 0; i < nr_online; i++)
+		if (online[i] != local)
+			online[nr++] = online[i];
+
+	sort_nodes(online, nr, local);
+	if (nr > k)
+		nr = k;
+
+	*nodes = online;
+
+	return nr;
+}
+
+struct replica_job {
+	const struct chkpt_transport *t;
+	const char *dir;
+	long app_id;
+	int chkpt_sn;
+	int node;
+	int result;
+};
+
+static void *replica_worker(void *arg)
+{
+	struct replica_job *job = arg;
+	char path[PATH_MAX];
+	struct dirent *ent;
+	struct stat buf;
+	void *stream;
+	DIR *dir;
+	int fd, r = 0;
+
+	job->result = -1;
+
+	dir = opendir(job->dir);
+	if (!dir)
+		return NULL;
+
+	stream = job->t->ops->open(job->t, job->node, job->app_id,
+				   job->chkpt_sn);
+	if (!stream) {
+		closedir(dir);
+		return NULL;
+	}
+
+	while (!r && (ent = readdir(dir)) != NULL) {
+		if (join_path(path, sizeof(path), job->dir, ent->d_name))
+			continue;
+
+		fd = open(path, O_RDONLY);
+		if (fd == -1)
+			continue;
+
+		if (!fstat(fd, &buf) && S_ISREG(buf.st_mode))
+			r = job->t->ops->send(stream, ent->d_name, fd,
+					      buf.st_size);
+		close(fd);
+	}
+	closedir(dir);
+
+	job->result = job->t->ops->close(stream, !r);
+	if (r)
+		job->result = r;
+
+	return NULL;
+}
+
+static int write_replica_map(const struct chkpt_transport *t, long app_id,
+			     int chkpt_sn, const struct replica_job *jobs,
+			     int nr_jobs)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *file;
+	int i;
+
+	if (store_path(path, sizeof(path), CHKPT_DIR, app_id, chkpt_sn,
+		       ".replicas")
+	    || store_path(tmp, sizeof(tmp), CHKPT_DIR, app_id, chkpt_sn,
+			  ".replicas.tmp"))
+		return -1;
+
+	file = fopen(tmp, "w");
+	if (!file)
+		return -1;
+
+	for (i = 0; i < nr_jobs; i++)
+		if (!jobs[i].result)
+			fprintf(file, "%d %s\n", jobs[i].node, t->spec);
+
+	if (fclose(file)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return rename(tmp, path);
+}
+
+int chkpt_replicate_version(const struct chkpt_transport *t, long app_id,
+			    int chkpt_sn, const int *nodes, int nr_nodes)
+{
+	struct replica_job *jobs;
+	pthread_t *threads;
+	char dir[PATH_MAX];
+	int i, nr_threads, nr_valid = 0;
+
+	if (chkpt_version_dir(dir, sizeof(dir), app_id, chkpt_sn))
+		return -1;
+
+	jobs = calloc(nr_nodes, sizeof(*jobs));
+	threads = calloc(nr_nodes, sizeof(*threads));
+	if (!jobs || !threads) {
+		free(jobs);
+		free(threads);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < nr_nodes; i++) {
+		jobs[i].t = t;
+		jobs[i].dir = dir;
+		jobs[i].app_id = app_id;
+		jobs[i].chkpt_sn = chkpt_sn;
+		jobs[i].node = nodes[i];
+	}
+
+	/* one stream per target node */
+	for (nr_threads = 0; nr_threads < nr_nodes; nr_threads++)
+		if (pthread_create(&threads[nr_threads], NULL, replica_worker,
+				   &jobs[nr_threads]))
+			break;
+
+	for (i = nr_threads; i < nr_nodes; i++)
+		replica_worker(&jobs[i]);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < nr_nodes; i++)
+		if (!jobs[i].result)
+			nr_valid++;
+
+	if (write_replica_map(t, app_id, chkpt_sn, jobs, nr_nodes))
+		nr_valid = -1;
+
+	free(threads);
+	free(jobs);
+
+	return nr_valid;
+}
+
+/* nodes holding a replica according to the map, -1 if there is no map */
+static int read_replica_map(long app_id, int chkpt_sn, int **nodes)
+{
+	char path[PATH_MAX], line[PATH_MAX + 16];
+	int *array = NULL, *tmp, node, nr = 0;
+	FILE *file;
+
+	if (store_path(path, sizeof(path), CHKPT_DIR, app_id, chkpt_sn,
+		       ".replicas"))
+		return -1;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%d", &node) != 1)
+			continue;
+
+		tmp = realloc(array, (nr + 1) * sizeof(int));
+		if (!tmp) {
+			free(array);
+			fclose(file);
+			return -1;
+		}
+		array = tmp;
+		array[nr++] = node;
+	}
+	fclose(file);
+
+	*nodes = array;
+
+	return nr;
+}
+
+int chkpt_fetch_replica(const struct chkpt_transport *t, long app_id,
+			int chkpt_sn)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int *online, *candidates, local, i, j, nr, nr_online;
+	int node = -1;
+
+	local = get_node_id();
+	if (local < 0)
+		return -1;
+
+	nr_online = get_online_nodes(&online);
+	if (nr_online < 0)
+		return -1;
+
+	/* without a map, any online node may hold a replica */
+	nr = read_replica_map(app_id, chkpt_sn, &candidates);
+	if (nr < 0) {
+		candidates = online;
+		nr = nr_online;
+		online = NULL;
+	} else {
+		for (i = 0, j = 0; i < nr; i++) {
+			int k;
+
+			for (k = 0; k < nr_online; k++)
+				if (online[k] == candidates[i])
+					break;
+
+			/* failed nodes are not online anymore */
+			if (k < nr_online)
+				candidates[j++] = candidates[i];
+		}
+		nr = j;
+	}
+
+	sort_nodes(candidates, nr, local);
+
+	snprintf(path, sizeof(path), "%s/%ld", CHKPT_DIR, app_id);
+	if (mkdir(path, 0700) && errno != EEXIST)
+		goto out;
+
+	if (store_path(path, sizeof(path), CHKPT_DIR, app_id, chkpt_sn, "")
+	    || store_path(tmp, sizeof(tmp), CHKPT_DIR, app_id, chkpt_sn,
+			  ".tmp"))
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		chkpt_remove_dir(tmp);
+		if (mkdir(tmp, 0700))
+			break;
+
+		if (!t->ops->fetch(t, candidates[i], app_id, chkpt_sn, tmp)
+		    && !rename(tmp, path)) {
+			node = candidates[i];
+			break;
+		}
+	}
+	chkpt_remove_dir(tmp);
+
+	/* restart --latest finds fetched versions in the index */
+	if (node != -1)
+		chkpt_index_add(app_id, chkpt_sn);
+
+	if (node == -1 && i == nr)
+		errno = ENOENT;
+
+out:
+	free(candidates);
+	free(online);
+
+	return node;
+}
@@ -0,0 +1,1078 @@
+/* Checkpoint storage related interface functions.
+ * @file libstorage.c
+ *
+ * Copyright (C) 2010, Kerlabs
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+
+#include <proc.h>
+#include <storage.h>
+
+/* Size of the chunks copied between two bandwidth checks */
+#define CHKPT_COPY_CHUNK (1 << 20)
+
+enum copy_method {
+	COPY_FILE_RANGE,
+	COPY_SENDFILE,
+	COPY_READ_WRITE,
+};
+
+const char *chkpt_location_str(enum chkpt_location loc)
+{
+	static const char *str[] = { "unknown", "local", "draining",
+				     "shared", "evicted" };
+
+	if (loc < CHKPT_LOCATION_UNKNOWN || loc > CHKPT_LOCATION_EVICTED)
+		loc = CHKPT_LOCATION_UNKNOWN;
+
+	return str[loc];
+}
+
+static enum chkpt_location location_from_str(const char *s)
+{
+	enum chkpt_location loc;
+
+	for (loc = CHKPT_LOCATION_LOCAL; loc <= CHKPT_LOCATION_EVICTED; loc++)
+		if (!strcmp(s, chkpt_location_str(loc)))
+			return loc;
+
+	return CHKPT_LOCATION_UNKNOWN;
+}
+
+int chkpt_version_dir(char *path, size_t size, long app_id, int chkpt_sn)
+{
+	int r;
+
+	r = snprintf(path, size, "%s/%ld/v%d", CHKPT_DIR, app_id, chkpt_sn);
+	if (r < 0 || r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int location_file(char *path, size_t size, long app_id, int chkpt_sn)
+{
+	int r;
+
+	r = snprintf(path, size, "%s/%ld/v%d.location", CHKPT_DIR, app_id,
+		     chkpt_sn);
+	if (r < 0 || r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+enum chkpt_location chkpt_get_location(long app_id, int chkpt_sn,
+				       char *shared_path, size_t size)
+{
+	char path[PATH_MAX], state[32], shared[PATH_MAX];
+	struct stat buf;
+	FILE *file;
+	enum chkpt_location loc = CHKPT_LOCATION_UNKNOWN;
+
+	if (shared_path && size)
+		shared_path[0] = '\0';
+
+	if (location_file(path, sizeof(path), app_id, chkpt_sn))
+		return CHKPT_LOCATION_UNKNOWN;
+
+	file = fopen(path, "r");
+	if (!file) {
+		/* never drained: the version is local if it exists */
+		if (chkpt_version_dir(path, sizeof(path), app_id, chkpt_sn)
+		    || stat(path, &buf))
+			return CHKPT_LOCATION_UNKNOWN;
+
+		return CHKPT_LOCATION_LOCAL;
+	}
+
+	shared[0] = '\0';
+	if (fscanf(file, "%31s %4095s", state, shared) >= 1)
+		loc = location_from_str(state);
+	fclose(file);
+
+	if (shared_path && size) {
+		strncpy(shared_path, shared, size - 1);
+		shared_path[size - 1] = '\0';
+	}
+
+	return loc;
+}
+
+int chkpt_set_location(long app_id, int chkpt_sn, enum chkpt_location loc,
+		       const char *shared_path)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *file;
+	int r;
+
+	if (location_file(path, sizeof(path), app_id, chkpt_sn))
+		return -1;
+
+	r = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (r < 0 || r >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	file = fopen(tmp, "w");
+	if (!file)
+		return -1;
+
+	fprintf(file, "%s %s\n", chkpt_location_str(loc),
+		shared_path ? shared_path : "-");
+
+	if (fclose(file)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	/* readers never see a partially written location */
+	r = rename(tmp, path);
+	if (r)
+		unlink(tmp);
+
+	return r;
+}
+
+static ssize_t copy_chunk(int in_fd, int out_fd, size_t len,
+			  enum copy_method *method)
+{
+	char buf[65536];
+	ssize_t r, w, done;
+
+	switch (*method) {
+	case COPY_FILE_RANGE:
+#ifdef __NR_copy_file_range
+		r = syscall(__NR_copy_file_range, in_fd, NULL, out_fd, NULL,
+			    len, 0);
+		if (r >= 0)
+			return r;
+		if (errno != ENOSYS && errno != EXDEV && errno != EINVAL
+		    && errno != EOPNOTSUPP)
+			return -1;
+#endif
+		*method = COPY_SENDFILE;
+		/* fall through */
+	case COPY_SENDFILE:
+		r = sendfile(out_fd, in_fd, NULL, len);
+		if (r >= 0)
+			return r;
+		if (errno != ENOSYS && errno != EINVAL)
+			return -1;
+
+		*method = COPY_READ_WRITE;
+		/* fall through */
+	case COPY_READ_WRITE:
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+
+		r = read(in_fd, buf, len);
+		if (r <= 0)
+			return r;
+
+		for (done = 0; done < r; done += w) {
+			w = write(out_fd, buf + done, r - done);
+			if (w < 0)
+				return -1;
+		}
+		return r;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static void throttle(const struct timeval *start, size_t copied,
+		     unsigned long bwlimit)
+{
+	struct timeval now;
+	struct timespec delay;
+	double expected, elapsed;
+
+	if (!bwlimit)
+		return;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - start->tv_sec)
+		+ (now.tv_usec - start->tv_usec) / 1000000.0;
+	expected = (double)copied / bwlimit;
+
+	if (expected <= elapsed)
+		return;
+
+	delay.tv_sec = (time_t)(expected - elapsed);
+	delay.tv_nsec = (long)((expected - elapsed - delay.tv_sec) * 1e9);
+	while (nanosleep(&delay, &delay) && errno == EINTR);
+}
+
+ssize_t chkpt_copy_fd(int in_fd, int out_fd, size_t size,
+		      unsigned long bwlimit)
+{
+	enum copy_method method = COPY_FILE_RANGE;
+	struct timeval start;
+	size_t copied = 0, len;
+	ssize_t r;
+
+	gettimeofday(&start, NULL);
+
+	while (copied < size) {
+		len = size - copied;
+		if (len > CHKPT_COPY_CHUNK)
+			len = CHKPT_COPY_CHUNK;
+
+		r = copy_chunk(in_fd, out_fd, len, &method);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!r)
+			/* file shrunk while copying */
+			break;
+
+		copied += r;
+		throttle(&start, copied, bwlimit);
+	}
+
+	return copied;
+}
+
+static int copy_file(const char *src, const char *dst,
+		     unsigned long bwlimit)
+{
+	struct stat buf;
+	int in_fd, out_fd, r = -1;
+
+	in_fd = open(src, O_RDONLY);
+	if (in_fd == -1)
+		return -1;
+
+	if (fstat(in_fd, &buf))
+		goto out_in;
+
+	out_fd = open(dst, O_WRONLY|O_CREAT|O_TRUNC, buf.st_mode & 0777);
+	if (out_fd == -1)
+		goto out_in;
+
+	if (chkpt_copy_fd(in_fd, out_fd, buf.st_size, bwlimit) == -1)
+		goto out_out;
+
+	r = fsync(out_fd);
+
+out_out:
+	if (close(out_fd))
+		r = -1;
+out_in:
+	close(in_fd);
+	return r;
+}
+
+int chkpt_copy_dir(const char *src, const char *dst, unsigned long bwlimit)
+{
+	char src_path[PATH_MAX], dst_path[PATH_MAX];
+	struct dirent *ent;
+	struct stat buf;
+	DIR *dir;
+	int r = 0;
+
+	dir = opendir(src);
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir)) != NULL) {
+		snprintf(src_path, sizeof(src_path), "%s/%s", src,
+			 ent->d_name);
+		snprintf(dst_path, sizeof(dst_path), "%s/%s", dst,
+			 ent->d_name);
+
+		if (stat(src_path, &buf) || !S_ISREG(buf.st_mode))
+			continue;
+
+		r = copy_file(src_path, dst_path, bwlimit);
+		if (r)
+			break;
+	}
+	closedir(dir);
+
+	return r;
+}
+
+int chkpt_remove_dir(const char *path)
+{
+	char file_path[PATH_MAX];
+	struct dirent *ent;
+	struct stat buf;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir)) != NULL) {
+		snprintf(file_path, sizeof(file_path), "%s/%s", path,
+			 ent->d_name);
+
+		if (lstat(file_path, &buf) || S_ISDIR(buf.st_mode))
+			continue;
+
+		if (unlink(file_path)) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+
+	return rmdir(path);
+}
+
+int chkpt_drain_version(long app_id, int chkpt_sn, const char *shared_root,
+			unsigned long bwlimit, int evict)
+{
+	char local[PATH_MAX], shared[PATH_MAX], tmp[PATH_MAX];
+	char old[PATH_MAX], link[PATH_MAX];
+	struct stat buf;
+	int r;
+
+	if (chkpt_version_dir(local, sizeof(local), app_id, chkpt_sn))
+		return -1;
+
+	r = snprintf(old, sizeof(old), "%s.old", local);
+	if (r >= 0 && r < sizeof(old))
+		r = snprintf(link, sizeof(link), "%s.lnk", local);
+	if (r < 0 || r >= sizeof(link)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	/* leftover of an evict interrupted between its renames */
+	if (lstat(local, &buf) && errno == ENOENT && !lstat(old, &buf))
+		rename(old, local);
+
+	snprintf(shared, sizeof(shared), "%s/%ld", shared_root, app_id);
+	if (mkdir(shared, 0700) && errno != EEXIST)
+		return -1;
+
+	snprintf(shared, sizeof(shared), "%s/%ld/v%d", shared_root, app_id,
+		 chkpt_sn);
+	r = snprintf(tmp, sizeof(tmp), "%s.tmp", shared);
+	if (r < 0 || r >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	r = chkpt_set_location(app_id, chkpt_sn, CHKPT_LOCATION_DRAINING,
+			       shared);
+	if (r)
+		return r;
+
+	/* leftover of an interrupted drain */
+	chkpt_remove_dir(tmp);
+
+	r = mkdir(tmp, 0700);
+	if (r)
+		goto err;
+
+	r = chkpt_copy_dir(local, tmp, bwlimit);
+	if (r)
+		goto err_tmp;
+
+	/* the shared copy appears only once complete */
+	r = rename(tmp, shared);
+	if (r)
+		goto err_tmp;
+
+	if (!evict)
+		return chkpt_set_location(app_id, chkpt_sn,
+					  CHKPT_LOCATION_SHARED, shared);
+
+	/*
+	 * The local copy is removed only once the link replaced it: it is
+	 * renamed aside, and back if the link cannot take its place.
+	 */
+	unlink(link);
+	r = symlink(shared, link);
+	if (r)
+		goto err_evict;
+
+	r = rename(local, old);
+	if (r) {
+		unlink(link);
+		goto err_evict;
+	}
+
+	r = rename(link, local);
+	if (r) {
+		rename(old, local);
+		unlink(link);
+		goto err_evict;
+	}
+
+	chkpt_remove_dir(old);
+
+	return chkpt_set_location(app_id, chkpt_sn, CHKPT_LOCATION_EVICTED,
+				  shared);
+
+err_evict:
+	/* the shared copy is still complete and valid */
+	chkpt_set_location(app_id, chkpt_sn, CHKPT_LOCATION_SHARED, shared);
+	return r;
+
+err_tmp:
+	chkpt_remove_dir(tmp);
+err:
+	chkpt_set_location(app_id, chkpt_sn, CHKPT_LOCATION_LOCAL, NULL);
+	return -1;
+}
+
+/*****************************************************************************/
+/*                                                                           */
+/*                               STORAGE ROOTS                               */
+/*                                                                           */
+/*****************************************************************************/
+
+static int root_index(const struct chkpt_roots *roots, const char *path)
+{
+	int i;
+
+	for (i = 0; i < roots->nr_roots; i++)
+		if (!strcmp(roots->root[i], path))
+			return i;
+
+	return -1;
+}
+
+static int add_root(struct chkpt_roots *roots, const char *path)
+{
+	int i;
+
+	i = root_index(roots, path);
+	if (i != -1)
+		return i;
+
+	if (roots->nr_roots == CHKPT_MAX_ROOTS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	if (strlen(path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(roots->root[roots->nr_roots], path);
+
+	return roots->nr_roots++;
+}
+
+static int parse_policy(const char *str, enum chkpt_root_policy *policy)
+{
+	if (!strcmp(str, "round-robin"))
+		*policy = CHKPT_ROOT_ROUND_ROBIN;
+	else if (!strcmp(str, "most-free"))
+		*policy = CHKPT_ROOT_MOST_FREE;
+	else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int chkpt_roots_pin(struct chkpt_roots *roots, long app_id, const char *path)
+{
+	struct chkpt_root_pin *pins;
+	int i;
+
+	i = add_root(roots, path);
+	if (i == -1)
+		return -1;
+
+	pins = realloc(roots->pins, (roots->nr_pins + 1) * sizeof(*pins));
+	if (!pins)
+		return -1;
+
+	roots->pins = pins;
+	roots->pins[roots->nr_pins].app_id = app_id;
+	roots->pins[roots->nr_pins].root = i;
+	roots->nr_pins++;
+
+	return 0;
+}
+
+static int load_env_roots(struct chkpt_roots *roots, const char *env)
+{
+	char *list, *path, *saveptr;
+	int r = 0;
+
+	list = strdup(env);
+	if (!list)
+		return -1;
+
+	for (path = strtok_r(list, ":", &saveptr); path && !r;
+	     path = strtok_r(NULL, ":", &saveptr))
+		if (add_root(roots, path) == -1)
+			r = -1;
+
+	free(list);
+
+	return r;
+}
+
+static int override_roots(struct chkpt_roots *roots, const char *env)
+{
+	char (*old)[PATH_MAX];
+	int i, r;
+
+	old = malloc(sizeof(roots->root));
+	if (!old)
+		return -1;
+	memcpy(old, roots->root, sizeof(roots->root));
+
+	roots->nr_roots = 0;
+	r = load_env_roots(roots, env);
+
+	/* pinned roots stay known */
+	for (i = 0; !r && i < roots->nr_pins; i++) {
+		roots->pins[i].root = add_root(roots, old[roots->pins[i].root]);
+		if (roots->pins[i].root == -1)
+			r = -1;
+	}
+
+	free(old);
+
+	return r;
+}
+
+int chkpt_roots_load(struct chkpt_roots *roots, const char *conf)
+{
+	char line[PATH_MAX + 64], key[16], arg[PATH_MAX], path[PATH_MAX];
+	const char *env;
+	FILE *file;
+	long app_id;
+	int r = 0;
+
+	memset(roots, 0, sizeof(*roots));
+	roots->policy = CHKPT_ROOT_MOST_FREE;
+
+	file = fopen(conf ? conf : CHKPT_ROOTS_CONF, "r");
+	if (!file && errno != ENOENT)
+		return -1;
+
+	while (file && !r && fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%15s", key) != 1 || key[0] == '#')
+			continue;
+
+		if (!strcmp(key, "root")
+		    && sscanf(line, "%*s %4095s", arg) == 1)
+			r = add_root(roots, arg) == -1 ? -1 : 0;
+		else if (!strcmp(key, "policy")
+			 && sscanf(line, "%*s %4095s", arg) == 1)
+			r = parse_policy(arg, &roots->policy);
+		else if (!strcmp(key, "pin")
+			 && sscanf(line, "%*s %ld %4095s", &app_id, path) == 2)
+			r = chkpt_roots_pin(roots, app_id, path);
+		else {
+			errno = EINVAL;
+			r = -1;
+		}
+	}
+	if (file)
+		fclose(file);
+
+	env = getenv("KRG_CHKPT_ROOTS");
+	if (!r && env && *env)
+		r = override_roots(roots, env);
+
+	env = getenv("KRG_CHKPT_POLICY");
+	if (!r && env && *env)
+		r = parse_policy(env, &roots->policy);
+
+	if (r)
+		chkpt_roots_free(roots);
+
+	return r;
+}
+
+void chkpt_roots_free(struct chkpt_roots *roots)
+{
+	free(roots->pins);
+	roots->pins = NULL;
+	roots->nr_pins = 0;
+	roots->nr_roots = 0;
+}
+
+static int lock_index(void)
+{
+	int fd;
+
+	fd = open(CHKPT_ROOTS_INDEX, O_RDWR|O_CREAT|O_APPEND, 0644);
+	if (fd == -1)
+		return -1;
+
+	if (lockf(fd, F_LOCK, 0)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void unlock_index(int fd)
+{
+	lseek(fd, 0, SEEK_SET);
+	lockf(fd, F_ULOCK, 0);
+	close(fd);
+}
+
+/* number of applications placed so far, used for round-robin */
+static int count_placements(int fd)
+{
+	char buf[4096];
+	ssize_t r;
+	int i, nr = 0;
+
+	lseek(fd, 0, SEEK_SET);
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < r; i++)
+			if (buf[i] == '\n')
+				nr++;
+
+	return nr;
+}
+
+static int select_root(const struct chkpt_roots *roots, long app_id,
+		       int index_fd)
+{
+	unsigned long long avail, best_avail = 0;
+	struct statvfs buf;
+	int i, best = -1;
+
+	if (!roots->nr_roots) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	for (i = roots->nr_pins - 1; i >= 0; i--)
+		if (roots->pins[i].app_id == app_id)
+			return roots->pins[i].root;
+
+	if (roots->policy == CHKPT_ROOT_ROUND_ROBIN)
+		return count_placements(index_fd) % roots->nr_roots;
+
+	for (i = 0; i < roots->nr_roots; i++) {
+		if (statvfs(roots->root[i], &buf))
+			continue;
+
+		avail = (unsigned long long)buf.f_bavail * buf.f_frsize;
+		if (best == -1 || avail > best_avail) {
+			best = i;
+			best_avail = avail;
+		}
+	}
+
+	if (best == -1)
+		errno = ENOENT;
+
+	return best;
+}
+
+int chkpt_root_select(const struct chkpt_roots *roots, long app_id)
+{
+	int fd, r;
+
+	fd = lock_index();
+	if (fd == -1)
+		return -1;
+
+	r = select_root(roots, app_id, fd);
+	unlock_index(fd);
+
+	return r;
+}
+
+static int move_entry(const char *src, const char *dst)
+{
+	char link[PATH_MAX];
+	struct stat buf;
+	ssize_t len;
+
+	if (!rename(src, dst))
+		return 0;
+	if (errno != EXDEV || lstat(src, &buf))
+		return -1;
+
+	if (S_ISLNK(buf.st_mode)) {
+		len = readlink(src, link, sizeof(link) - 1);
+		if (len < 0)
+			return -1;
+		link[len] = '\0';
+		if (symlink(link, dst))
+			return -1;
+		return unlink(src);
+	}
+
+	if (S_ISDIR(buf.st_mode)) {
+		if (mkdir(dst, buf.st_mode & 0777) && errno != EEXIST)
+			return -1;
+		if (chkpt_copy_dir(src, dst, 0))
+			return -1;
+		return chkpt_remove_dir(src);
+	}
+
+	if (copy_file(src, dst, 0))
+		return -1;
+
+	return unlink(src);
+}
+
+/* Move what the kernel already wrote in CHKPT_DIR/<app_id> to root */
+static int move_app_dir(const char *app_dir, const char *root_dir)
+{
+	char src[PATH_MAX], dst[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+	int r = 0;
+
+	dir = opendir(app_dir);
+	if (!dir)
+		return -1;
+
+	while (!r && (ent = readdir(dir)) != NULL) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		if (snprintf(src, sizeof(src), "%s/%s", app_dir,
+			     ent->d_name) >= sizeof(src)
+		    || snprintf(dst, sizeof(dst), "%s/%s", root_dir,
+				ent->d_name) >= sizeof(dst)) {
+			errno = ENAMETOOLONG;
+			r = -1;
+			break;
+		}
+		r = move_entry(src, dst);
+	}
+	closedir(dir);
+
+	if (!r)
+		r = rmdir(app_dir);
+
+	return r;
+}
+
+int chkpt_place_app(const struct chkpt_roots *roots, long app_id)
+{
+	char app_dir[PATH_MAX], root_dir[PATH_MAX];
+	struct stat buf;
+	int fd, i, r;
+
+	fd = lock_index();
+	if (fd == -1)
+		return -1;
+
+	snprintf(app_dir, sizeof(app_dir), "%s/%ld", CHKPT_DIR, app_id);
+
+	r = lstat(app_dir, &buf);
+	if (!r && S_ISLNK(buf.st_mode))
+		/* already placed */
+		goto out;
+	if (r && errno != ENOENT)
+		goto err;
+
+	i = select_root(roots, app_id, fd);
+	if (i == -1)
+		goto err;
+
+	if (snprintf(root_dir, sizeof(root_dir), "%s/%ld", roots->root[i],
+		     app_id) >= sizeof(root_dir)) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+	if (mkdir(root_dir, 0755) && errno != EEXIST)
+		goto err;
+
+	if (!r && move_app_dir(app_dir, root_dir))
+		goto err;
+
+	if (symlink(root_dir, app_dir))
+		goto err;
+
+	dprintf(fd, "%ld %s\n", app_id, roots->root[i]);
+
+out:
+	unlock_index(fd);
+	return 0;
+
+err:
+	unlock_index(fd);
+	return -1;
+}
+
+int chkpt_resolve_version(long app_id, int chkpt_sn, char *path, size_t size)
+{
+	char line[PATH_MAX + 32], root[PATH_MAX], found[PATH_MAX];
+	struct stat buf;
+	FILE *file;
+	long id;
+	int r;
+
+	strcpy(found, CHKPT_DIR);
+
+	/* the last placement of the application wins */
+	file = fopen(CHKPT_ROOTS_INDEX, "r");
+	if (file) {
+		while (fgets(line, sizeof(line), file))
+			if (sscanf(line, "%ld %4095s", &id, root) == 2
+			    && id == app_id)
+				strcpy(found, root);
+		fclose(file);
+	}
+
+	r = snprintf(path, size, "%s/%ld/v%d", found, app_id, chkpt_sn);
+	if (r < 0 || r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return stat(path, &buf);
+}
+
+/*****************************************************************************/
+/*                                                                           */
+/*                               VERSION INDEX                               */
+/*                                                                           */
+/*****************************************************************************/
+
+static int index_file(char *path, size_t size, long app_id)
+{
+	int r;
+
+	r = snprintf(path, size, "%s/%ld/versions", CHKPT_DIR, app_id);
+	if (r < 0 || r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int add_version(int **versions, int *nr, int *max, int chkpt_sn)
+{
+	int *tmp;
+
+	if (*nr == *max) {
+		*max = *max ? *max * 2 : 16;
+		tmp = realloc(*versions, *max * sizeof(int));
+		if (!tmp)
+			return -1;
+		*versions = tmp;
+	}
+
+	(*versions)[(*nr)++] = chkpt_sn;
+
+	return 0;
+}
+
+static int read_index(FILE *file, int **versions, int *nr, int *max)
+{
+	int sn, r = 0;
+
+	while (!r && fscanf(file, "%d", &sn) == 1)
+		r = add_version(versions, nr, max, sn);
+
+	return r;
+}
+
+static int scan_versions(long app_id, int **versions, int *nr, int *max)
+{
+	char path[PATH_MAX], *end;
+	struct dirent *ent;
+	DIR *dir;
+	long sn;
+	int r = 0;
+
+	snprintf(path, sizeof(path), "%s/%ld", CHKPT_DIR, app_id);
+
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while (!r && (ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] != 'v')
+			continue;
+
+		sn = strtol(ent->d_name + 1, &end, 10);
+		if (end != ent->d_name + 1 && !*end && sn > 0)
+			r = add_version(versions, nr, max, sn);
+	}
+	closedir(dir);
+
+	return r;
+}
+
+static int cmp_newest_first(const void *a, const void *b)
+{
+	return *(const int *)b - *(const int *)a;
+}
+
+/* sort newest first and drop duplicates, return the new number */
+static int sort_versions(int *versions, int nr)
+{
+	int i, j;
+
+	qsort(versions, nr, sizeof(int), cmp_newest_first);
+
+	for (i = 0, j = 0; i < nr; i++)
+		if (!j || versions[j - 1] != versions[i])
+			versions[j++] = versions[i];
+
+	return j;
+}
+
+/*
+ * The index gets the mtime the directory had before it was last scanned:
+ * a directory newer than its index holds versions written without
+ * chkpt_index_add(), by library users or before the index existed.
+ */
+static int index_outdated(long app_id, FILE *file)
+{
+	char path[PATH_MAX];
+	struct stat dir, index;
+
+	snprintf(path, sizeof(path), "%s/%ld", CHKPT_DIR, app_id);
+
+	if (stat(path, &dir) || fstat(fileno(file), &index))
+		return 1;
+
+	if (dir.st_mtim.tv_sec != index.st_mtim.tv_sec)
+		return dir.st_mtim.tv_sec > index.st_mtim.tv_sec;
+
+	return dir.st_mtim.tv_nsec > index.st_mtim.tv_nsec;
+}
+
+/* append chkpt_sn and the versions of the directory missing in file */
+static int complete_index(FILE *file, long app_id, int chkpt_sn)
+{
+	int *indexed = NULL, *found = NULL;
+	int nr_indexed = 0, max_indexed = 0, nr_found = 0, max_found = 0;
+	char line[16];
+	int i, len, r;
+
+	r = read_index(file, &indexed, &nr_indexed, &max_indexed);
+	if (!r)
+		r = add_version(&found, &nr_found, &max_found, chkpt_sn);
+	if (!r)
+		r = scan_versions(app_id, &found, &nr_found, &max_found);
+	if (r)
+		goto out;
+
+	nr_indexed = sort_versions(indexed, nr_indexed);
+	nr_found = sort_versions(found, nr_found);
+
+	for (i = 0; !r && i < nr_found; i++) {
+		if (bsearch(&found[i], indexed, nr_indexed, sizeof(int),
+			    cmp_newest_first))
+			continue;
+
+		/* a single short write is never interleaved with another
+		 * one */
+		len = snprintf(line, sizeof(line), "%d\n", found[i]);
+		if (write(fileno(file), line, len) != len)
+			r = -1;
+	}
+
+out:
+	free(indexed);
+	free(found);
+
+	return r;
+}
+
+int chkpt_index_add(long app_id, int chkpt_sn)
+{
+	char path[PATH_MAX], dir_path[PATH_MAX];
+	struct timespec times[2];
+	struct stat dir;
+	FILE *file;
+	int fd, r;
+
+	if (index_file(path, sizeof(path), app_id))
+		return -1;
+
+	fd = open(path, O_RDWR|O_APPEND|O_CREAT, 0644);
+	if (fd == -1)
+		return -1;
+
+	file = fdopen(fd, "a+");
+	if (!file) {
+		close(fd);
+		return -1;
+	}
+
+	/* versions written after this stat outdate the index */
+	snprintf(dir_path, sizeof(dir_path), "%s/%ld", CHKPT_DIR, app_id);
+	r = stat(dir_path, &dir);
+	if (!r)
+		r = complete_index(file, app_id, chkpt_sn);
+
+	if (!r) {
+		times[0].tv_nsec = UTIME_OMIT;
+		times[1] = dir.st_mtim;
+		r = futimens(fd, times);
+	}
+
+	if (fclose(file))
+		r = -1;
+
+	return r;
+}
+
+int chkpt_index_versions(long app_id, int **versions)
+{
+	char path[PATH_MAX];
+	FILE *file;
+	int *array = NULL, nr = 0, max = 0, r = 0;
+
+	if (index_file(path, sizeof(path), app_id))
+		return -1;
+
+	file = fopen(path, "r");
+	if (file) {
+		r = read_index(file, &array, &nr, &max);
+		if (!r && index_outdated(app_id, file))
+			r = scan_versions(app_id, &array, &nr, &max);
+		fclose(file);
+	} else if (errno == ENOENT) {
+		/* checkpoints taken before the index existed */
+		r = scan_versions(app_id, &array, &nr, &max);
+	} else
+		r = -1;
+
+	if (r) {
+		free(array);
+		return -1;
+	}
+
+	*versions = array;
+
+	return sort_versions(array, nr);
+}
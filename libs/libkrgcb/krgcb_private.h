@@ -0,0 +1,19 @@
+/** Kerrighed Callback-Library Interface
+ *  @file krgcb_private.h
+ *
+ *  Helpers of libkrgcb shared with libkrgcheckpoint only, kept out of
+ *  libkrgcb.h so that clients do not get <signal.h>.
+ */
+
+#ifndef KRGCB_PRIVATE_H
+#define KRGCB_PRIVATE_H
+
+#include <signal.h>
+
+/* block the signals carrying requests in the calling thread, saving its
+ * mask in oldset, around updates of data read by callbacks run out of
+ * signal handlers; cr_callback_unblock() restores the mask */
+int cr_callback_block(sigset_t *oldset);
+int cr_callback_unblock(const sigset_t *oldset);
+
+#endif /* KRGCB_PRIVATE_H */
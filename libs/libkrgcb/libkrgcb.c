@@ -4,8 +4,10 @@
  *  @author Eugen Feller, Matthieu Fertré, John Mehnert-Spahn
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -15,14 +17,23 @@
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <strings.h>
+#include <stddef.h>
 #include <kerrighed.h>
 #include <libkrgcb.h>
 
+#include "krgcb_private.h"
+
 #define CR_CB_ABORT(f, a...) do { \
 	printf(f, ##a); exit(EXIT_FAILURE); \
 	} while (0)
@@ -41,23 +52,57 @@
 /* Max path size */
 #define CHKPT_PATH_SIZE 60
 
-/* Max nb of callbacks */
-#define CR_CB_MAX_CALLBACKS 40
-
 /* Active CB bit */
 #define CR_CB_ACTIV_CB (1 << 0)
 
+/*
+ * Set by processes acknowledging on the socket of the requester, with
+ * their node + 1 (0 if unknown) above CR_CB_NODE_SHIFT: the abstract
+ * namespace is local to a node. Processes of older versions of the
+ * library only acknowledge on the message queue.
+ */
+#define CR_CB_SOCKET_ACK (1 << 1)
+#define CR_CB_NODE_SHIFT 8
+#define CR_CB_NODE_MASK 0xffff
+
+/*
+ * Period at which a requester waiting on its socket looks for an
+ * acknowledgement sent on the message queue instead, by a process which
+ * migrated since it declared its node, or for the death of the process.
+ */
+#define CR_CB_FALLBACK_MS 100
+
 /* Message codes */
 enum cr_cb_status {
 	CR_CB_CHKPT_APP = 1,
 	CR_CB_ERR = 2
 };
 
-/* Hooks */
-enum cr_cb_hook {
-	CR_CB_CHECKPOINT = 1,
-	CR_CB_RESTART = 2,
-	CR_CB_CONTINUE = 3
+/*
+ * Acknowledgements of checkpoint callbacks are sent back on a unix
+ * datagram socket of the requester, bound in the abstract namespace to
+ * the tid of the requesting thread, which is queued with the signal.
+ * A plain kill() queues no value: the SysV message queue keyed by the
+ * target pid remains the channel of older requesters.
+ */
+#define CR_CB_SOCKET_PREFIX "krgcb."
+
+/*
+ * Set in the queued value, above the tid, when the requester delivers
+ * the callbacks to every process of the application itself.
+ */
+#define CR_CB_REQ_FANOUT (1 << 30)
+
+/* Acknowledgement sent on the socket */
+struct cr_cb_ack {
+	int status;
+	int pid;
+	/* summary of the callbacks run for the request */
+	unsigned int callbacks_us;
+	unsigned int slowest_us;
+	unsigned long long slowest_func;
+	/* lines written by callbacks through cr_callback_report() */
+	char report[CR_CB_REPORT_SIZE];
 };
 
 enum cr_cb_context {
@@ -65,19 +110,37 @@ enum cr_cb_context {
 	THREAD_CONTEXT
 };
 
-/* struct holds function pointer + argument pointer */
+/*
+ * A registered callback. Entries are never modified once published but
+ * for their statistics, and freed only once no handler can see them.
+ */
 struct cr_cb_callback_s {
 	cr_cb_callback_t func;
 	void *arg;
 	int thread_cb;
+	int independent;	/* may run concurrently with other callbacks */
+	int priority;
+	unsigned int budget_ms;	/* 0: unbounded */
+	/* statistics, each entry being run by one thread at a time */
+	unsigned int request;	/* request of the last execution */
+	unsigned int last_us;	/* duration of the last execution */
+	unsigned int max_us;
+	unsigned long count;
+	unsigned long long total_us;
+	unsigned long hist[CR_CB_HIST_BUCKETS];
+	struct cr_cb_callback_s *next_retired;
 };
 
-/* callback count */
-typedef struct cr_cb_count_s {
-	int chkpt;
-	int rst;
-	int cnt;
-} cr_cb_count_t;
+/*
+ * Snapshot of the callbacks of a hook, by decreasing priority. Updates
+ * publish a new snapshot, so that handlers walk a consistent array
+ * without locking.
+ */
+struct cr_cb_table {
+	int nr;
+	struct cr_cb_table *next_retired;
+	struct cr_cb_callback_s *cb[];
+};
 
 /* buffer for message queue */
 typedef struct cr_cb_msgbuf_s {
@@ -87,61 +150,255 @@ typedef struct cr_cb_msgbuf_s {
 
 /* info structure */
 typedef struct cr_cb_info_s {
-	cr_cb_count_t cr_cb_count;
-	struct cr_cb_callback_s cr_cb_chkpt[CR_CB_MAX_CALLBACKS];
-	struct cr_cb_callback_s cr_cb_rst[CR_CB_MAX_CALLBACKS];
-	struct cr_cb_callback_s cr_cb_cnt[CR_CB_MAX_CALLBACKS];
+	struct cr_cb_table *table[CR_CB_CONTINUE + 1];
+	/* snapshots and entries replaced while handlers were running */
+	struct cr_cb_table *retired_tables;
+	struct cr_cb_callback_s *retired_cbs;
 } cr_cb_info_t;
 
 cr_cb_info_t *info = NULL;
 int thread_running = 0;
 pthread_t cb_thread;
+/* signalfd dispatch mode: callbacks run out of the dispatch thread */
+int dispatch_fd = -1;
+pthread_t dispatch_thread;
 enum cr_cb_hook current_hook;
+pid_t current_requester;
+int current_fanout;
+unsigned int current_request;
+int ack_fd = -1;
+/* report of the current request */
+char current_report[CR_CB_REPORT_SIZE];
+size_t current_report_len;
+pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Socket receiving the acknowledgements requested by the thread */
+static __thread int req_fd = -1;
+static __thread pid_t req_tid;
+static __thread int req_busy;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static int cb_count_read(enum cr_cb_hook hook, cr_cb_count_t *cb)
+/* Max nb of threads running independent callbacks */
+#define CR_CB_POOL_SIZE 4
+
+/*
+ * Pool running the independent thread context callbacks of a snapshot,
+ * concurrently with the worker thread which runs the other ones.
+ */
+struct cr_cb_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* new batch, or batch completed */
+	int nr_threads;
+	pthread_t threads[CR_CB_POOL_SIZE];
+	int stop;
+	unsigned int batch;	/* incremented for each new batch */
+	struct cr_cb_table *table;
+	int next;		/* next callback of table to look at */
+	int nr_running;
+	int error;
+};
+
+static struct cr_cb_pool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Serializes updates of the registry */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Number of handlers walking a snapshot */
+static int nr_readers;
+
+static int valid_hook(enum cr_cb_hook hook)
 {
-	if (!info)
-		CR_CB_ABORT("Called without first calling cr_init()\n");
+	return hook >= CR_CB_CHECKPOINT && hook <= CR_CB_CONTINUE;
+}
 
-	switch (hook) {
-		case CR_CB_CHECKPOINT:
-			return cb->chkpt;
-		case CR_CB_RESTART:
-			return cb->rst;
-		case CR_CB_CONTINUE:
-			return cb->cnt;
-		default:
-			break;
+/*
+ * Async-signal safe. The snapshot remains valid until put_snapshot().
+ */
+static struct cr_cb_table *get_snapshot(enum cr_cb_hook hook)
+{
+	/* full barrier: a writer seeing no reader has published before */
+	__sync_fetch_and_add(&nr_readers, 1);
+
+	return *(struct cr_cb_table * volatile *)&info->table[hook];
+}
+
+static void put_snapshot(void)
+{
+	__sync_fetch_and_sub(&nr_readers, 1);
+}
+
+static void free_retired(int force)
+{
+	struct cr_cb_table *table;
+	struct cr_cb_callback_s *cb;
+
+	__sync_synchronize();
+	if (!force && nr_readers)
+		return;
+
+	while ((table = info->retired_tables)) {
+		info->retired_tables = table->next_retired;
+		free(table);
 	}
 
-	return -1;
+	while ((cb = info->retired_cbs)) {
+		info->retired_cbs = cb->next_retired;
+		free(cb);
+	}
 }
 
-static int cb_count_write(enum cr_cb_hook hook, int value,
-			  cr_cb_count_t *cb)
+/*
+ * Replace the snapshot of hook by table, removed being an entry not in
+ * table anymore. Called with registry_lock held.
+ */
+static void publish_snapshot(enum cr_cb_hook hook, struct cr_cb_table *table,
+			     struct cr_cb_callback_s *removed)
 {
-	if (!info)
-		CR_CB_ABORT("Called without first calling cr_init()\n");
+	struct cr_cb_table *old;
 
-	switch (hook) {
-		case CR_CB_CHECKPOINT:
-			cb->chkpt = value;
-			return 0;
-		case CR_CB_RESTART:
-			cb->rst = value;
-			return 0;
-		case CR_CB_CONTINUE:
-			cb->cnt = value;
-			return 0;
-		default:
+	__sync_synchronize();
+	old = __sync_lock_test_and_set(&info->table[hook], table);
+
+	if (old) {
+		old->next_retired = info->retired_tables;
+		info->retired_tables = old;
+	}
+	if (removed) {
+		removed->next_retired = info->retired_cbs;
+		info->retired_cbs = removed;
+	}
+
+	free_retired(0);
+}
+
+static struct cr_cb_table *alloc_table(int nr)
+{
+	struct cr_cb_table *table;
+
+	table = malloc(sizeof(*table) + nr * sizeof(table->cb[0]));
+	if (!table)
+		return NULL;
+
+	table->nr = nr;
+	table->next_retired = NULL;
+
+	return table;
+}
+
+static int insert_callback(enum cr_cb_hook hook, struct cr_cb_callback_s *cb)
+{
+	struct cr_cb_table *old, *table;
+	int i, j, nr;
+
+	pthread_mutex_lock(&registry_lock);
+
+	old = info->table[hook];
+	nr = old ? old->nr : 0;
+
+	table = alloc_table(nr + 1);
+	if (!table) {
+		pthread_mutex_unlock(&registry_lock);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* after the callbacks of higher or same priority */
+	for (i = 0, j = 0; i < nr; i++) {
+		if (j == i && old->cb[i]->priority < cb->priority)
+			table->cb[j++] = cb;
+		table->cb[j++] = old->cb[i];
+	}
+	if (j == nr)
+		table->cb[j] = cb;
+
+	publish_snapshot(hook, table, NULL);
+
+	pthread_mutex_unlock(&registry_lock);
+
+	return 0;
+}
+
+static int remove_callback(enum cr_cb_hook hook, cr_cb_callback_t func,
+			   void *arg)
+{
+	struct cr_cb_table *old, *table;
+	int i, j, found;
+
+	pthread_mutex_lock(&registry_lock);
+
+	old = info->table[hook];
+	if (!old)
+		goto not_found;
+
+	for (found = 0; found < old->nr; found++)
+		if (old->cb[found]->func == func && old->cb[found]->arg == arg)
 			break;
+	if (found == old->nr)
+		goto not_found;
+
+	table = alloc_table(old->nr - 1);
+	if (!table) {
+		pthread_mutex_unlock(&registry_lock);
+		errno = ENOMEM;
+		return -1;
 	}
 
+	for (i = 0, j = 0; i < old->nr; i++)
+		if (i != found)
+			table->cb[j++] = old->cb[i];
+
+	publish_snapshot(hook, table, old->cb[found]);
+
+	pthread_mutex_unlock(&registry_lock);
+
+	return 0;
+
+not_found:
+	pthread_mutex_unlock(&registry_lock);
+	errno = ENOENT;
 	return -1;
 }
 
-static int send_message(int msg)
+/*
+ * Fill addr with the abstract unix socket address of key. Async-signal
+ * safe, since callbacks of children are executed from a signal handler.
+ */
+static socklen_t channel_address(struct sockaddr_un *addr, long key)
+{
+	char digits[24];
+	size_t len;
+	int i = 0;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	/* sun_path[0] stays '\0': abstract namespace */
+	len = 1;
+	memcpy(addr->sun_path + len, CR_CB_SOCKET_PREFIX,
+	       strlen(CR_CB_SOCKET_PREFIX));
+	len += strlen(CR_CB_SOCKET_PREFIX);
+
+	if (key < 0) {
+		addr->sun_path[len++] = '-';
+		key = -key;
+	}
+	do {
+		digits[i++] = '0' + key % 10;
+		key /= 10;
+	} while (key);
+	while (i)
+		addr->sun_path[len++] = digits[--i];
+
+	return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+/*
+ * The queue is created by the requester, unless the acknowledgement falls
+ * back from the socket (create set).
+ */
+static int send_message_msgq(int msg, int create)
 {
 	key_t key;
 	cr_cb_msgbuf_t buf;
@@ -150,7 +407,7 @@ static int send_message(int msg)
 
 	key = getpid();
 
-	msqid = msgget(key, 0644);
+	msqid = msgget(key, 0644 | (create ? IPC_CREAT : 0));
 	if (msqid < 0) {
 		perror("libkrgcb.c::send_message::msgget");
 		CR_CB_DEBUG("msgget failed\n");
@@ -159,8 +416,9 @@ static int send_message(int msg)
 	}
 
 	buf.mtype = msg;
+	memset(buf.mtext, 0, sizeof(buf.mtext));
 
-	if (msgsnd(msqid, (cr_cb_msgbuf_t *)&buf, sizeof(buf), 0)) {
+	if (msgsnd(msqid, (cr_cb_msgbuf_t *)&buf, sizeof(buf.mtext), 0)) {
 		perror("libkrgcb.c::send_message::msgsnd");
 		CR_CB_DEBUG("msgsnd failed\n");
 		r = -1;
@@ -169,7 +427,113 @@ err:
 	return r;
 }
 
-static int cr_detect_callbacks(long pid, short from_appid)
+/*
+ * Sum of the durations of the callbacks run for the current request, and
+ * the slowest one. Async-signal safe.
+ */
+static void request_summary(struct cr_cb_ack *ack)
+{
+	struct cr_cb_table *table;
+	struct cr_cb_callback_s *cr_cb;
+	int idx;
+
+	ack->callbacks_us = 0;
+	ack->slowest_us = 0;
+	ack->slowest_func = 0;
+
+	if (!info || !valid_hook(current_hook))
+		return;
+
+	table = get_snapshot(current_hook);
+	for (idx = 0; table && idx < table->nr; idx++) {
+		cr_cb = table->cb[idx];
+		if (cr_cb->request != current_request)
+			continue;
+
+		ack->callbacks_us += cr_cb->last_us;
+		if (cr_cb->last_us >= ack->slowest_us) {
+			ack->slowest_us = cr_cb->last_us;
+			ack->slowest_func = (unsigned long)cr_cb->func;
+		}
+	}
+	put_snapshot();
+
+	memcpy(ack->report, current_report, sizeof(ack->report));
+}
+
+static int send_message_socket(int msg)
+{
+	struct sockaddr_un addr;
+	struct cr_cb_ack ack;
+	socklen_t len;
+	int fd = ack_fd;
+	int r = 0;
+
+	if (fd < 0) {
+		fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			perror("libkrgcb.c::send_message::socket");
+			return -1;
+		}
+	}
+
+	len = channel_address(&addr, current_requester);
+	ack.status = msg;
+	ack.pid = getpid();
+	request_summary(&ack);
+
+	if (sendto(fd, &ack, sizeof(ack), 0,
+		   (struct sockaddr *)&addr, len) != sizeof(ack)) {
+		/* requester on another node: the queue is cluster wide */
+		if (errno == ECONNREFUSED || errno == ENOENT) {
+			r = send_message_msgq(msg, 1);
+		} else {
+			perror("libkrgcb.c::send_message::sendto");
+			CR_CB_DEBUG("sendto failed\n");
+			r = -1;
+		}
+	}
+
+	if (fd != ack_fd)
+		close(fd);
+
+	return r;
+}
+
+static int send_message(int msg)
+{
+	if (current_requester)
+		return send_message_socket(msg);
+
+	return send_message_msgq(msg, 0);
+}
+
+/* Node field of the user data of the processes of the local node */
+static __u64 local_node_field(void)
+{
+	static int node = -2;
+
+	if (node == -2)
+		node = get_node_id();
+
+	return node < 0 ? 0 : (node + 1) & CR_CB_NODE_MASK;
+}
+
+/*
+ * Whether the process with user data udata acknowledges on the socket of
+ * a requester of the local node
+ */
+static int socket_reachable(__u64 udata)
+{
+	if (!(udata & CR_CB_SOCKET_ACK))
+		return 0;
+
+	return ((udata >> CR_CB_NODE_SHIFT) & CR_CB_NODE_MASK)
+		== local_node_field();
+}
+
+/* Fill *udata, if not NULL, with the user data of pid */
+static int cr_detect_callbacks(long pid, short from_appid, __u64 *pudata)
 {
 	int r = 0;
 	__u64 udata = 0;
@@ -184,124 +548,906 @@ static int cr_detect_callbacks(long pid, short from_appid)
 
 	if (!(udata & CR_CB_ACTIV_CB))
 		r = -1;
+	if (pudata)
+		*pudata = udata;
+err:
+	return r;
+}
+
+static int msgq_requested(void)
+{
+	const char *env = getenv("KRGCB_CHANNEL");
+
+	return env && !strcmp(env, "msgq");
+}
+
+static void fill_deadline(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* Milliseconds left before deadline, -1 if there is no deadline */
+static int time_left(const struct timespec *deadline)
+{
+	struct timespec now;
+	long left;
+
+	if (!deadline)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (deadline->tv_sec - now.tv_sec) * 1000
+		+ (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return left > 0 ? left : 0;
+}
+
+/* Time to wait on the socket before looking at the message queue */
+static int wait_tick(const struct timespec *deadline)
+{
+	int left = time_left(deadline);
+
+	return left < 0 || left > CR_CB_FALLBACK_MS ? CR_CB_FALLBACK_MS : left;
+}
+
+/* Zombies never acknowledge either */
+static int process_alive(long pid)
+{
+	char path[64], buf[512], *state;
+	ssize_t len;
+	int fd;
+
+	if (kill(pid, 0) && errno == ESRCH)
+		return 0;
+
+	snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno != ENOENT;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 1;
+	buf[len] = '\0';
+
+	state = strrchr(buf, ')');
+	if (!state || !state[1])
+		return 1;
+
+	return state[2] != 'Z' && state[2] != 'X';
+}
+
+/*
+ * Look for an acknowledgement of pid sent on the message queue instead of
+ * the socket. Return 1 and fill *status if found, -1 if pid is dead, 0
+ * otherwise.
+ */
+static int check_silent_target(long pid, int *status)
+{
+	cr_cb_msgbuf_t buf;
+	int msqid;
+
+	msqid = msgget(pid, 0644);
+	if (msqid >= 0
+	    && msgrcv(msqid, (cr_cb_msgbuf_t *)&buf, sizeof(buf.mtext), -CR_CB_ERR,
+		      IPC_NOWAIT) >= 0) {
+		msgctl(msqid, IPC_RMID, NULL);
+		*status = buf.mtype;
+		return 1;
+	}
+
+	if (!process_alive(pid))
+		return -1;
+
+	return 0;
+}
+
+static unsigned int elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000
+		+ (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int execute_chkpt_callbacks_msgq(long pid,
+					const struct timespec *deadline)
+{
+	struct timespec delay = { 0, 1000000 };
+	cr_cb_msgbuf_t buf;
+	key_t key;
+	int msqid;
+	int r = 0;
+
+	key = pid;
+
+	msqid = msgget(key, 0644 | IPC_CREAT);
+	if (msqid < 0) {
+		r = -1;
+		goto err;
+	}
+
+	r = kill(pid, SIG_CB_RUN_CHKPT);
+	if (r)
+		goto err_rmid;
+
+	/* msgrcv() can not time out: poll the queue every ms */
+	while (msgrcv(msqid, (cr_cb_msgbuf_t *)&buf, sizeof(buf.mtext),
+		      0, deadline ? IPC_NOWAIT : 0) < 0) {
+		if (errno == ENOMSG && time_left(deadline)) {
+			nanosleep(&delay, NULL);
+			continue;
+		}
+		if (errno == ENOMSG)
+			errno = ETIMEDOUT;
+		r = -1;
+		goto err_rmid;
+	}
+
+	r = msgctl(msqid, IPC_RMID, NULL);
+	if (r)
+		goto err;
+
+	if (buf.mtype == CR_CB_ERR)
+		r = -1;
 err:
 	return r;
+
+err_rmid:
+	/* a late acknowledgement will find no queue */
+	msgctl(msqid, IPC_RMID, NULL);
+	return r;
+}
+
+/*
+ * The socket of the thread is bound once, so that a round trip costs
+ * sigqueue() and recv() only. It vanishes with the process: nothing is
+ * left behind if either side dies. Return -1 if the socket is already
+ * waiting for an acknowledgement of this thread.
+ */
+static int requester_socket(pid_t tid)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+
+	if (req_busy)
+		return -1;
+
+	/* forked child: the socket is bound to a tid of the parent */
+	if (req_fd >= 0 && req_tid != tid) {
+		close(req_fd);
+		req_fd = -1;
+	}
+
+	if (req_fd < 0) {
+		req_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (req_fd < 0)
+			return -1;
+
+		len = channel_address(&addr, tid);
+		if (bind(req_fd, (struct sockaddr *)&addr, len)) {
+			close(req_fd);
+			req_fd = -1;
+			return -1;
+		}
+		req_tid = tid;
+	}
+
+	return req_fd;
+}
+
+/* Older versions of the library send the status and pid only */
+static int valid_ack(struct cr_cb_ack *ack, ssize_t size)
+{
+	if (size < (ssize_t)offsetof(struct cr_cb_ack, callbacks_us))
+		return 0;
+
+	if (size < (ssize_t)sizeof(*ack))
+		memset((char *)ack + size, 0, sizeof(*ack) - size);
+
+	return 1;
+}
+
+static void fill_result(struct cr_cb_result *result,
+			const struct cr_cb_ack *ack)
+{
+	if (!result)
+		return;
+
+	result->callbacks_us = ack->callbacks_us;
+	result->slowest_us = ack->slowest_us;
+	result->slowest_func = ack->slowest_func;
+	memcpy(result->report, ack->report, sizeof(result->report));
+	result->report[sizeof(result->report) - 1] = '\0';
+}
+
+static int execute_chkpt_callbacks_socket(long pid, int fd, pid_t tid,
+					  const struct timespec *deadline,
+					  struct cr_cb_result *result)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	struct cr_cb_ack ack;
+	union sigval value;
+	ssize_t size;
+	int r = -1, status, msqid;
+
+	/* acknowledgements of requests which timed out before, on the
+	 * socket or on the queue when the requester was gone */
+	while (recv(fd, &ack, sizeof(ack), MSG_DONTWAIT) >= 0)
+		;
+	msqid = msgget(pid, 0644);
+	if (msqid >= 0)
+		msgctl(msqid, IPC_RMID, NULL);
+
+	value.sival_int = tid;
+	if (sigqueue(pid, SIG_CB_RUN_CHKPT, value))
+		goto err;
+
+	req_busy = 1;
+
+	/* skip acknowledgements left by processes which failed before */
+	do {
+		r = poll(&pfd, 1, wait_tick(deadline));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			goto err_busy;
+		if (!r) {
+			r = check_silent_target(pid, &status);
+			if (r > 0) {
+				r = status == CR_CB_ERR ? -1 : 0;
+				goto err_busy;
+			}
+			if (r < 0) {
+				errno = ESRCH;
+				goto err_busy;
+			}
+			if (!time_left(deadline)) {
+				errno = ETIMEDOUT;
+				r = -1;
+				goto err_busy;
+			}
+			continue;
+		}
+		r = -1;
+
+		size = recv(fd, &ack, sizeof(ack), 0);
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (!valid_ack(&ack, size))
+			goto err_busy;
+	} while (ack.pid != pid);
+
+	fill_result(result, &ack);
+
+	if (ack.status != CR_CB_ERR)
+		r = 0;
+
+err_busy:
+	req_busy = 0;
+err:
+	return r;
+}
+
+int cr_execute_chkpt_callbacks_report(long pid, short from_appid,
+				      int timeout, struct cr_cb_result *result)
+{
+	struct timespec deadline, *pdeadline = NULL, start;
+	__u64 udata;
+	pid_t tid;
+	int fd, r = 0;
+
+	if (result) {
+		memset(result, 0, sizeof(*result));
+		result->pid = pid;
+	}
+
+	if (cr_detect_callbacks(pid, from_appid, &udata))
+		goto err;
+
+	if (timeout > 0) {
+		fill_deadline(&deadline, timeout);
+		pdeadline = &deadline;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	tid = syscall(SYS_gettid);
+
+	/*
+	 * nested calls from a signal handler, and processes which can not
+	 * reach the socket, use the message queue
+	 */
+	if (!msgq_requested() && socket_reachable(udata)
+	    && (fd = requester_socket(tid)) >= 0)
+		r = execute_chkpt_callbacks_socket(pid, fd, tid, pdeadline,
+						   result);
+	else
+		r = execute_chkpt_callbacks_msgq(pid, pdeadline);
+
+	if (result) {
+		result->result = r;
+		result->error = r ? errno : 0;
+		result->elapsed_ms = elapsed_ms(&start);
+	}
+err:
+	return r;
+}
+
+int cr_execute_chkpt_callbacks_timeout(long pid, short from_appid,
+				       int timeout)
+{
+	return cr_execute_chkpt_callbacks_report(pid, from_appid, timeout,
+						 NULL);
+}
+
+int cr_execute_chkpt_callbacks(long pid, short from_appid)
+{
+	return cr_execute_chkpt_callbacks_timeout(pid, from_appid, 0);
+}
+
+int cr_execute_restart_callbacks(long pid)
+{
+	int r = 0;
+
+	if (cr_detect_callbacks(pid, 0, NULL))
+		goto err;
+
+	r = kill(pid, SIG_CB_RUN_RST);
+	if (r)
+		goto err;
+err:
+	return r;
+}
+
+int cr_execute_continue_callbacks(long pid, short from_appid)
+{
+	int r = 0;
+
+	if (cr_detect_callbacks(pid, from_appid, NULL))
+		goto err;
+
+	r = kill(pid, SIG_CB_RUN_CNT);
+	if (r)
+		goto err;
+err:
+	return r;
+}
+
+/* Whether pid catches SIG_CB_RUN_CHKPT */
+static int catches_callback_signal(pid_t pid)
+{
+	unsigned long long caught = 0;
+	char path[64], line[256];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	while (fgets(line, sizeof(line), file))
+		if (sscanf(line, "SigCgt: %llx", &caught) == 1)
+			break;
+	fclose(file);
+
+	return !!(caught & (1ULL << (SIG_CB_RUN_CHKPT - 1)));
+}
+
+/*
+ * Processes of the application which installed the handlers of libkrgcb:
+ * a process not catching the signals would be killed.
+ */
+static int list_callback_processes(long pid, short from_appid, pid_t **pids)
+{
+	int nr, nr_pids = 0, i;
+
+	nr = application_get_pids(pid, from_appid, pids);
+	if (nr < 0)
+		return -1;
+
+	for (i = 0; i < nr; i++)
+		if (catches_callback_signal((*pids)[i]))
+			(*pids)[nr_pids++] = (*pids)[i];
+
+	if (!nr_pids) {
+		free(*pids);
+		*pids = NULL;
+	}
+
+	return nr_pids;
+}
+
+/*
+ * All processes are signaled at once, and their acknowledgements are
+ * collected on the socket of the thread as they come.
+ */
+static void fanout_chkpt_callbacks(int fd, pid_t tid,
+				   struct cr_cb_result *results, int nr,
+				   const struct timespec *deadline)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	struct timespec start;
+	struct cr_cb_ack ack;
+	union sigval value;
+	int i, nr_pending = 0, r, status;
+
+	while (recv(fd, &ack, sizeof(ack), MSG_DONTWAIT) >= 0)
+		;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	value.sival_int = tid | CR_CB_REQ_FANOUT;
+	for (i = 0; i < nr; i++) {
+		if (sigqueue(results[i].pid, SIG_CB_RUN_CHKPT, value)) {
+			results[i].result = -1;
+			results[i].error = errno;
+		} else {
+			results[i].result = 1;	/* pending */
+			nr_pending++;
+		}
+	}
+
+	req_busy = 1;
+
+	while (nr_pending) {
+		r = poll(&pfd, 1, wait_tick(deadline));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			break;
+		if (!r) {
+			for (i = 0; i < nr; i++) {
+				if (results[i].result != 1)
+					continue;
+				r = check_silent_target(results[i].pid,
+							&status);
+				if (!r)
+					continue;
+				results[i].elapsed_ms = elapsed_ms(&start);
+				results[i].result = -1;
+				results[i].error = r < 0 ? ESRCH : 0;
+				if (r > 0 && status != CR_CB_ERR)
+					results[i].result = 0;
+				nr_pending--;
+			}
+			if (!time_left(deadline))
+				break;
+			continue;
+		}
+
+		if (!valid_ack(&ack, recv(fd, &ack, sizeof(ack), 0)))
+			continue;
+
+		for (i = 0; i < nr; i++)
+			if (results[i].pid == ack.pid)
+				break;
+		if (i == nr || results[i].result != 1)
+			continue;
+
+		results[i].elapsed_ms = elapsed_ms(&start);
+		fill_result(&results[i], &ack);
+		if (ack.status == CR_CB_ERR) {
+			results[i].result = -1;
+			results[i].error = 0;
+		} else {
+			results[i].result = 0;
+		}
+		nr_pending--;
+	}
+
+	req_busy = 0;
+
+	for (i = 0; i < nr; i++)
+		if (results[i].result == 1) {
+			results[i].result = -1;
+			results[i].error = ETIMEDOUT;
+			results[i].elapsed_ms = elapsed_ms(&start);
+		}
+}
+
+int cr_execute_app_chkpt_callbacks(long pid, short from_appid, int timeout,
+				   struct cr_cb_result **results)
+{
+	struct timespec deadline, *pdeadline = NULL, start;
+	struct cr_cb_result *res, tmp;
+	pid_t *pids, tid;
+	int i, nr, nr_socket = 0, fd;
+	__u64 udata;
+
+	*results = NULL;
+
+	if (cr_detect_callbacks(pid, from_appid, NULL))
+		return 0;
+
+	nr = list_callback_processes(pid, from_appid, &pids);
+	if (nr <= 0)
+		return nr;
+
+	res = calloc(nr, sizeof(*res));
+	if (!res) {
+		free(pids);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < nr; i++)
+		res[i].pid = pids[i];
+	free(pids);
+
+	/* processes reachable on the socket first */
+	if (!msgq_requested())
+		for (i = 0; i < nr; i++) {
+			if (application_get_userdata_from_pid(res[i].pid,
+							      &udata)
+			    || !socket_reachable(udata))
+				continue;
+			tmp = res[nr_socket];
+			res[nr_socket++] = res[i];
+			res[i] = tmp;
+		}
+
+	if (timeout > 0) {
+		fill_deadline(&deadline, timeout);
+		pdeadline = &deadline;
+	}
+
+	tid = syscall(SYS_gettid);
+
+	if (!nr_socket || (fd = requester_socket(tid)) < 0)
+		nr_socket = 0;
+	else
+		fanout_chkpt_callbacks(fd, tid, res, nr_socket, pdeadline);
+
+	/* message queues are keyed by pid: one at a time */
+	for (i = nr_socket; i < nr; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		res[i].result = execute_chkpt_callbacks_msgq(res[i].pid,
+							     pdeadline);
+		res[i].error = res[i].result ? errno : 0;
+		res[i].elapsed_ms = elapsed_ms(&start);
+	}
+
+	*results = res;
+
+	return nr;
+}
+
+int cr_execute_app_continue_callbacks(long pid, short from_appid)
+{
+	union sigval value;
+	pid_t *pids;
+	int i, nr, r = 0;
+
+	if (cr_detect_callbacks(pid, from_appid, NULL))
+		return 0;
+
+	nr = list_callback_processes(pid, from_appid, &pids);
+	if (nr < 0)
+		return -1;
+
+	value.sival_int = CR_CB_REQ_FANOUT;
+	for (i = 0; i < nr; i++)
+		if (sigqueue(pids[i], SIG_CB_RUN_CNT, value))
+			r = -1;
+
+	free(pids);
+
+	return r;
+}
+
+int cr_callback_fanned_out(void)
+{
+	return current_fanout;
+}
+
+int cr_callback_block(sigset_t *oldset)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIG_CB_RUN_CHKPT);
+	sigaddset(&set, SIG_CB_RUN_RST);
+	sigaddset(&set, SIG_CB_RUN_CNT);
+
+	errno = pthread_sigmask(SIG_BLOCK, &set, oldset);
+
+	return errno ? -1 : 0;
+}
+
+int cr_callback_unblock(const sigset_t *oldset)
+{
+	errno = pthread_sigmask(SIG_SETMASK, oldset, NULL);
+
+	return errno ? -1 : 0;
+}
+
+int cr_callback_report(const char *format, ...)
+{
+	va_list args;
+	size_t len;
+	int r;
+
+	pthread_mutex_lock(&report_mutex);
+
+	len = current_report_len;
+	if (len && len < sizeof(current_report) - 1)
+		current_report[len++] = '\n';
+
+	va_start(args, format);
+	r = vsnprintf(current_report + len, sizeof(current_report) - len,
+		      format, args);
+	va_end(args);
+
+	/* truncated reports are still sent */
+	if (r >= 0) {
+		len += r;
+		if (len >= sizeof(current_report))
+			len = sizeof(current_report) - 1;
+		current_report_len = len;
+	}
+
+	pthread_mutex_unlock(&report_mutex);
+
+	return r < 0 ? -1 : 0;
+}
+
+static unsigned int elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000
+		+ (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* hist[0] counts durations below 1 us, hist[i] in [2^(i-1), 2^i) us */
+static int hist_bucket(unsigned int us)
+{
+	int i = 0;
+
+	while (us && i < CR_CB_HIST_BUCKETS - 1) {
+		us >>= 1;
+		i++;
+	}
+
+	return i;
+}
+
+static void account_callback(struct cr_cb_callback_s *cr_cb, unsigned int us)
+{
+	cr_cb->request = current_request;
+	cr_cb->last_us = us;
+	if (us > cr_cb->max_us)
+		cr_cb->max_us = us;
+	cr_cb->count++;
+	cr_cb->total_us += us;
+	cr_cb->hist[hist_bucket(us)]++;
+}
+
+/*
+ * A callback running longer than its budget fails the checkpoint, so
+ * that the application is continued rather than frozen late.
+ */
+static int run_callback(struct cr_cb_callback_s *cr_cb, int idx)
+{
+	struct timespec start;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	r = (*cr_cb->func)(cr_cb->arg);
+
+	account_callback(cr_cb, elapsed_us(&start));
+
+	if (r) {
+		CR_CB_DEBUG("Callback %d returned %d\n", idx, r);
+		return r;
+	}
+
+	if (cr_cb->budget_ms && cr_cb->last_us > cr_cb->budget_ms * 1000ULL
+	    && current_hook == CR_CB_CHECKPOINT) {
+		CR_CB_DEBUG("Callback %d ran %u us, over its budget of %u ms\n",
+			    idx, cr_cb->last_us, cr_cb->budget_ms);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Run the independent callbacks of the current batch not taken by
+ * other threads yet. Called with pool.lock held.
+ */
+static void pool_run_batch(void)
+{
+	struct cr_cb_callback_s *cr_cb;
+	int idx, skip, r;
+
+	while (pool.table && pool.next < pool.table->nr) {
+		idx = pool.next++;
+		cr_cb = pool.table->cb[idx];
+		if (!cr_cb->thread_cb || !cr_cb->independent)
+			continue;
+
+		/* no need to run more once one has failed */
+		skip = pool.error;
+		pool.nr_running++;
+		pthread_mutex_unlock(&pool.lock);
+
+		r = skip ? 0 : run_callback(cr_cb, idx);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.nr_running--;
+		if (r && !pool.error)
+			pool.error = r;
+	}
+
+	pthread_cond_broadcast(&pool.cond);
 }
 
-int cr_execute_chkpt_callbacks(long pid, short from_appid)
+/*
+ * Threads of the library must not get the signals of the requests: the
+ * handler would run on the worker thread waiting to be woken up by it.
+ */
+static void block_request_signals(void)
 {
-	cr_cb_msgbuf_t buf;
-	key_t key;
-	int msqid;
-	int r = 0;
+	sigset_t set;
 
-	if (cr_detect_callbacks(pid, from_appid))
-		goto err;
+	sigemptyset(&set);
+	sigaddset(&set, SIG_CB_RUN_CHKPT);
+	sigaddset(&set, SIG_CB_RUN_RST);
+	sigaddset(&set, SIG_CB_RUN_CNT);
 
-	key = pid;
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
 
-	msqid = msgget(key, 0644 | IPC_CREAT);
-	if (msqid < 0) {
-		r = -1;
-		goto err;
+static void *pool_thread(void *arg)
+{
+	unsigned int batch = 0;
+
+	block_request_signals();
+
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.stop) {
+		if (pool.batch == batch) {
+			pthread_cond_wait(&pool.cond, &pool.lock);
+			continue;
+		}
+		batch = pool.batch;
+		pool_run_batch();
 	}
+	pthread_mutex_unlock(&pool.lock);
 
-	r = kill(pid, SIG_CB_RUN_CHKPT);
-	if (r)
-		goto err;
+	return NULL;
+}
 
-	if (msgrcv(msqid, (cr_cb_msgbuf_t *)&buf, sizeof(buf),
-		   0, 0) < 0) {
-		r = -1;
-		goto err;
+/*
+ * Callbacks mostly flush data, so the pool is not sized on the number of
+ * CPUs.
+ */
+static int initialize_pool(void)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&pool.lock);
+
+	if (pool.nr_threads)
+		goto out;
+
+	pool.stop = 0;
+	while (pool.nr_threads < CR_CB_POOL_SIZE) {
+		r = pthread_create(&pool.threads[pool.nr_threads], NULL,
+				   pool_thread, NULL);
+		if (r)
+			break;
+		pool.nr_threads++;
 	}
 
-	r = msgctl(msqid, IPC_RMID, NULL);
-	if (r)
-		goto err;
+	/* the worker thread runs the independent callbacks alone */
+	if (pool.nr_threads)
+		r = 0;
+out:
+	pthread_mutex_unlock(&pool.lock);
 
-	if (buf.mtype == CR_CB_ERR)
-		r = -1;
-err:
 	return r;
 }
 
-int cr_execute_restart_callbacks(long pid)
+static void stop_pool(void)
 {
-	int r = 0;
+	int i;
 
-	if (cr_detect_callbacks(pid, 0))
-		goto err;
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
 
-	r = kill(pid, SIG_CB_RUN_RST);
-	if (r)
-		goto err;
-err:
-	return r;
+	for (i = 0; i < pool.nr_threads; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.nr_threads = 0;
 }
 
-int cr_execute_continue_callbacks(long pid, short from_appid)
+static void pool_start_batch(struct cr_cb_table *table)
 {
-	int r = 0;
+	pthread_mutex_lock(&pool.lock);
+	pool.table = table;
+	pool.next = 0;
+	pool.error = 0;
+	pool.batch++;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
 
-	if (cr_detect_callbacks(pid, from_appid))
-		goto err;
+/* Help running the batch, then wait for its completion */
+static int pool_join_batch(void)
+{
+	int r;
+
+	pthread_mutex_lock(&pool.lock);
+	pool_run_batch();
+	while (pool.nr_running)
+		pthread_cond_wait(&pool.cond, &pool.lock);
+	r = pool.error;
+	pool.table = NULL;
+	pthread_mutex_unlock(&pool.lock);
 
-	r = kill(pid, SIG_CB_RUN_CNT);
-	if (r)
-		goto err;
-err:
 	return r;
 }
 
 static int run_callbacks(enum cr_cb_context context)
 {
+	struct cr_cb_table *table;
 	struct cr_cb_callback_s *cr_cb;
-	int idx;
+	int idx, batch = 0;
 	int r = 0;
 
 	if (!info)
 		CR_CB_ABORT("Called without first calling cr_init()\n");
 
-	switch (current_hook) {
-		case CR_CB_CHECKPOINT:
-			cr_cb = info->cr_cb_chkpt;
-			break;
-		case CR_CB_RESTART:
-			cr_cb = info->cr_cb_rst;
-			break;
-		case CR_CB_CONTINUE:
-			cr_cb = info->cr_cb_cnt;
-			break;
-		default:
-			CR_CB_DEBUG("Unknown hook: %d\n", current_hook);
-			r = -1;
-			goto err;
+	if (!valid_hook(current_hook)) {
+		CR_CB_DEBUG("Unknown hook: %d\n", current_hook);
+		return -1;
+	}
+
+	table = get_snapshot(current_hook);
+	if (!table)
+		goto err;
+
+	if (context == THREAD_CONTEXT) {
+		for (idx = 0; idx < table->nr; idx++)
+			if (table->cb[idx]->thread_cb
+			    && table->cb[idx]->independent)
+				break;
+		if (idx < table->nr) {
+			pool_start_batch(table);
+			batch = 1;
+		}
 	}
 
-	for (idx = 0; idx < cb_count_read(current_hook, &info->cr_cb_count);
-	     idx++) {
+	for (idx = 0; idx < table->nr; idx++) {
+		cr_cb = table->cb[idx];
+
 		switch (context) {
 			case SIGNAL_CONTEXT:
-				if (cr_cb[idx].func && !cr_cb[idx].thread_cb) {
-					r = (*cr_cb[idx].func)(cr_cb[idx].arg);
-					if (r) {
-						CR_CB_DEBUG("Callback %d \
-							    returned %d:\n",
-							    idx, r);
+				if (!cr_cb->thread_cb) {
+					r = run_callback(cr_cb, idx);
+					if (r)
 						goto err;
-					}
 				}
 				break;
 			case THREAD_CONTEXT:
-				if (cr_cb[idx].func && cr_cb[idx].thread_cb) {
-					r = (*cr_cb[idx].func)(cr_cb[idx].arg);
-					if (r) {
-						CR_CB_DEBUG("Callback %d \
-							    returned %d:\n",
-							    idx, r);
+				if (cr_cb->thread_cb && !cr_cb->independent) {
+					r = run_callback(cr_cb, idx);
+					if (r)
 						goto err;
-					}
 				}
 				break;
 			default:
@@ -311,16 +1457,31 @@ static int run_callbacks(enum cr_cb_context context)
 		}
 	}
 err:
+	/* the snapshot must stay valid until all callbacks are done */
+	if (batch) {
+		int batch_r = pool_join_batch();
+		if (!r)
+			r = batch_r;
+	}
+	put_snapshot();
 	CR_CB_DEBUG("run_callbacks ret: %d\n", r);
 	return r;
 }
 
-static void handle_signal(int signum)
+/* Record the request carried by signal signum */
+static int set_current_request(int signum, int code, int value)
 {
-	int r;
-
-	if (!info)
-		CR_CB_ABORT("Called without first calling cr_init()\n");
+	current_request++;
+	current_report_len = 0;
+	current_report[0] = '\0';
+
+	if (code == SI_QUEUE) {
+		current_requester = value & ~CR_CB_REQ_FANOUT;
+		current_fanout = !!(value & CR_CB_REQ_FANOUT);
+	} else {
+		current_requester = 0;
+		current_fanout = 0;
+	}
 
 	switch (signum) {
 		case SIG_CB_RUN_CHKPT:
@@ -334,9 +1495,53 @@ static void handle_signal(int signum)
 			break;
 		default:
 			CR_CB_DEBUG("Bad signal received: %d\n", signum);
-			return;
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * signalfd dispatch mode: a request landing on a thread which does not
+ * block the signals is queued again to the dispatch thread, with the same
+ * requester, so that it runs all the callbacks and acknowledges.
+ */
+static void forward_signal(int signum, siginfo_t *si)
+{
+	union sigval value;
+
+	value.sival_int = 0;
+	if (si && si->si_code == SI_QUEUE)
+		value.sival_int = si->si_value.sival_int;
+
+	if (!pthread_sigqueue(dispatch_thread, signum, value))
+		return;
+
+	CR_CB_DEBUG("Fail to forward signal %d to the dispatch thread\n",
+		    signum);
+	if (signum == SIG_CB_RUN_CHKPT
+	    && !set_current_request(signum, si ? si->si_code : SI_USER,
+				    value.sival_int))
+		send_message(CR_CB_ERR);
+}
+
+static void handle_signal(int signum, siginfo_t *si, void *ucontext)
+{
+	int saved_errno = errno;
+	int r;
+
+	if (!info)
+		CR_CB_ABORT("Called without first calling cr_init()\n");
+
+	if (dispatch_fd >= 0) {
+		forward_signal(signum, si);
+		goto out;
 	}
 
+	if (set_current_request(signum, si ? si->si_code : SI_USER,
+				si ? si->si_value.sival_int : 0))
+		goto out;
+
 	r = run_callbacks(SIGNAL_CONTEXT);
 	if (current_hook == CR_CB_CHECKPOINT) {
 		if (r)
@@ -350,6 +1555,46 @@ static void handle_signal(int signum)
 	CR_CB_DEBUG("Waking up worker thread\n");
 	if (thread_running && pthread_mutex_unlock(&mutex))
 		CR_CB_DEBUG("Error while releasing mutex");
+out:
+	errno = saved_errno;
+}
+
+/*
+ * signalfd dispatch mode: signals are consumed by this thread, which runs
+ * both signal and thread context callbacks out of any signal handler.
+ */
+static void *dispatch_signals(void *arg)
+{
+	int fd = (int)(long)arg;
+	struct signalfd_siginfo si;
+	ssize_t size;
+	int r;
+
+	for (;;) {
+		size = read(fd, &si, sizeof(si));
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size != sizeof(si))
+			break;
+
+		if (set_current_request(si.ssi_signo, si.ssi_code,
+					si.ssi_int))
+			continue;
+
+		r = run_callbacks(SIGNAL_CONTEXT);
+		if (!r)
+			r = run_callbacks(THREAD_CONTEXT);
+
+		if (current_hook == CR_CB_CHECKPOINT) {
+			r = send_message(r ? CR_CB_ERR : CR_CB_CHKPT_APP);
+			CR_CB_DEBUG("dispatch_signals - send_message ret: "
+				    "%d\n", r);
+		}
+	}
+
+	CR_CB_DEBUG("End of dispatch thread\n");
+
+	return NULL;
 }
 
 static void* worker_thread(void *arg)
@@ -359,6 +1604,8 @@ static void* worker_thread(void *arg)
 	if (!info)
 		CR_CB_ABORT("Called without first calling cr_init()\n");
 
+	block_request_signals();
+
 	while (thread_running) {
 		CR_CB_DEBUG("Locking worker thread\n");
 		if (pthread_mutex_lock(&mutex))
@@ -385,11 +1632,39 @@ static void* worker_thread(void *arg)
 
 static void free_info_memory(void)
 {
+	enum cr_cb_hook hook;
+	struct cr_cb_table *table;
+	int i;
+
+	if (dispatch_fd >= 0) {
+		pthread_cancel(dispatch_thread);
+		pthread_join(dispatch_thread, NULL);
+		close(dispatch_fd);
+		dispatch_fd = -1;
+	}
+
+	if (pool.nr_threads)
+		stop_pool();
+
 	if (info) {
+		for (hook = CR_CB_CHECKPOINT; hook <= CR_CB_CONTINUE; hook++) {
+			table = info->table[hook];
+			if (!table)
+				continue;
+			for (i = 0; i < table->nr; i++)
+				free(table->cb[i]);
+			free(table);
+		}
+		free_retired(1);
 		free(info);
 		info = NULL;
 	}
 
+	if (ack_fd >= 0) {
+		close(ack_fd);
+		ack_fd = -1;
+	}
+
 	thread_running = 0;
 }
 
@@ -418,8 +1693,8 @@ static int initialize_signal_handlers(void)
 	struct sigaction sa;
 	int r = 0;
 
-	sa.sa_handler = handle_signal;
-	sa.sa_flags = 0;
+	sa.sa_sigaction = handle_signal;
+	sa.sa_flags = SA_SIGINFO;
 	sigfillset(&sa.sa_mask);
 
 	r = sigaction(SIG_CB_RUN_CHKPT, &sa, NULL);
@@ -454,22 +1729,86 @@ static int declare_cb(void)
 {
 	__u64 udata = 0;
 	udata |= CR_CB_ACTIV_CB;
+	udata |= CR_CB_SOCKET_ACK | (local_node_field() << CR_CB_NODE_SHIFT);
 
 	return application_set_userdata(udata);
 }
 
-int cr_callback_init(void)
+/*
+ * The handlers stay installed in dispatch mode, for the threads created
+ * before which do not block the signals: they forward the requests to the
+ * dispatch thread.
+ */
+static int initialize_dispatch_thread(void)
+{
+	sigset_t set;
+	int fd, r;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIG_CB_RUN_CHKPT);
+	sigaddset(&set, SIG_CB_RUN_RST);
+	sigaddset(&set, SIG_CB_RUN_CNT);
+
+	r = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (r) {
+		errno = r;
+		return -1;
+	}
+
+	fd = signalfd(-1, &set, SFD_CLOEXEC);
+	if (fd < 0)
+		goto err_unblock;
+
+	r = pthread_create(&dispatch_thread, NULL, dispatch_signals,
+			   (void *)(long)fd);
+	if (r) {
+		close(fd);
+		errno = r;
+		goto err_unblock;
+	}
+
+	/* handlers forward requests to dispatch_thread from now on */
+	dispatch_fd = fd;
+
+	return 0;
+
+err_unblock:
+	r = errno;
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+	errno = r;
+	return -1;
+}
+
+int cr_callback_init_flags(int flags)
 {
+	const char *env = getenv("KRGCB_DISPATCH");
 	int r = 0;
 
+	/* libraries and the program may all initialize, keep the callbacks
+	 * already registered */
+	if (info)
+		return 0;
+
+	if (env && !strcmp(env, "signalfd"))
+		flags |= CR_CB_INIT_SIGNALFD;
+
 	r = initialize_cb_info();
 	if (r)
 		goto err;
 
+	/* acknowledgements need no syscall but sendto() then */
+	ack_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
 	r = initialize_signal_handlers();
 	if (r)
 		goto err;
 
+	if (flags & CR_CB_INIT_SIGNALFD) {
+		r = initialize_dispatch_thread();
+		if (r)
+			goto err;
+	}
+
 	r = declare_cb();
 
 err:
@@ -479,6 +1818,11 @@ err:
 	return r;
 }
 
+int cr_callback_init(void)
+{
+	return cr_callback_init_flags(0);
+}
+
 void cr_callback_exit(void)
 {
 	if (info)
@@ -488,54 +1832,84 @@ void cr_callback_exit(void)
 }
 
 static int register_callback(enum cr_cb_hook hook, cr_cb_callback_t func,
-			     void *arg, enum cr_cb_context context)
+			     void *arg, enum cr_cb_context context,
+			     int priority, int independent)
 {
-	int idx;
 	struct cr_cb_callback_s *cr_cb;
 
 	if (!info)
 		CR_CB_ABORT("Called without first calling cr_init()\n");
 
+	if (!valid_hook(hook) || !func) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	if (context == THREAD_CONTEXT) {
-		if (!thread_running) {
+		/* the dispatch thread runs thread context callbacks too */
+		if (!thread_running && dispatch_fd < 0) {
 			int r = initialize_cb_thread();
 			if (r)
 				return r;
 		}
+		if (independent) {
+			int r = initialize_pool();
+			if (r)
+				return r;
+		}
 	}
 
-	switch (hook) {
-		case CR_CB_CHECKPOINT:
-			cr_cb = info->cr_cb_chkpt;
-			break;
-		case CR_CB_RESTART:
-			cr_cb = info->cr_cb_rst;
-			break;
-		case CR_CB_CONTINUE:
-			cr_cb = info->cr_cb_cnt;
-			break;
-		default:
-			return -1;
+	cr_cb = calloc(1, sizeof(*cr_cb));
+	if (!cr_cb) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	cr_cb->func = func;
+	cr_cb->arg = arg;
+	cr_cb->priority = priority;
+	if (context == SIGNAL_CONTEXT)
+		cr_cb->thread_cb = 0;
+	else
+		cr_cb->thread_cb = 1;
+	cr_cb->independent = independent;
+
+	if (insert_callback(hook, cr_cb)) {
+		free(cr_cb);
+		return -1;
 	}
 
-	idx = cb_count_read(hook, &info->cr_cb_count);
+	return 0;
+}
+
+int cr_register_callback(enum cr_cb_hook hook, cr_cb_callback_t func,
+			 void *arg, int priority, int flags)
+{
+	enum cr_cb_context context = SIGNAL_CONTEXT;
+	int independent = 0;
 
-	CR_CB_DEBUG("idx:%d\n", idx);
+	/* signal context callbacks all run in the signal handler */
+	if (flags & CR_CB_THREAD) {
+		context = THREAD_CONTEXT;
+		independent = !!(flags & CR_CB_INDEPENDENT);
+	}
 
-	if (idx < CR_CB_MAX_CALLBACKS) {
-		cr_cb[idx].func = func;
-		cr_cb[idx].arg = arg;
+	return register_callback(hook, func, arg, context, priority,
+				 independent);
+}
 
-		if (context == SIGNAL_CONTEXT)
-			cr_cb[idx].thread_cb = 0;
-		else
-			cr_cb[idx].thread_cb = 1;
+int cr_unregister_callback(enum cr_cb_hook hook, cr_cb_callback_t func,
+			   void *arg)
+{
+	if (!info)
+		CR_CB_ABORT("Called without first calling cr_init()\n");
 
-		cb_count_write(hook, idx+1, &info->cr_cb_count);
-	} else
+	if (!valid_hook(hook)) {
+		errno = EINVAL;
 		return -1;
+	}
 
-	return 0;
+	return remove_callback(hook, func, arg);
 }
 
 // Signal handler context callback registration
@@ -543,19 +1917,22 @@ static int register_callback(enum cr_cb_hook hook, cr_cb_callback_t func,
 int cr_register_chkpt_callback(cr_cb_callback_t func, void *arg)
 {
 	return register_callback(CR_CB_CHECKPOINT, func, arg,
-				 SIGNAL_CONTEXT);
+				 SIGNAL_CONTEXT,
+				 CR_CB_DEFAULT_PRIORITY, 0);
 }
 
 int cr_register_restart_callback(cr_cb_callback_t func, void *arg)
 {
 	return register_callback(CR_CB_RESTART, func, arg,
-				 SIGNAL_CONTEXT);
+				 SIGNAL_CONTEXT,
+				 CR_CB_DEFAULT_PRIORITY, 0);
 }
 
 int cr_register_continue_callback(cr_cb_callback_t func, void *arg)
 {
 	return register_callback(CR_CB_CONTINUE, func, arg,
-				 SIGNAL_CONTEXT);
+				 SIGNAL_CONTEXT,
+				 CR_CB_DEFAULT_PRIORITY, 0);
 }
 
 // Thread context callbacks registration
@@ -563,17 +1940,196 @@ int cr_register_continue_callback(cr_cb_callback_t func, void *arg)
 int cr_register_chkpt_thread_callback(cr_cb_callback_t func, void *arg)
 {
 	return register_callback(CR_CB_CHECKPOINT, func, arg,
-				 THREAD_CONTEXT);
+				 THREAD_CONTEXT,
+				 CR_CB_DEFAULT_PRIORITY, 0);
 }
 
 int cr_register_restart_thread_callback(cr_cb_callback_t func, void *arg)
 {
 	return register_callback(CR_CB_RESTART, func, arg,
-				 THREAD_CONTEXT);
+				 THREAD_CONTEXT,
+				 CR_CB_DEFAULT_PRIORITY, 0);
 }
 
 int cr_register_continue_thread_callback(cr_cb_callback_t func, void *arg)
 {
 	return register_callback(CR_CB_CONTINUE, func, arg,
-				 THREAD_CONTEXT);
+				 THREAD_CONTEXT,
+				 CR_CB_DEFAULT_PRIORITY, 0);
+}
+
+int cr_set_callback_budget(cr_cb_callback_t func, unsigned int budget_ms)
+{
+	enum cr_cb_hook hook;
+	struct cr_cb_table *table;
+	int idx, found = 0;
+
+	if (!info)
+		CR_CB_ABORT("Called without first calling cr_init()\n");
+
+	pthread_mutex_lock(&registry_lock);
+
+	for (hook = CR_CB_CHECKPOINT; hook <= CR_CB_CONTINUE; hook++) {
+		table = info->table[hook];
+		if (!table)
+			continue;
+		for (idx = 0; idx < table->nr; idx++)
+			if (table->cb[idx]->func == func) {
+				table->cb[idx]->budget_ms = budget_ms;
+				found = 1;
+			}
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	if (!found) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return 0;
+}
+
+static const char *hook_name(enum cr_cb_hook hook)
+{
+	switch (hook) {
+		case CR_CB_CHECKPOINT:
+			return "checkpoint";
+		case CR_CB_RESTART:
+			return "restart";
+		case CR_CB_CONTINUE:
+			return "continue";
+		default:
+			return "unknown";
+	}
+}
+
+int cr_callback_get_stats(struct cr_cb_stats **stats)
+{
+	enum cr_cb_hook hook;
+	struct cr_cb_table *table;
+	struct cr_cb_callback_s *cr_cb;
+	struct cr_cb_stats *array;
+	int idx, nr = 0;
+
+	if (!info)
+		CR_CB_ABORT("Called without first calling cr_init()\n");
+
+	pthread_mutex_lock(&registry_lock);
+
+	for (hook = CR_CB_CHECKPOINT; hook <= CR_CB_CONTINUE; hook++)
+		if (info->table[hook])
+			nr += info->table[hook]->nr;
+
+	array = calloc(nr ? nr : 1, sizeof(*array));
+	if (!array) {
+		pthread_mutex_unlock(&registry_lock);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	nr = 0;
+	for (hook = CR_CB_CHECKPOINT; hook <= CR_CB_CONTINUE; hook++) {
+		table = info->table[hook];
+		for (idx = 0; table && idx < table->nr; idx++, nr++) {
+			cr_cb = table->cb[idx];
+
+			array[nr].hook = hook;
+			array[nr].func = cr_cb->func;
+			array[nr].arg = cr_cb->arg;
+			array[nr].priority = cr_cb->priority;
+			if (cr_cb->thread_cb)
+				array[nr].flags |= CR_CB_THREAD;
+			if (cr_cb->independent)
+				array[nr].flags |= CR_CB_INDEPENDENT;
+			array[nr].count = cr_cb->count;
+			array[nr].total_us = cr_cb->total_us;
+			array[nr].max_us = cr_cb->max_us;
+			array[nr].last_us = cr_cb->last_us;
+			memcpy(array[nr].hist, cr_cb->hist,
+			       sizeof(array[nr].hist));
+		}
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	*stats = array;
+
+	return nr;
+}
+
+void cr_callback_reset_stats(void)
+{
+	enum cr_cb_hook hook;
+	struct cr_cb_table *table;
+	struct cr_cb_callback_s *cr_cb;
+	int idx;
+
+	if (!info)
+		CR_CB_ABORT("Called without first calling cr_init()\n");
+
+	pthread_mutex_lock(&registry_lock);
+
+	for (hook = CR_CB_CHECKPOINT; hook <= CR_CB_CONTINUE; hook++) {
+		table = info->table[hook];
+		for (idx = 0; table && idx < table->nr; idx++) {
+			cr_cb = table->cb[idx];
+			cr_cb->count = 0;
+			cr_cb->total_us = 0;
+			cr_cb->max_us = 0;
+			cr_cb->last_us = 0;
+			memset(cr_cb->hist, 0, sizeof(cr_cb->hist));
+		}
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/*
+ * The format is stable: tools may parse it. Fields are separated by
+ * spaces, one callback per line, after a version line and a comment
+ * line naming the fields.
+ */
+int cr_callback_dump_stats(int fd)
+{
+	struct cr_cb_stats *stats;
+	FILE *file;
+	int i, j, nr, r = 0;
+
+	nr = cr_callback_get_stats(&stats);
+	if (nr < 0)
+		return -1;
+
+	fd = dup(fd);
+	if (fd < 0 || !(file = fdopen(fd, "w"))) {
+		if (fd >= 0)
+			close(fd);
+		free(stats);
+		return -1;
+	}
+
+	fprintf(file, "krgcb-stats 1 pid %d buckets %d\n", getpid(),
+		CR_CB_HIST_BUCKETS);
+	fprintf(file, "# hook func arg priority context count total_us "
+		"max_us last_us hist...\n");
+
+	for (i = 0; i < nr; i++) {
+		fprintf(file, "%s %p %p %d %s %lu %llu %u %u",
+			hook_name(stats[i].hook), (void *)stats[i].func,
+			stats[i].arg, stats[i].priority,
+			!(stats[i].flags & CR_CB_THREAD) ? "signal"
+			: (stats[i].flags & CR_CB_INDEPENDENT) ? "independent"
+			: "thread",
+			stats[i].count, stats[i].total_us, stats[i].max_us,
+			stats[i].last_us);
+		for (j = 0; j < CR_CB_HIST_BUCKETS; j++)
+			fprintf(file, " %lu", stats[i].hist[j]);
+		fputc('\n', file);
+	}
+
+	if (fclose(file))
+		r = -1;
+	free(stats);
+
+	return r;
 }
@@ -0,0 +1,288 @@
+/** Kerrighed Checkpoint-Library Interface
+ *  @file excl_arena.c
+ *
+ *  Allocation of memory excluded from checkpoints, out of a few large
+ *  arenas each registered once with cr_exclude_on().
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <libkrgcheckpoint.h>
+
+#define CHUNK_SHIFT 6
+#define CHUNK_SIZE (1UL << CHUNK_SHIFT)
+#define BITS_PER_LONG (CHAR_BIT * sizeof(unsigned long))
+
+/*
+ * The content of an arena is lost on restart, so the allocator state is
+ * kept out of it: allocations are runs of chunks, tracked in a bitmap of
+ * used chunks and a bitmap of the first chunk of each run.
+ */
+struct cr_excl_arena
+{
+	char *base;
+	size_t size;
+
+	unsigned long nr_chunks;
+	unsigned long *used;
+	unsigned long *first;
+	unsigned long hint;
+
+	/* arena of cr_excl_malloc(), without restart callback */
+	int shared;
+
+	struct cr_excl_arena *next;
+};
+
+static struct cr_excl_arena *first_arena = NULL;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int test_chunk(const unsigned long *map, unsigned long n)
+{
+	return (map[n / BITS_PER_LONG] >> (n % BITS_PER_LONG)) & 1;
+}
+
+static inline void set_chunk(unsigned long *map, unsigned long n)
+{
+	map[n / BITS_PER_LONG] |= 1UL << (n % BITS_PER_LONG);
+}
+
+static inline void clear_chunk(unsigned long *map, unsigned long n)
+{
+	map[n / BITS_PER_LONG] &= ~(1UL << (n % BITS_PER_LONG));
+}
+
+/* Return the first chunk of a free run of nr chunks at or after start,
+ * or the number of chunks of the arena if there is none */
+static unsigned long find_free_run(struct cr_excl_arena *arena,
+				   unsigned long start, unsigned long nr)
+{
+	unsigned long n = start, run = 0;
+
+	while (n < arena->nr_chunks) {
+		if (!(n % BITS_PER_LONG)
+		    && arena->used[n / BITS_PER_LONG] == ~0UL) {
+			n += BITS_PER_LONG;
+			run = 0;
+			continue;
+		}
+
+		if (test_chunk(arena->used, n))
+			run = 0;
+		else if (++run == nr)
+			return n + 1 - nr;
+		n++;
+	}
+
+	return arena->nr_chunks;
+}
+
+static void *arena_alloc(struct cr_excl_arena *arena, size_t size)
+{
+	unsigned long nr, start, n;
+
+	if (!size)
+		size = 1;
+	if (size > arena->size)
+		return NULL;
+	nr = (size + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+
+	start = find_free_run(arena, arena->hint, nr);
+	if (start == arena->nr_chunks && arena->hint)
+		start = find_free_run(arena, 0, nr);
+	if (start == arena->nr_chunks)
+		return NULL;
+
+	set_chunk(arena->first, start);
+	for (n = start; n < start + nr; n++)
+		set_chunk(arena->used, n);
+
+	arena->hint = start + nr;
+	if (arena->hint == arena->nr_chunks)
+		arena->hint = 0;
+
+	return arena->base + (start << CHUNK_SHIFT);
+}
+
+static int arena_free(struct cr_excl_arena *arena, void *ptr)
+{
+	unsigned long start, n;
+
+	start = ((char *)ptr - arena->base) >> CHUNK_SHIFT;
+	if (((char *)ptr - arena->base) & (CHUNK_SIZE - 1)
+	    || !test_chunk(arena->first, start))
+		return -1;
+
+	clear_chunk(arena->first, start);
+	n = start;
+	do {
+		clear_chunk(arena->used, n);
+		n++;
+	} while (n < arena->nr_chunks && test_chunk(arena->used, n)
+		 && !test_chunk(arena->first, n));
+
+	if (start < arena->hint)
+		arena->hint = start;
+
+	return 0;
+}
+
+static struct cr_excl_arena *new_arena(size_t size,
+				       cr_mm_excl_callback_t func, void *arg)
+{
+	struct cr_excl_arena *arena;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t map_size;
+
+	size = (size + page_size - 1) & ~(page_size - 1);
+	if (!size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+
+	arena->size = size;
+	arena->nr_chunks = size >> CHUNK_SHIFT;
+	map_size = (arena->nr_chunks + BITS_PER_LONG - 1) / BITS_PER_LONG;
+
+	arena->used = calloc(map_size, sizeof(unsigned long));
+	arena->first = calloc(map_size, sizeof(unsigned long));
+	if (!arena->used || !arena->first)
+		goto err_map;
+
+	arena->base = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (arena->base == MAP_FAILED)
+		goto err_map;
+
+	if (cr_exclude_on(arena->base, size, func, arg))
+		goto err_exclude;
+
+	arena->next = first_arena;
+	first_arena = arena;
+
+	return arena;
+
+err_exclude:
+	munmap(arena->base, size);
+err_map:
+	free(arena->used);
+	free(arena->first);
+	free(arena);
+	return NULL;
+}
+
+struct cr_excl_arena *cr_excl_arena_create(size_t size,
+					   cr_mm_excl_callback_t func,
+					   void *arg)
+{
+	struct cr_excl_arena *arena;
+
+	pthread_mutex_lock(&arenas_lock);
+	arena = new_arena(size, func, arg);
+	pthread_mutex_unlock(&arenas_lock);
+
+	return arena;
+}
+
+int cr_excl_arena_destroy(struct cr_excl_arena *arena)
+{
+	struct cr_excl_arena **prev;
+
+	pthread_mutex_lock(&arenas_lock);
+
+	for (prev = &first_arena; *prev; prev = &(*prev)->next)
+		if (*prev == arena)
+			break;
+
+	if (!*prev) {
+		pthread_mutex_unlock(&arenas_lock);
+		errno = EINVAL;
+		return -1;
+	}
+
+	*prev = arena->next;
+	cr_exclude_off(arena->base);
+
+	pthread_mutex_unlock(&arenas_lock);
+
+	munmap(arena->base, arena->size);
+	free(arena->used);
+	free(arena->first);
+	free(arena);
+
+	return 0;
+}
+
+void *cr_excl_arena_malloc(struct cr_excl_arena *arena, size_t size)
+{
+	void *ptr;
+
+	pthread_mutex_lock(&arenas_lock);
+	ptr = arena_alloc(arena, size);
+	pthread_mutex_unlock(&arenas_lock);
+
+	if (!ptr)
+		errno = ENOMEM;
+
+	return ptr;
+}
+
+void *cr_excl_malloc(size_t size)
+{
+	struct cr_excl_arena *arena;
+	void *ptr = NULL;
+
+	pthread_mutex_lock(&arenas_lock);
+
+	for (arena = first_arena; arena; arena = arena->next) {
+		if (!arena->shared)
+			continue;
+
+		ptr = arena_alloc(arena, size);
+		if (ptr)
+			goto out;
+	}
+
+	arena = new_arena(size > CR_EXCL_ARENA_SIZE ? size : CR_EXCL_ARENA_SIZE,
+			  NULL, NULL);
+	if (arena) {
+		arena->shared = 1;
+		ptr = arena_alloc(arena, size);
+	}
+
+out:
+	pthread_mutex_unlock(&arenas_lock);
+
+	if (!ptr)
+		errno = ENOMEM;
+
+	return ptr;
+}
+
+void cr_excl_free(void *ptr)
+{
+	struct cr_excl_arena *arena;
+
+	if (!ptr)
+		return;
+
+	pthread_mutex_lock(&arenas_lock);
+
+	for (arena = first_arena; arena; arena = arena->next)
+		if ((char *)ptr >= arena->base
+		    && (char *)ptr < arena->base + arena->size) {
+			arena_free(arena, ptr);
+			break;
+		}
+
+	pthread_mutex_unlock(&arenas_lock);
+}
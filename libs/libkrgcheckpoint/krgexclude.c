@@ -0,0 +1,543 @@
+/** Kerrighed Checkpoint-Library Interface
+ *  @file krgexclude.c
+ *
+ *  Preloadable library excluding memory regions of unmodified programs
+ *  from checkpoints:
+ *
+ *    LD_PRELOAD=libkrgexclude.so KRGCR_EXCLUDE="anon:64M" program
+ *
+ *  Rules are read from KRGCR_EXCLUDE, separated by ';', and from the file
+ *  named by KRGCR_EXCLUDE_FILE, one per line ('#' starts a comment):
+ *
+ *    anon:<size>[K|M|G]      anonymous mappings of at least <size> bytes
+ *                            made by the program through mmap()
+ *    name:<pattern>          mappings of files matching the shell
+ *                            <pattern>, as named in /proc/<pid>/maps
+ *    range:<start>-<end>     the part of any mapping within [start, end)
+ *
+ *  With KRGCR_SHRINK set, memory is also released before checkpoints, as
+ *  cr_shrink_init() does.
+ *
+ *  Matching regions are registered with cr_exclude_on() as they are
+ *  mapped, follow them through mremap(), and are unregistered as they are
+ *  unmapped, so that they are handed
+ *  to the kernel by the checkpoint callback of libkrgcheckpoint. Their
+ *  content is not restored on restart: the program must be able to
+ *  rebuild it (caches) or never read it again.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <libkrgcheckpoint.h>
+
+enum rule_type {
+	RULE_ANON,
+	RULE_NAME,
+	RULE_RANGE,
+};
+
+struct exclude_rule
+{
+	enum rule_type type;
+	size_t min_size;
+	char *pattern;
+	unsigned long start, end;
+
+	struct exclude_rule *next;
+};
+
+/* regions registered with cr_exclude_on(), sorted by address */
+struct exclude_region
+{
+	unsigned long start, end;
+};
+
+static struct exclude_rule *first_rule = NULL;
+static int has_name_rules = 0;
+
+static struct exclude_region *regions = NULL;
+static int nr_regions = 0;
+static int max_regions = 0;
+
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* set while the calling thread updates regions, during which mappings
+ * made by the libraries are not tracked */
+static __thread int tracking = 0;
+
+int cr_mm_exclusion_init(void);
+
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t) = NULL;
+static void *(*real_mmap64)(void *, size_t, int, int, int, off64_t) = NULL;
+static int (*real_munmap)(void *, size_t) = NULL;
+static void *(*real_mremap)(void *, size_t, size_t, int, ...) = NULL;
+
+static int parse_size(const char *str, size_t *size)
+{
+	unsigned long long value;
+	char *end;
+
+	errno = 0;
+	value = strtoull(str, &end, 0);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		value <<= 10;
+	case 'M':
+	case 'm':
+		value <<= 10;
+	case 'K':
+	case 'k':
+		value <<= 10;
+		end++;
+	}
+
+	if (*end)
+		return -1;
+
+	*size = value;
+	return 0;
+}
+
+static int parse_rule(char *str)
+{
+	struct exclude_rule *rule;
+	char *end;
+
+	while (*str == ' ' || *str == '\t')
+		str++;
+	end = str + strlen(str);
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t'
+			     || end[-1] == '\n'))
+		*--end = '\0';
+
+	if (!*str || *str == '#')
+		return 0;
+
+	rule = calloc(1, sizeof(*rule));
+	if (!rule)
+		return -1;
+
+	if (!strncmp(str, "anon:", 5)) {
+		rule->type = RULE_ANON;
+		if (parse_size(str + 5, &rule->min_size))
+			goto err_rule;
+	} else if (!strncmp(str, "name:", 5)) {
+		rule->type = RULE_NAME;
+		rule->pattern = strdup(str + 5);
+		if (!rule->pattern)
+			goto err_rule;
+		has_name_rules = 1;
+	} else if (!strncmp(str, "range:", 6)) {
+		rule->type = RULE_RANGE;
+		errno = 0;
+		rule->start = strtoul(str + 6, &end, 16);
+		if (errno || *end != '-')
+			goto err_rule;
+		rule->end = strtoul(end + 1, &end, 16);
+		if (errno || *end || rule->end <= rule->start)
+			goto err_rule;
+	} else {
+		goto err_rule;
+	}
+
+	rule->next = first_rule;
+	first_rule = rule;
+
+	return 0;
+
+err_rule:
+	fprintf(stderr, "krgexclude: invalid rule: %s\n", str);
+	free(rule);
+	return -1;
+}
+
+static void parse_rules(void)
+{
+	char line[PATH_MAX + 16];
+	char *env, *rules, *rule, *saveptr;
+	FILE *file;
+
+	env = getenv("KRGCR_EXCLUDE");
+	if (env) {
+		rules = strdup(env);
+		if (!rules)
+			return;
+
+		for (rule = strtok_r(rules, ";", &saveptr); rule;
+		     rule = strtok_r(NULL, ";", &saveptr))
+			parse_rule(rule);
+
+		free(rules);
+	}
+
+	env = getenv("KRGCR_EXCLUDE_FILE");
+	if (!env)
+		return;
+
+	file = fopen(env, "r");
+	if (!file) {
+		perror(env);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), file))
+		parse_rule(line);
+
+	fclose(file);
+}
+
+/* Return the index of the first region ending after addr */
+static int find_region(unsigned long addr)
+{
+	int low = 0, high = nr_regions;
+	int middle;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (regions[middle].end <= addr)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+static void add_region(unsigned long start, unsigned long end)
+{
+	struct exclude_region *new_regions;
+	int i, max;
+
+	i = find_region(start);
+	/* already excluded by another rule */
+	if (i < nr_regions && regions[i].start < end)
+		return;
+
+	if (nr_regions == max_regions) {
+		max = max_regions ? 2 * max_regions : 64;
+		new_regions = realloc(regions, max * sizeof(*regions));
+		if (!new_regions)
+			return;
+		regions = new_regions;
+		max_regions = max;
+	}
+
+	if (cr_exclude_on((void *)start, end - start, NULL, NULL))
+		return;
+
+	memmove(&regions[i + 1], &regions[i],
+		(nr_regions - i) * sizeof(*regions));
+	regions[i].start = start;
+	regions[i].end = end;
+	nr_regions++;
+}
+
+/* Unregister [start, end), keeping what is left of partly unmapped
+ * regions */
+static void remove_regions(unsigned long start, unsigned long end)
+{
+	struct exclude_region region;
+	int i;
+
+	i = find_region(start);
+	while (i < nr_regions && regions[i].start < end) {
+		region = regions[i];
+
+		cr_exclude_off((void *)region.start);
+		nr_regions--;
+		memmove(&regions[i], &regions[i + 1],
+			(nr_regions - i) * sizeof(*regions));
+
+		if (region.start < start)
+			add_region(region.start, start);
+		if (region.end > end)
+			add_region(end, region.end);
+
+		i = find_region(start);
+	}
+}
+
+/* Copy the regions overlapping [start, end), return their number */
+static int save_regions(unsigned long start, unsigned long end,
+			struct exclude_region **saved)
+{
+	int i, nr;
+
+	*saved = NULL;
+
+	i = find_region(start);
+	for (nr = 0; i + nr < nr_regions && regions[i + nr].start < end; nr++)
+		;
+	if (!nr)
+		return 0;
+
+	*saved = malloc(nr * sizeof(**saved));
+	if (!*saved)
+		return 0;
+	memcpy(*saved, &regions[i], nr * sizeof(**saved));
+
+	return nr;
+}
+
+/*
+ * Register again the part within [start, end) of the saved regions, moved
+ * to new_start. A region reaching end reaches new_end.
+ */
+static void restore_regions(const struct exclude_region *saved, int nr,
+			    unsigned long start, unsigned long end,
+			    unsigned long new_start, unsigned long new_end)
+{
+	unsigned long region_start, region_end;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		region_start = saved[i].start > start ? saved[i].start : start;
+		region_start = region_start - start + new_start;
+		if (saved[i].end >= end)
+			region_end = new_end;
+		else
+			region_end = saved[i].end - start + new_start;
+		if (region_end > new_end)
+			region_end = new_end;
+
+		if (region_start < region_end)
+			add_region(region_start, region_end);
+	}
+}
+
+static void consider_mapping(unsigned long start, unsigned long end,
+			     int anon, const char *name)
+{
+	struct exclude_rule *rule;
+
+	for (rule = first_rule; rule; rule = rule->next) {
+		switch (rule->type) {
+		case RULE_ANON:
+			if (anon && end - start >= rule->min_size)
+				add_region(start, end);
+			break;
+		case RULE_NAME:
+			if (name && !fnmatch(rule->pattern, name, 0))
+				add_region(start, end);
+			break;
+		case RULE_RANGE:
+			if (rule->start < end && rule->end > start)
+				add_region(rule->start > start ?
+					   rule->start : start,
+					   rule->end < end ? rule->end : end);
+			break;
+		}
+	}
+}
+
+/* mappings present before the program starts, named or in ranges */
+static void scan_mappings(void)
+{
+	char line[PATH_MAX + 128], *name;
+	unsigned long start, end;
+	FILE *maps;
+
+	maps = fopen("/proc/self/maps", "r");
+	if (!maps)
+		return;
+
+	while (fgets(line, sizeof(line), maps)) {
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+			continue;
+
+		name = strchr(line, '/');
+		if (name)
+			name[strcspn(name, "\n")] = '\0';
+
+		consider_mapping(start, end, 0, name);
+	}
+
+	fclose(maps);
+}
+
+static unsigned long page_end(unsigned long start, size_t length)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	return start + ((length + page_size - 1) & ~(page_size - 1));
+}
+
+static void track_mmap(void *addr, size_t length, int flags, int fd)
+{
+	char link[32], path[PATH_MAX], *name = NULL;
+	unsigned long start = (unsigned long)addr;
+	unsigned long end;
+	ssize_t r;
+
+	if (addr == MAP_FAILED)
+		return;
+
+	end = page_end(start, length);
+
+	if (!(flags & MAP_ANONYMOUS) && fd >= 0 && has_name_rules) {
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+		r = readlink(link, path, sizeof(path) - 1);
+		if (r > 0) {
+			path[r] = '\0';
+			name = path;
+		}
+	}
+
+	pthread_mutex_lock(&regions_lock);
+	tracking = 1;
+	/* MAP_FIXED may replace excluded mappings */
+	remove_regions(start, end);
+	consider_mapping(start, end, flags & MAP_ANONYMOUS, name);
+	tracking = 0;
+	pthread_mutex_unlock(&regions_lock);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+	   off_t offset)
+{
+	void *r;
+
+	if (!real_mmap)
+		real_mmap = dlsym(RTLD_NEXT, "mmap");
+
+	r = real_mmap(addr, length, prot, flags, fd, offset);
+	if (first_rule && !tracking)
+		track_mmap(r, length, flags, fd);
+
+	return r;
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd,
+	     off64_t offset)
+{
+	void *r;
+
+	if (!real_mmap64)
+		real_mmap64 = dlsym(RTLD_NEXT, "mmap64");
+
+	r = real_mmap64(addr, length, prot, flags, fd, offset);
+	if (first_rule && !tracking)
+		track_mmap(r, length, flags, fd);
+
+	return r;
+}
+
+/*
+ * Regions are unregistered before the memory is unmapped, so that neither
+ * a checkpoint nor a region mapped meanwhile by another thread at the same
+ * address sees a stale region.
+ */
+int munmap(void *addr, size_t length)
+{
+	unsigned long start = (unsigned long)addr;
+	unsigned long end = page_end(start, length);
+	struct exclude_region *saved;
+	int nr_saved, r;
+
+	if (!real_munmap)
+		real_munmap = dlsym(RTLD_NEXT, "munmap");
+
+	if (!first_rule || tracking)
+		return real_munmap(addr, length);
+
+	pthread_mutex_lock(&regions_lock);
+	tracking = 1;
+	nr_saved = save_regions(start, end, &saved);
+	remove_regions(start, end);
+
+	r = real_munmap(addr, length);
+	if (r)
+		restore_regions(saved, nr_saved, start, end, start, end);
+
+	tracking = 0;
+	pthread_mutex_unlock(&regions_lock);
+	free(saved);
+
+	return r;
+}
+
+/* Excluded parts of a mapping stay excluded where it moves or grows */
+void *mremap(void *old_address, size_t old_size, size_t new_size,
+	     int flags, ...)
+{
+	unsigned long start = (unsigned long)old_address;
+	unsigned long end = page_end(start, old_size);
+	unsigned long new_start, new_end;
+	struct exclude_region *saved;
+	void *new_address = NULL, *r;
+	int nr_saved, _errno;
+	va_list args;
+
+	if (flags & MREMAP_FIXED) {
+		va_start(args, flags);
+		new_address = va_arg(args, void *);
+		va_end(args);
+	}
+
+	if (!real_mremap)
+		real_mremap = dlsym(RTLD_NEXT, "mremap");
+
+	if (!first_rule || tracking)
+		return real_mremap(old_address, old_size, new_size, flags,
+				   new_address);
+
+	pthread_mutex_lock(&regions_lock);
+	tracking = 1;
+	nr_saved = save_regions(start, end, &saved);
+	remove_regions(start, end);
+
+	r = real_mremap(old_address, old_size, new_size, flags, new_address);
+	_errno = errno;
+	if (r == MAP_FAILED) {
+		restore_regions(saved, nr_saved, start, end, start, end);
+	} else {
+		new_start = (unsigned long)r;
+		new_end = page_end(new_start, new_size);
+
+		/* MREMAP_FIXED replaces what was mapped there */
+		remove_regions(new_start, new_end);
+		restore_regions(saved, nr_saved, start, end,
+				new_start, new_end);
+		consider_mapping(new_start, new_end, 0, NULL);
+	}
+
+	tracking = 0;
+	pthread_mutex_unlock(&regions_lock);
+	free(saved);
+
+	errno = _errno;
+	return r;
+}
+
+void __attribute__ ((constructor)) krgexclude_init(void)
+{
+	if (getenv("KRGCR_SHRINK"))
+		cr_shrink_init();
+
+	parse_rules();
+	if (!first_rule)
+		return;
+
+	pthread_mutex_lock(&regions_lock);
+	tracking = 1;
+	/* callbacks are needed even if nothing is excluded yet */
+	cr_mm_exclusion_init();
+	scan_mappings();
+	tracking = 0;
+	pthread_mutex_unlock(&regions_lock);
+}
@@ -3,20 +3,28 @@
  *
  *  @author Matthieu Fertré
  */
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include <types.h>
 #include <kerrighed_tools.h>
 #include <checkpoint.h>
 #include <libkrgcb.h>
+#include <estimate.h>
 #include <libkrgcheckpoint.h>
 
+#include "krgcb_private.h"
+
 int cr_disable(void)
 {
 	return call_kerrighed_services(KSYS_APP_CR_DISABLE, NULL);
@@ -27,112 +35,426 @@ int cr_enable(void)
 	return call_kerrighed_services(KSYS_APP_CR_ENABLE, NULL);
 }
 
-/**
- * container_of - cast a member of a structure out to the containing structure
- * @ptr:        the pointer to the member.
- * @type:       the type of the container struct this is embedded in.
- * @member:     the name of the member within the struct.
- *
+/*
+ * Sections nest per thread: only the outermost begin and end reach the
+ * kernel. In batch mode, the enable of an outermost end is deferred, so
+ * that the next section of the thread needs no syscall, until the batch
+ * reaches max_sections or lasts max_us.
  */
-#define container_of(ptr, type, member) ({                      \
-			const typeof( ((type *)0)->member ) *__mptr = (ptr); \
-			(type *)( (char *)__mptr - offsetof(type,member) );})
+struct cr_section_state
+{
+	unsigned int depth;
+	int disabled;
+
+	unsigned int nr_deferred;
+	struct timespec deadline;
+};
+
+static __thread struct cr_section_state section;
+
+static unsigned int batch_max_sections = 0;
+static unsigned int batch_max_us = 0;
+
+int cr_section_batch(unsigned int max_sections, unsigned int max_us)
+{
+	batch_max_sections = max_sections;
+	batch_max_us = max_us;
+
+	return 0;
+}
+
+int cr_section_begin(void)
+{
+	if (section.depth++ || section.disabled)
+		return 0;
+
+	if (cr_disable()) {
+		section.depth--;
+		return -1;
+	}
+	section.disabled = 1;
+
+	return 0;
+}
+
+static int batch_expired(void)
+{
+	struct timespec now;
+
+	/* the section ending counts in the batch */
+	if (section.nr_deferred + 1 >= batch_max_sections)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!section.nr_deferred) {
+		section.deadline.tv_sec = now.tv_sec + batch_max_us / 1000000;
+		section.deadline.tv_nsec = now.tv_nsec
+			+ (batch_max_us % 1000000) * 1000;
+		if (section.deadline.tv_nsec >= 1000000000) {
+			section.deadline.tv_sec++;
+			section.deadline.tv_nsec -= 1000000000;
+		}
+		return 0;
+	}
 
+	return now.tv_sec > section.deadline.tv_sec
+		|| (now.tv_sec == section.deadline.tv_sec
+		    && now.tv_nsec >= section.deadline.tv_nsec);
+}
+
+int cr_section_flush(void)
+{
+	if (section.depth || !section.disabled)
+		return 0;
+
+	section.nr_deferred = 0;
+	section.disabled = 0;
+
+	return cr_enable();
+}
+
+int cr_section_end(void)
+{
+	if (!section.depth) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (--section.depth)
+		return 0;
+
+	if (batch_max_sections && !batch_expired()) {
+		section.nr_deferred++;
+		return 0;
+	}
+
+	return cr_section_flush();
+}
+
+/*
+ * Excluded regions are indexed in an array sorted by address, so that
+ * lookups are done by binary search and overlapping registrations are
+ * detected. The array handed to the kernel is kept apart: it is only
+ * rebuilt, merging adjacent regions, at the first checkpoint following a
+ * change, without allocating memory since it runs from a signal handler.
+ *
+ * The checkpoint callback may interrupt any thread: updates are done under
+ * excluded_lock, which the callbacks take too, with the signals of the
+ * requests blocked so that no callback waits for the thread it
+ * interrupted. The lock is recursive since restart callbacks of regions
+ * may register regions again.
+ */
 struct cr_mm_region_excluded
 {
-	struct cr_mm_region region;
+	unsigned long addr;
+	size_t size;
 
 	cr_mm_excl_callback_t func;
 	void *arg;
 };
 
-static
-struct cr_mm_region_excluded *next_region(struct cr_mm_region_excluded *mm_region)
+static struct cr_mm_region_excluded *excluded = NULL;
+static int nr_excluded = 0;
+static int max_excluded = 0;
+
+static unsigned long long excluded_bytes = 0;
+
+static struct cr_mm_region *excluded_payload = NULL;
+static int excluded_payload_dirty = 0;
+static pid_t excluded_payload_pid = 0;
+
+#define MIN_EXCLUDED_REGIONS 64
+
+static pthread_mutex_t excluded_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static void lock_excluded(sigset_t *oldset)
 {
-	struct cr_mm_region_excluded *next;
-	struct cr_mm_region *intern;
-
-	intern = mm_region->region.next;
-	if (intern)
-		next = container_of(intern,
-				    struct cr_mm_region_excluded,
-				    region);
-	else
-		next = NULL;
-
-	return next;
+	cr_callback_block(oldset);
+	pthread_mutex_lock(&excluded_lock);
 }
 
-struct child_process
+static void unlock_excluded(const sigset_t *oldset)
 {
-	pid_t pid;
-	struct child_process *next;
-};
+	pthread_mutex_unlock(&excluded_lock);
+	cr_callback_unblock(oldset);
+}
 
-static struct cr_mm_region_excluded *first_mm_region_excluded = NULL;
-static struct child_process *first_child = NULL;
-static int initialized = 0;
-static int pipefd[2];
-int cr_mm_exclusion_init(void);
+/*
+ * What is excluded, published for checkpoint estimations. The object is
+ * written at once so that it is neither mapped nor open when the process
+ * is checkpointed.
+ */
+static struct chkpt_excluded_info published;
 
-static void add_child(pid_t pid)
+static void publish_excluded(void)
 {
-	struct child_process *child;
-	int r;
+	pid_t pid = getpid();
+	char name[64];
+	int fd;
 
-	r = cr_mm_exclusion_init();
-	if (r)
+	/* the identity of the parent after fork */
+	if (published.pid != pid
+	    && chkpt_excluded_identify(pid, &published)) {
+		published.pid = 0;
 		return;
+	}
 
-	child = malloc(sizeof(struct child_process));
-	if (!child)
+	published.nr_regions = nr_excluded;
+	published.bytes = excluded_bytes;
+
+	snprintf(name, sizeof(name), CHKPT_EXCLUDED_SHM, pid);
+	fd = shm_open(name, O_WRONLY|O_CREAT, 0644);
+	if (fd == -1)
 		return;
 
-	child->pid = pid;
-	if (first_child)
-		child->next = first_child->next;
-	else
-		child->next = NULL;
+	if (pwrite(fd, &published, sizeof(published), 0)
+	    != sizeof(published))
+		shm_unlink(name);
+	close(fd);
+}
+
+/*
+ * Changes are published by publisher_thread at most once per
+ * PUBLISH_INTERVAL_MS, so that registering many regions costs no syscall.
+ */
+#define PUBLISH_INTERVAL_MS 100
+
+static pthread_mutex_t publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t publish_cond = PTHREAD_COND_INITIALIZER;
+static int publish_requested = 0;	/* under publish_mutex */
+static int publish_pending = 0;		/* under excluded_lock */
+static pid_t publisher_pid = 0;		/* process running the thread */
+
+static void *publisher_thread(void *arg)
+{
+	struct timespec delay = { 0, PUBLISH_INTERVAL_MS * 1000000L };
+	sigset_t set;
+
+	/* callbacks never run here, excluded_lock is taken as is */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;) {
+		pthread_mutex_lock(&publish_mutex);
+		while (!publish_requested)
+			pthread_cond_wait(&publish_cond, &publish_mutex);
+		publish_requested = 0;
+		pthread_mutex_unlock(&publish_mutex);
+
+		/* let the changes made meanwhile coalesce */
+		nanosleep(&delay, NULL);
+
+		pthread_mutex_lock(&excluded_lock);
+		if (publish_pending) {
+			publish_pending = 0;
+			publish_excluded();
+		}
+		pthread_mutex_unlock(&excluded_lock);
+	}
+
+	return NULL;
+}
+
+/* Called with excluded_lock held */
+static void excluded_changed(void)
+{
+	pthread_t thread;
+	pid_t pid;
+
+	if (publish_pending)
+		return;
+	publish_pending = 1;
+
+	pid = getpid();
+	if (publisher_pid != pid) {
+		if (pthread_create(&thread, NULL, publisher_thread, NULL)) {
+			publish_pending = 0;
+			publish_excluded();
+			return;
+		}
+		pthread_detach(thread);
+		publisher_pid = pid;
+	}
+
+	pthread_mutex_lock(&publish_mutex);
+	publish_requested = 1;
+	pthread_cond_signal(&publish_cond);
+	pthread_mutex_unlock(&publish_mutex);
+}
+
+static void unpublish_excluded(void)
+{
+	char name[64];
+
+	if (published.pid != getpid())
+		return;
+
+	snprintf(name, sizeof(name), CHKPT_EXCLUDED_SHM, published.pid);
+	shm_unlink(name);
+	published.pid = 0;
+}
+
+/* Return the index of the first region not below addr */
+static int find_region(unsigned long addr)
+{
+	int low = 0, high = nr_excluded;
+	int middle;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (excluded[middle].addr < addr)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+static int grow_excluded_regions(void)
+{
+	struct cr_mm_region_excluded *regions;
+	struct cr_mm_region *payload;
+	int max;
+
+	max = max_excluded ? 2 * max_excluded : MIN_EXCLUDED_REGIONS;
+
+	regions = realloc(excluded, max * sizeof(*regions));
+	if (!regions)
+		return -1;
+	excluded = regions;
+
+	payload = realloc(excluded_payload, max * sizeof(*payload));
+	if (!payload)
+		return -1;
+	excluded_payload = payload;
+
+	max_excluded = max;
+
+	/* next pointers refer to the old array */
+	excluded_payload_dirty = 1;
+
+	return 0;
+}
+
+/* Return the number of regions handed to the kernel */
+static int build_excluded_payload(void)
+{
+	struct cr_mm_region *region = NULL;
+	pid_t pid = getpid();
+	int i, nr = 0;
+
+	if (!excluded_payload_dirty) {
+		/* update pid is needed in case of fork */
+		if (pid != excluded_payload_pid)
+			for (region = excluded_payload; region;
+			     region = region->next)
+				region->pid = pid;
+		excluded_payload_pid = pid;
+		return nr_excluded ? 1 : 0;
+	}
+
+	for (i = 0; i < nr_excluded; i++) {
+		if (region && region->addr + region->size == excluded[i].addr) {
+			region->size += excluded[i].size;
+			continue;
+		}
+
+		if (region)
+			region->next = &excluded_payload[nr];
+		region = &excluded_payload[nr++];
+		region->pid = pid;
+		region->addr = excluded[i].addr;
+		region->size = excluded[i].size;
+		region->next = NULL;
+	}
+
+	excluded_payload_pid = pid;
+	excluded_payload_dirty = 0;
 
-	first_child = child;
+	return nr;
 }
 
-static void remove_all_children()
+/*
+ * Children are tracked in a hash table of pids, preallocated in a shared
+ * mapping inherited by all the processes forked after initialization.
+ * Each child registers itself with its parent pid after fork, and entries
+ * are removed from the SIGCHLD handler, so that fork needs neither a
+ * handshake with the parent nor memory allocation. Entries are updated
+ * with compare and swap only, since they are shared between processes.
+ */
+#define NR_CHILD_SLOTS 4096
+
+#define CHILD_SLOT_FREE 0ULL
+#define CHILD_SLOT_REMOVED (~0ULL)
+
+#define child_slot(ppid, pid) \
+	(((unsigned long long)(unsigned int)(ppid) << 32) | (unsigned int)(pid))
+#define slot_ppid(slot) ((pid_t)((slot) >> 32))
+#define slot_pid(slot) ((pid_t)((slot) & 0xffffffffULL))
+
+static volatile unsigned long long *children = NULL;
+static int initialized = 0;
+
+static inline unsigned int child_hash(pid_t pid)
 {
-	struct child_process *child, *next;
+	return ((unsigned int)pid * 2654435761U) % NR_CHILD_SLOTS;
+}
 
-	child = first_child;
-	while (child) {
-		next = child->next;
+/* async-signal-safe */
+static void add_child(pid_t ppid, pid_t pid)
+{
+	unsigned long long slot, old;
+	unsigned int i, n;
+
+	i = child_hash(pid);
+	for (n = 0; n < NR_CHILD_SLOTS; n++) {
+		old = children[i];
+
+		/* a stale entry of an earlier process with the same pid
+		 * is reused */
+		if (old == CHILD_SLOT_FREE || old == CHILD_SLOT_REMOVED
+		    || slot_pid(old) == pid) {
+			slot = child_slot(ppid, pid);
+			if (__sync_bool_compare_and_swap(&children[i], old, slot))
+				return;
+			/* taken by another process, look further */
+		}
 
-		free(child);
-		child = next;
+		i = (i + 1) % NR_CHILD_SLOTS;
 	}
-	first_child = NULL;
+
+	/* table full: the child will not get the requests of its parent */
 }
 
+/* async-signal-safe */
 static void remove_child(pid_t pid)
 {
-	struct child_process *child, *prev;
-
-	prev = NULL;
-	child = first_child;
-	while (child) {
-		if (child->pid == pid) {
-			if (!prev)
-				first_child = child->next;
-			else
-				prev->next = child->next;
-
-			free(child);
+	unsigned long long old;
+	unsigned int i, n;
+
+	i = child_hash(pid);
+	for (n = 0; n < NR_CHILD_SLOTS; n++) {
+		old = children[i];
+		if (old == CHILD_SLOT_FREE)
+			return;
+
+		if (old != CHILD_SLOT_REMOVED && slot_pid(old) == pid) {
+			__sync_bool_compare_and_swap(&children[i], old,
+						     CHILD_SLOT_REMOVED);
 			return;
 		}
 
-		prev = child;
-		child = child->next;
+		i = (i + 1) % NR_CHILD_SLOTS;
 	}
 }
 
+#define for_each_child(pid, i, slot)					\
+	for (i = 0; children && i < NR_CHILD_SLOTS; i++)		\
+		if ((slot = children[i]) != CHILD_SLOT_FREE		\
+		    && slot != CHILD_SLOT_REMOVED			\
+		    && slot_ppid(slot) == (pid))
+
 static void handle_sigchild(int signum, siginfo_t *siginfo, void *context)
 {
 	remove_child(siginfo->si_pid);
@@ -145,6 +467,7 @@ static int initiliaze_sigchild_handler(void)
 
 	sa.sa_sigaction = handle_sigchild;
 	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
 
 	r = sigaction(SIGCHLD, &sa, NULL);
 
@@ -153,99 +476,72 @@ static int initiliaze_sigchild_handler(void)
 
 int cr_mm_exclusion_checkpoint_cb(void *arg)
 {
-	int r;
-	struct cr_mm_region_excluded *mm_region;
-	struct child_process *child;
-
-	if (!first_mm_region_excluded)
-		return 0;
-
-	mm_region = first_mm_region_excluded;
-	while (mm_region) {
-
-		/* update pid is needed in case of fork */
-		mm_region->region.pid = getpid();
-
-		mm_region = next_region(mm_region);
-	}
+	unsigned long long slot;
+	pid_t pid = getpid();
+	int i, r = 0;
 
-	r = call_kerrighed_services(KSYS_APP_CR_EXCLUDE,
-				    first_mm_region_excluded);
+	/* signals are blocked in handlers and in the dispatch thread */
+	pthread_mutex_lock(&excluded_lock);
+	if (build_excluded_payload())
+		r = call_kerrighed_services(KSYS_APP_CR_EXCLUDE,
+					    excluded_payload);
+	pthread_mutex_unlock(&excluded_lock);
 
 	if (r)
 		perror("cr_exclude");
 
-	child = first_child;
-	while (child) {
-		cr_execute_chkpt_callbacks(child->pid, 0);
-		child = child->next;
-	}
+	/* children got the request from the requester already */
+	if (cr_callback_fanned_out())
+		return r;
+
+	for_each_child(pid, i, slot)
+		if (cr_execute_chkpt_callbacks(slot_pid(slot), 0)
+		    && errno == ESRCH)
+			/* SIGCHLD was merged with another one */
+			remove_child(slot_pid(slot));
 
 	return r;
 }
 
 int cr_mm_exclusion_restart_cb(void *arg)
 {
-	struct cr_mm_region_excluded *mm_region;
-	struct child_process *child;
-	int ret = 0, r = 0;
-
-	mm_region = first_mm_region_excluded;
-	while (mm_region) {
-		if (mm_region->func) {
-			r = (*mm_region->func)(mm_region->arg);
+	unsigned long long slot;
+	pid_t pid = getpid();
+	int i, ret = 0, r = 0;
+
+	pthread_mutex_lock(&excluded_lock);
+
+	/* the restarted process has another start time */
+	if (published.pid == pid) {
+		published.pid = 0;
+		publish_excluded();
+	}
+
+	for (i = 0; i < nr_excluded; i++) {
+		if (excluded[i].func) {
+			r = (*excluded[i].func)(excluded[i].arg);
 			if (r)
 				ret = r;
 		}
-
-		mm_region = next_region(mm_region);
 	}
+	pthread_mutex_unlock(&excluded_lock);
 
-	child = first_child;
-	while (child) {
-		cr_execute_restart_callbacks(child->pid);
-		child = child->next;
-	}
+	for_each_child(pid, i, slot)
+		cr_execute_restart_callbacks(slot_pid(slot));
 
 	return ret;
 }
 
-void parent_before_fork(void)
-{
-	int r;
-	r = pipe(pipefd);
-	if (r)
-		perror("pipe");
-}
-
-void parent_after_fork(void)
-{
-	int r;
-	pid_t pid;
-
-	r = read(pipefd[0], &pid, sizeof(pid_t));
-	if (r == -1)
-		perror("read");
-
-	close(pipefd[0]);
-	close(pipefd[1]);
-
-	add_child(pid);
-}
-
 void child_after_fork(void)
 {
-	int r;
-	pid_t pid = getpid();
-
-	remove_all_children();
-
-	close(pipefd[0]);
-	r = write(pipefd[1], &pid, sizeof(pid_t));
-	if (r == -1)
-		perror("write");
-
-	close(pipefd[1]);
+	add_child(getppid(), getpid());
+
+	/* the publisher thread of the parent is not there, and may have
+	 * held publish_mutex */
+	pthread_mutex_init(&publish_mutex, NULL);
+	pthread_cond_init(&publish_cond, NULL);
+	publish_pending = 0;
+	publish_requested = 0;
 }
 
 int cr_mm_exclusion_init(void)
@@ -269,12 +565,19 @@ int cr_mm_exclusion_init(void)
 	if (r)
 		goto out;
 
+	children = mmap(NULL, NR_CHILD_SLOTS * sizeof(*children),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (children == MAP_FAILED) {
+		children = NULL;
+		r = -1;
+		goto out;
+	}
+
 	r = initiliaze_sigchild_handler();
 	if (r)
 		goto out;
 
-	r = pthread_atfork(parent_before_fork, parent_after_fork,
-			   child_after_fork);
+	r = pthread_atfork(NULL, NULL, child_after_fork);
 	if (r)
 		goto out;
 
@@ -286,86 +589,100 @@ out:
 
 void __attribute__ ((destructor)) cr_mm_exclusion_exit(void)
 {
-	struct cr_mm_region_excluded *mm_region, *next;
-
-	mm_region = first_mm_region_excluded;
-	while (mm_region) {
-		next = next_region(mm_region);
-
-		free(mm_region);
-		mm_region = next;
-	}
-
-	remove_all_children();
+	sigset_t oldset;
+
+	lock_excluded(&oldset);
+	free(excluded);
+	excluded = NULL;
+	free(excluded_payload);
+	excluded_payload = NULL;
+	nr_excluded = 0;
+	max_excluded = 0;
+	excluded_bytes = 0;
+
+	publish_pending = 0;
+	unpublish_excluded();
+	unlock_excluded(&oldset);
 }
 
 int cr_exclude_on(void *data, size_t datasize,
 		  cr_mm_excl_callback_t func, void *arg)
 {
-	struct cr_mm_region_excluded *mm_region, *element, *next;
-	int r;
+	unsigned long addr = (unsigned long)data;
+	sigset_t oldset;
+	int i, r;
 
-	mm_region = malloc(sizeof(struct cr_mm_region_excluded));
-	if (!mm_region)
+	if (!datasize || addr + datasize < addr) {
+		errno = EINVAL;
 		return -1;
+	}
 
-	mm_region->region.pid = 0;
-	mm_region->region.addr = (unsigned long)data;
-	mm_region->region.size = datasize;
-
-	mm_region->func = func;
-	mm_region->arg = arg;
+	r = cr_mm_exclusion_init();
+	if (r)
+		return r;
 
-	if (!first_mm_region_excluded)
-		first_mm_region_excluded = mm_region;
-	else {
-		next = first_mm_region_excluded;
+	lock_excluded(&oldset);
 
-		do {
-			element = next;
-			if (element->region.addr == mm_region->region.addr)
-				goto err_busy;
+	i = find_region(addr);
 
-			next = next_region(element);
-		} while (next);
+	/* overlap with the previous or the next region */
+	if ((i > 0 && excluded[i - 1].addr + excluded[i - 1].size > addr)
+	    || (i < nr_excluded && excluded[i].addr < addr + datasize)) {
+		unlock_excluded(&oldset);
+		errno = EBUSY;
+		return -1;
+	}
 
-		element->region.next = &mm_region->region;
+	if (nr_excluded == max_excluded) {
+		r = grow_excluded_regions();
+		if (r) {
+			unlock_excluded(&oldset);
+			errno = ENOMEM;
+			return r;
+		}
 	}
 
-	r = cr_mm_exclusion_init();
-	if (r)
-		free(mm_region);
+	memmove(&excluded[i + 1], &excluded[i],
+		(nr_excluded - i) * sizeof(*excluded));
+	excluded[i].addr = addr;
+	excluded[i].size = datasize;
+	excluded[i].func = func;
+	excluded[i].arg = arg;
+	nr_excluded++;
+	excluded_bytes += datasize;
 
-	return r;
+	excluded_payload_dirty = 1;
+	excluded_changed();
+
+	unlock_excluded(&oldset);
 
-err_busy:
-	errno = EBUSY;
-	free(mm_region);
-	return -1;
+	return 0;
 }
 
 int cr_exclude_off(void *data)
 {
-	struct cr_mm_region_excluded *prev_region, *mm_region;
-
-	mm_region = first_mm_region_excluded;
-	prev_region = NULL;
+	unsigned long addr = (unsigned long)data;
+	sigset_t oldset;
+	int i;
 
-	while (mm_region) {
-		if (mm_region->region.addr == (unsigned long)data) {
-			if (prev_region)
-				prev_region->region.next =
-					mm_region->region.next;
-			else
-				first_mm_region_excluded = next_region(mm_region);
+	lock_excluded(&oldset);
 
-			free(mm_region);
-			return 0;
-		}
-		prev_region = mm_region;
-		mm_region = next_region(mm_region);
+	i = find_region(addr);
+	if (i == nr_excluded || excluded[i].addr != addr) {
+		unlock_excluded(&oldset);
+		errno = EINVAL;
+		return -1;
 	}
 
-	errno = EINVAL;
-	return -1;
+	excluded_bytes -= excluded[i].size;
+	nr_excluded--;
+	memmove(&excluded[i], &excluded[i + 1],
+		(nr_excluded - i) * sizeof(*excluded));
+
+	excluded_payload_dirty = 1;
+	excluded_changed();
+
+	unlock_excluded(&oldset);
+
+	return 0;
 }
@@ -0,0 +1,179 @@
+/** Kerrighed Checkpoint-Library Interface
+ *  @file shrink.c
+ *
+ *  Memory released before checkpoints, so that it does not end in the
+ *  image.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include <libkrgcb.h>
+#include <libkrgcheckpoint.h>
+
+/* after the checkpoint callbacks of the application, which may free
+ * memory as well */
+#define SHRINK_PRIORITY -1000
+
+struct droppable_cache
+{
+	char name[32];
+	cr_cache_drop_t func;
+	void *arg;
+};
+
+static struct droppable_cache *caches = NULL;
+static int nr_caches = 0;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static int shrink_initialized = 0;
+
+/* Return the resident set size of the process in bytes, 0 if unknown */
+static unsigned long resident_bytes(void)
+{
+	unsigned long size, resident;
+	char buf[128];
+	ssize_t r;
+	int fd;
+
+	fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+	buf[r] = '\0';
+
+	if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+		return 0;
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static unsigned long reclaimed(unsigned long before, unsigned long after)
+{
+	return after < before ? before - after : 0;
+}
+
+static int shrink_checkpoint_cb(void *arg)
+{
+	unsigned long start, before, after;
+	size_t released;
+	int i;
+
+	start = before = resident_bytes();
+
+	pthread_mutex_lock(&caches_lock);
+	for (i = 0; i < nr_caches; i++) {
+		released = caches[i].func(caches[i].arg);
+		after = resident_bytes();
+		cr_callback_report("shrink: cache %s: released %lu, "
+				   "reclaimed %lu bytes", caches[i].name,
+				   (unsigned long)released,
+				   reclaimed(before, after));
+		before = after;
+	}
+	pthread_mutex_unlock(&caches_lock);
+
+	/* free memory at the top of the heap and free pages inside the
+	 * heaps of all arenas */
+	malloc_trim(0);
+	after = resident_bytes();
+	cr_callback_report("shrink: malloc_trim: reclaimed %lu bytes",
+			   reclaimed(before, after));
+
+	cr_callback_report("shrink: resident %lu -> %lu bytes", start, after);
+
+	return 0;
+}
+
+int cr_shrink_init(void)
+{
+	int r;
+
+	pthread_mutex_lock(&caches_lock);
+
+	r = 0;
+	if (shrink_initialized)
+		goto out;
+
+	r = cr_callback_init();
+	if (r)
+		goto out;
+
+	r = cr_register_callback(CR_CB_CHECKPOINT, shrink_checkpoint_cb, NULL,
+				 SHRINK_PRIORITY, CR_CB_THREAD);
+	if (r)
+		goto out;
+
+	shrink_initialized = 1;
+
+out:
+	pthread_mutex_unlock(&caches_lock);
+	return r;
+}
+
+int cr_register_droppable_cache(const char *name, cr_cache_drop_t func,
+				void *arg)
+{
+	struct droppable_cache *new_caches;
+	int r;
+
+	if (!func) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	r = cr_shrink_init();
+	if (r)
+		return r;
+
+	pthread_mutex_lock(&caches_lock);
+
+	new_caches = realloc(caches, (nr_caches + 1) * sizeof(*caches));
+	if (!new_caches) {
+		r = -1;
+		goto out;
+	}
+	caches = new_caches;
+
+	snprintf(caches[nr_caches].name, sizeof(caches[nr_caches].name),
+		 "%s", name ? name : "-");
+	caches[nr_caches].func = func;
+	caches[nr_caches].arg = arg;
+	nr_caches++;
+
+out:
+	pthread_mutex_unlock(&caches_lock);
+	return r;
+}
+
+int cr_unregister_droppable_cache(cr_cache_drop_t func, void *arg)
+{
+	int i, r = -1;
+
+	pthread_mutex_lock(&caches_lock);
+
+	for (i = 0; i < nr_caches; i++)
+		if (caches[i].func == func && caches[i].arg == arg)
+			break;
+
+	if (i < nr_caches) {
+		nr_caches--;
+		memmove(&caches[i], &caches[i + 1],
+			(nr_caches - i) * sizeof(*caches));
+		r = 0;
+	} else {
+		errno = ENOENT;
+	}
+
+	pthread_mutex_unlock(&caches_lock);
+	return r;
+}
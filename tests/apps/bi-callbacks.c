@@ -0,0 +1,289 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <libkrgcb.h>
+#include <libkrgcheckpoint.h>
+#include "libbi.h"
+
+/*
+ * Log the callbacks it runs, one line "<pid> <tid> <event>" each, so that
+ * tests can check which callbacks ran, where and in which order
+ */
+
+int numloops = -1 ;
+int quiet = 0;
+int close_stdbuffers = 0;
+char *logfile = NULL;
+int slow_ms = 0;
+int fail = 0;
+int priorities = 0;
+int nr_children = 0;
+int nr_sections = 0;
+size_t cache_size = 0;
+char *cache = NULL;
+
+/* excluding it sets libkrgcheckpoint up to track the children */
+char excluded[4096];
+
+void parse_args(int argc, char *argv[])
+{
+	int c;
+
+	while (1){
+		c = getopt(argc, argv, "l:qhco:w:epf:S:m:");
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'l':
+			numloops = atoi(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'c':
+			quiet = 1;
+			close_stdbuffers = 1;
+			break;
+		case 'o':
+			logfile = optarg;
+			break;
+		case 'w':
+			slow_ms = atoi(optarg);
+			break;
+		case 'e':
+			fail = 1;
+			break;
+		case 'p':
+			priorities = 1;
+			break;
+		case 'f':
+			nr_children = atoi(optarg);
+			break;
+		case 'S':
+			nr_sections = atoi(optarg);
+			break;
+		case 'm':
+			cache_size = (size_t)atoi(optarg) << 20;
+			break;
+		default:
+			printf("** unknown option\n");
+		case 'h':
+			printf("usage: %s [-h] [-l N] [-q] [-c] -o file [-w ms] "
+			       "[-e] [-p] [-f N]\n"
+			       "       [-S N] [-m MB]\n", argv[0]);
+			printf(" -h      : this help\n");
+			printf(" -l N    : number of loops\n");
+			printf(" -q      : quiet\n");
+			printf(" -c      : quiet + close the stdin, stdout, "
+			       "and stderr\n");
+			printf(" -o file : log the callbacks in file\n");
+			printf(" -w ms   : checkpoint callback taking ms "
+			       "milliseconds\n");
+			printf(" -e      : failing checkpoint callback\n");
+			printf(" -p      : checkpoint callbacks of priorities "
+			       "10, 0 and -10\n");
+			printf(" -f N    : fork N children, tracked by "
+			       "libkrgcheckpoint\n");
+			printf(" -S N    : run N nested sections disabling "
+			       "checkpoint first\n");
+			printf(" -m MB   : cache of MB megabytes dropped before "
+			       "checkpoints\n");
+			exit(1);
+		}
+	}
+
+	if (!logfile) {
+		printf("** missing log file\n");
+		exit(1);
+	}
+}
+
+/* no stdio stream: callbacks may run in signal handlers */
+void log_event(const char *event)
+{
+	char line[128];
+	int fd, len;
+
+	len = snprintf(line, sizeof(line), "%d %ld %s\n", getpid(),
+		       syscall(SYS_gettid), event);
+
+	fd = open(logfile, O_WRONLY|O_APPEND|O_CREAT, 0644);
+	if (fd == -1)
+		return;
+	if (write(fd, line, len) != len)
+		perror("write");
+	close(fd);
+}
+
+int log_cb(void *arg)
+{
+	log_event(arg);
+	return 0;
+}
+
+int slow_cb(void *arg)
+{
+	usleep(slow_ms * 1000);
+	log_event("slow");
+	return 0;
+}
+
+int fail_cb(void *arg)
+{
+	log_event("fail");
+	return -1;
+}
+
+/*
+ * Registered out of priority order, along with a callback unregistered at
+ * once: they must log "priority 10", "priority 0", then "priority -10"
+ */
+int register_priorities(void)
+{
+	int r;
+
+	r = cr_register_callback(CR_CB_CHECKPOINT, &log_cb, "priority -10",
+				 -10, 0);
+	if (!r)
+		r = cr_register_callback(CR_CB_CHECKPOINT, &log_cb,
+					 "priority 10", 10, 0);
+	if (!r)
+		r = cr_register_callback(CR_CB_CHECKPOINT, &log_cb,
+					 "unregistered", 5, 0);
+	if (!r)
+		r = cr_register_callback(CR_CB_CHECKPOINT, &log_cb,
+					 "priority 0", 0, 0);
+	if (!r)
+		r = cr_unregister_callback(CR_CB_CHECKPOINT, &log_cb,
+					   "unregistered");
+
+	return r;
+}
+
+/*
+ * Nested sections, batched: checkpoint must be enabled again once they
+ * are over
+ */
+int run_sections(void)
+{
+	int i, r;
+
+	r = cr_section_batch(64, 1000000);
+	for (i = 0; !r && i < nr_sections; i++) {
+		r = cr_section_begin();
+		if (!r)
+			r = cr_section_begin();
+		if (!r)
+			r = cr_section_end();
+		if (!r)
+			r = cr_section_end();
+	}
+	if (!r)
+		r = cr_section_batch(0, 0);
+	if (!r)
+		r = cr_section_flush();
+
+	return r;
+}
+
+/* the cache is not rebuilt, it is only dropped at the first checkpoint */
+size_t drop_cache(void *arg)
+{
+	size_t released = 0;
+
+	if (cache) {
+		free(cache);
+		cache = NULL;
+		released = cache_size;
+		log_event("drop");
+	}
+
+	return released;
+}
+
+int init_cache(void)
+{
+	cache = malloc(cache_size);
+	if (!cache)
+		return -1;
+
+	memset(cache, 'a', cache_size);
+
+	return cr_register_droppable_cache("bi-cache", &drop_cache, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	pid_t pid;
+	int i, r;
+
+	parse_args(argc, argv);
+
+	close_stdioe(close_stdbuffers);
+
+	r = cr_callback_init();
+	if (r) {
+		fprintf(stderr, "Fail to initialize callback library\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r = cr_register_chkpt_callback(&log_cb, "checkpoint");
+	if (!r)
+		r = cr_register_continue_callback(&log_cb, "continue");
+	if (!r)
+		r = cr_register_restart_callback(&log_cb, "restart");
+	if (!r && slow_ms)
+		r = cr_register_chkpt_thread_callback(&slow_cb, NULL);
+	if (!r && fail)
+		r = cr_register_chkpt_callback(&fail_cb, NULL);
+	if (!r && priorities)
+		r = register_priorities();
+	if (!r && cache_size)
+		r = init_cache();
+
+	if (r) {
+		fprintf(stderr, "Fail to register callbacks: %s\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Children inherit the callbacks. They only run signal context
+	 * callbacks, since they have no worker thread.
+	 */
+	if (nr_children) {
+		r = cr_exclude_on(excluded, sizeof(excluded), NULL, NULL);
+		if (r) {
+			fprintf(stderr, "Fail to initialize checkpoint "
+				"library: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (nr_sections && run_sections()) {
+		fprintf(stderr, "Fail to run sections: %s\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nr_children; i++) {
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (!pid)
+			break;
+	}
+
+	close_sync_pipe();
+
+	do_all_loops(quiet, numloops);
+
+	return 0;
+}
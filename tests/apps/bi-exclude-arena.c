@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <kerrighed.h>
+#include <libkrgcheckpoint.h>
+#include "libbi.h"
+
+int numloops = -1 ;
+int quiet = 0;
+int close_stdbuffers = 0;
+
+#define NR_BUFFERS 1000
+#define BUFFER_SIZE 4000
+
+char *buffers[NR_BUFFERS];
+
+void parse_args(int argc, char *argv[])
+{
+	int c;
+
+	while (1){
+		c = getopt(argc, argv, "l:qhc");
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'l':
+			numloops = atoi(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'c':
+			quiet = 1;
+			close_stdbuffers = 1;
+			break;
+		default:
+			printf("** unknown option\n");
+		case 'h':
+			printf("usage: %s [-h] [-l N] [-q] [-c]\n", argv[0]);
+			printf(" -h   : this help\n");
+			printf(" -l N : number of loops\n");
+			printf(" -q   : quiet\n");
+			printf(" -c   : quiet + close the stdin, stdout, "
+			       "and stderr\n");
+			exit(1);
+		}
+	}
+}
+
+int restart_cb(void *arg)
+{
+	int garbage = 0;
+	int i, j;
+
+	for (i = 0; i < NR_BUFFERS; i++)
+		for (j = 0; j < BUFFER_SIZE; j++) {
+			if (buffers[i][j] != 'a')
+				garbage = 1;
+			buffers[i][j] = 'b';
+		}
+
+	if (!garbage) {
+		fprintf(stderr,
+			"Error: arena has not been replaced by garbage\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!quiet)
+		printf("%d buffers rebuilt\n", NR_BUFFERS);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct cr_excl_arena *arena;
+	int i;
+
+	parse_args(argc, argv);
+
+	close_stdioe(close_stdbuffers);
+
+	arena = cr_excl_arena_create(NR_BUFFERS * BUFFER_SIZE * 2,
+				     restart_cb, NULL);
+	if (!arena) {
+		fprintf(stderr, "%s:%d - %d - %s\n",
+			__PRETTY_FUNCTION__, __LINE__,
+			getpid(), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < NR_BUFFERS; i++) {
+		buffers[i] = cr_excl_arena_malloc(arena, BUFFER_SIZE);
+		if (!buffers[i]) {
+			fprintf(stderr, "%s:%d - %d - %s\n",
+				__PRETTY_FUNCTION__, __LINE__,
+				getpid(), strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		memset(buffers[i], 'a', BUFFER_SIZE);
+	}
+
+	close_sync_pipe();
+
+	do_all_loops(quiet, numloops);
+
+	for (i = 0; i < NR_BUFFERS; i++)
+		cr_excl_free(buffers[i]);
+
+	cr_excl_arena_destroy(arena);
+
+	return 0;
+}
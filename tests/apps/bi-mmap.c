@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "libbi.h"
+
+/*
+ * Unmodified program mapping a large anonymous buffer, for exclusions
+ * given to libkrgexclude.so through the environment
+ */
+
+int numloops = -1 ;
+int quiet = 0;
+int close_stdbuffers = 0;
+int rewrite = 0;
+
+const size_t MMAP_SIZE = 64 << 20;
+
+void parse_args(int argc, char *argv[])
+{
+	int c;
+
+	while (1){
+		c = getopt(argc, argv, "l:qhcw");
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'l':
+			numloops = atoi(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'c':
+			quiet = 1;
+			close_stdbuffers = 1;
+			break;
+		case 'w':
+			rewrite = 1;
+			break;
+		default:
+			printf("** unknown option\n");
+		case 'h':
+			printf("usage: %s [-h] [-l N] [-q] [-c] [-w]\n",
+			       argv[0]);
+			printf(" -h   : this help\n");
+			printf(" -l N : number of loops\n");
+			printf(" -q   : quiet\n");
+			printf(" -c   : quiet + close the stdin, stdout, "
+			       "and stderr\n");
+			printf(" -w   : rewrite the buffer every 100 ms in the "
+			       "loops\n");
+			exit(1);
+		}
+	}
+}
+
+
+/* dirty every page of the buffer, for dirty rate measurements */
+void rewrite_loops(char *buffer)
+{
+	int i;
+
+	for (i = 0; numloops < 0 || i < numloops; i++) {
+		memset(buffer, 'a' + i % 26, MMAP_SIZE);
+		if (!quiet)
+			printf("(%d) %d\n", getpid(), i);
+		usleep(100000);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char *buffer;
+
+	parse_args(argc, argv);
+
+	close_stdioe(close_stdbuffers);
+
+	buffer = mmap(NULL, MMAP_SIZE, PROT_READ|PROT_WRITE,
+		      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	/* make every page count in checkpoints */
+	memset(buffer, 'a', MMAP_SIZE);
+
+	close_sync_pipe();
+
+	if (rewrite)
+		rewrite_loops(buffer);
+	else
+		do_all_loops(quiet, numloops);
+
+	munmap(buffer, MMAP_SIZE);
+
+	return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ *  Copyright (c) 2010, Kerlabs
+ *
+ * Round-trip latency of checkpoint callbacks, for each channel carrying
+ * the acknowledgement back to the requester.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <libkrgcb.h>
+
+int nr_loops = 1000;
+int thread_cb = 0;
+int init_flags = 0;
+
+static int noop_cb(void *arg)
+{
+	return 0;
+}
+
+void show_help(char *program_name)
+{
+	printf("Usage: %s [-l loops] [-t] [-s]\n"
+	       "\n"
+	       "  -l <loops>    Number of round trips per channel (default: 1000)\n"
+	       "  -t            Register a thread context callback\n"
+	       "  -s            Dispatch callbacks from a signalfd thread\n",
+	       program_name);
+}
+
+void parse_args(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "l:tsh")) != -1) {
+		switch (c) {
+		case 'l':
+			nr_loops = atoi(optarg);
+			break;
+		case 't':
+			thread_cb = 1;
+			break;
+		case 's':
+			init_flags |= CR_CB_INIT_SIGNALFD;
+			break;
+		case 'h':
+			show_help(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			show_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (nr_loops <= 0) {
+		show_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void run_target(int ready_fd)
+{
+	int r;
+
+	r = cr_callback_init_flags(init_flags);
+	if (!r) {
+		if (thread_cb)
+			r = cr_register_chkpt_thread_callback(noop_cb, NULL);
+		else
+			r = cr_register_chkpt_callback(noop_cb, NULL);
+	}
+	if (r) {
+		fprintf(stderr, "Fail to initialize callback library\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (write(ready_fd, &r, sizeof(r)) != sizeof(r))
+		exit(EXIT_FAILURE);
+	close(ready_fd);
+
+	for (;;)
+		pause();
+}
+
+static double elapsed_us(const struct timeval *start,
+			 const struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6
+		+ (end->tv_usec - start->tv_usec);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int measure(pid_t pid, const char *channel, double *samples)
+{
+	struct timeval start, end;
+	double sum = 0;
+	int i;
+
+	setenv("KRGCB_CHANNEL", channel, 1);
+
+	for (i = 0; i < nr_loops; i++) {
+		gettimeofday(&start, NULL);
+		if (cr_execute_chkpt_callbacks(pid, 0)) {
+			perror(channel);
+			return -1;
+		}
+		gettimeofday(&end, NULL);
+		samples[i] = elapsed_us(&start, &end);
+		sum += samples[i];
+	}
+
+	qsort(samples, nr_loops, sizeof(*samples), compare_double);
+
+	printf("%-8s %8d %10.1f %10.1f %10.1f %10.1f\n", channel, nr_loops,
+	       samples[0], sum / nr_loops, samples[nr_loops / 2],
+	       samples[(nr_loops * 99) / 100]);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	double *samples;
+	int pipefd[2], ready, r;
+	pid_t pid;
+
+	parse_args(argc, argv);
+
+	samples = malloc(nr_loops * sizeof(*samples));
+	if (!samples || pipe(pipefd)) {
+		perror("krgcb-latency");
+		exit(EXIT_FAILURE);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (!pid) {
+		close(pipefd[0]);
+		run_target(pipefd[1]);
+	}
+
+	close(pipefd[1]);
+	if (read(pipefd[0], &ready, sizeof(ready)) != sizeof(ready)) {
+		fprintf(stderr, "krgcb-latency: target failed to start\n");
+		waitpid(pid, NULL, 0);
+		exit(EXIT_FAILURE);
+	}
+	close(pipefd[0]);
+
+	printf("%-8s %8s %10s %10s %10s %10s\n", "channel", "loops",
+	       "min(us)", "avg(us)", "p50(us)", "p99(us)");
+
+	r = measure(pid, "msgq", samples);
+	if (!r)
+		r = measure(pid, "socket", samples);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	free(samples);
+
+	if (r)
+		exit(EXIT_FAILURE);
+
+	exit(EXIT_SUCCESS);
+}
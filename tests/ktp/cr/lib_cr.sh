@@ -91,6 +91,91 @@ move_task_back_file_to_make_restart_ok()
     return $r
 }
 
+# print the size in kB of the last checkpoint of _pid
+image_size()
+{
+    local _pid=$1
+
+    local version=`awk '$1=="Version:" {print $2}' /tmp/chkpt_result${_pid}`
+    du -skL $CHKPTDIR/${_pid}/v${version} | cut -f1
+}
+
+# wait for the background replication of the last checkpoint of _pid
+wait_replicas()
+{
+    local _pid=$1
+    local r=0
+
+    local version=`awk '$1=="Version:" {print $2}' /tmp/chkpt_result${_pid}`
+    local map=$CHKPTDIR/${_pid}/v${version}.replicas
+
+    local nb_try=0
+    while [ ! -e $map ] && [ $nb_try -lt 30 ]; do
+	sleep 1
+	nb_try=$[$nb_try+1]
+    done
+
+    if [ ! -s $map ]; then
+	r=1
+	tst_brkm TFAIL NULL \
+	    "replication: no valid replica of version $version of $_pid"
+	return $r
+    fi
+
+    LTP_print_step_info \
+	"wait_replicas $_pid: `cut -d' ' -f1 $map | tr '\n' ' '`"
+
+    return $r
+}
+
+# wait for the last checkpoint of _pid to reach _location (see storage.h)
+wait_location()
+{
+    local _pid=$1
+    local _location=$2
+    local r=0
+
+    local version=`awk '$1=="Version:" {print $2}' /tmp/chkpt_result${_pid}`
+    local file=$CHKPTDIR/${_pid}/v${version}.location
+
+    local location=`cut -d' ' -f1 $file 2> /dev/null`
+    local nb_try=0
+    while [ "$location" != "$_location" ] && [ $nb_try -lt 30 ]; do
+	sleep 1
+	location=`cut -d' ' -f1 $file 2> /dev/null`
+	nb_try=$[$nb_try+1]
+    done
+
+    if [ "$location" != "$_location" ]; then
+	r=1
+	tst_brkm TFAIL NULL \
+	    "version $version of $_pid is $location instead of $_location"
+	return $r
+    fi
+
+    LTP_print_step_info "wait_location $_pid: $location"
+
+    return $r
+}
+
+# remove the local copy of the last checkpoint of _pid
+remove_local_version()
+{
+    local _pid=$1
+    local r=0
+
+    local version=`awk '$1=="Version:" {print $2}' /tmp/chkpt_result${_pid}`
+
+    rm -rf $CHKPTDIR/${_pid}/v${version} $CHKPTDIR/${_pid}/v${version}.location
+    r=$?
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL \
+	    "remove_local_version: fail to remove version $version of $_pid"
+    fi
+
+    return $r
+}
+
 check_written_files()
 {
     local _pid=$1
@@ -444,10 +529,11 @@ restart_process()
     local _pid=$1
     local _version=$2
     local _name=$3
+    local _options=$4
     local r=0
 
     # Restart process
-    restart -q -t $_pid $_version
+    restart -q -t $_options $_pid $_version
 
     r=$?
     if [ $r -ne 0 ]; then
@@ -673,6 +759,124 @@ migrate_process_comeback()
     return $r
 }
 
+check_process_on_node()
+{
+    local _pid=$1
+    local _name=$2
+    local _node=$3
+    local r=0
+
+    local node=`get_node_hosting_process ${_pid}`
+    if [ "$node" != "$_node" ]; then
+	r=1
+	tst_brkm TFAIL NULL \
+	    "$_pid ($_name) runs on node $node instead of $_node"
+    fi
+
+    return $r
+}
+
+relocate_process()
+{
+    local _pid=$1
+    local _name=$2
+    local _tonode=$3
+    local r=0
+
+    # Checkpoint, kill and restart the application on _tonode
+    krgcr-relocate -q -P pack:$_tonode $_pid
+
+    r=$?
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL \
+	    "krgcr-relocate: failed to relocate $_pid to node $_tonode (error $r)"
+	return $r
+    fi
+
+    sleep 1
+
+    # Check process is still visible with ps
+    check_group_exists_in_ps $_pid $_name
+
+    r=$?
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL "ps: $_pid ($_name) is not visible with command ps"
+	return $r
+    fi
+
+    # Check process runs on _tonode
+    check_process_on_node $_pid $_name $_tonode || return $?
+
+    LTP_print_step_info \
+	"relocate $_pid $_name to node $_tonode: $r"
+
+    return $r
+}
+
+###############################################################################
+
+# print the number of _event lines logged in _log by process _pid of
+# bi-callbacks
+callbacks_logged()
+{
+    local _log=$1
+    local _pid=$2
+    local _event=$3
+
+    cat $_log 2> /dev/null | grep -c "^$_pid [0-9]* $_event\$"
+}
+
+# wait for process _pid of bi-callbacks to log _count _event lines
+wait_callbacks_logged()
+{
+    local _log=$1
+    local _pid=$2
+    local _event=$3
+    local _count=$4
+    local r=0
+
+    local count=`callbacks_logged $_log $_pid $_event`
+    local nb_try=0
+    while [ $count -lt $_count ] && [ $nb_try -lt 10 ]; do
+	sleep 1
+	count=`callbacks_logged $_log $_pid $_event`
+	nb_try=$[$nb_try+1]
+    done
+
+    if [ $count -lt $_count ]; then
+	r=1
+	tst_brkm TFAIL NULL \
+	    "callbacks: $_pid logged $count $_event instead of $_count"
+	return $r
+    fi
+
+    LTP_print_step_info "callbacks $_pid: $count $_event"
+
+    return $r
+}
+
+# check that each process of group _pgrp logged _count _event lines
+check_group_callbacks_logged()
+{
+    local _log=$1
+    local _pgrp=$2
+    local _name=`expr substr $3 1 15`
+    local _event=$4
+    local _count=$5
+
+    local pid=""
+    for pid in `pgrep -g $_pgrp $_name`; do
+	local count=`callbacks_logged $_log $pid $_event`
+	if [ $count -ne $_count ]; then
+	    tst_brkm TFAIL NULL \
+		"callbacks: $pid logged $count $_event instead of $_count"
+	    return 1
+	fi
+    done
+
+    return 0
+}
+
 ###############################################################################
 
 print_success()
@@ -481,3 +481,238 @@ restore_msg()
     fi
     return $r
 }
+
+###########################################################################
+
+dump_all_ipc()
+{
+    local dir=$1
+
+    LTP_print_step_info "dumping all SYSV IPC objects of `id -un` in $dir"
+    ipccheckpoint --all --user `id -u` $dir
+    local r=$?
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL "Fail to checkpoint all SYSV IPC objects in $dir: $r"
+    fi
+
+    return $r
+}
+
+check_ipc_indexed()
+{
+    local type=$1
+    local ipc_id=$2
+    local dir=$3
+
+    LTP_print_step_info "checking $type $ipc_id is in the index of $dir"
+    local file=`awk -v t=$type -v i=$ipc_id '$1 == t && $2 == i { print $4 }' $dir/index`
+    if [ -z "$file" ] || [ ! -f $dir/$file ]; then
+	tst_brkm TFAIL NULL "No image of $type $ipc_id in $dir"
+	return 1
+    fi
+
+    return 0
+}
+
+# keep the images of the given "type id" objects only, other instances
+# may have checkpointed theirs too
+select_ipc_images()
+{
+    local from=$1
+    local to=$2
+    shift 2
+
+    mkdir -p $to
+    : > $to/index
+    while [ $# -ge 2 ]; do
+	awk -v t=$1 -v i=$2 '$1 == t && $2 == i' $from/index >> $to/index
+	cp $from/$1_$2.bin $to/ || return $?
+	shift 2
+    done
+}
+
+restore_all_ipc()
+{
+    local dir=$1
+
+    LTP_print_step_info "restoring all SYSV IPC objects of $dir"
+    ipcrestart --all $dir
+    local r=$?
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL "Fail to restart all SYSV IPC objects of $dir: $r"
+    fi
+    return $r
+}
+
+dump_ipc_stream()
+{
+    local type=$1
+    local ipc_id=$2
+    local file=$3
+    local option
+
+    case $type in
+	msg) option=-q ;;
+	sem) option=-s ;;
+	shm) option=-m ;;
+    esac
+
+    LTP_print_step_info "dumping $type $ipc_id through gzip in $file"
+    set -o pipefail
+    ipccheckpoint $option $ipc_id - | gzip > $file
+    local r=$?
+    set +o pipefail
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL "Fail to checkpoint $type $ipc_id in a stream: $r"
+    fi
+
+    return $r
+}
+
+restore_ipc_stream()
+{
+    local file=$1
+
+    LTP_print_step_info "restoring the SYSV IPC objects of $file through gunzip"
+    set -o pipefail
+    gunzip -c $file | ipcrestart -
+    local r=$?
+    set +o pipefail
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL "Fail to restart the SYSV IPC objects of $file: $r"
+    fi
+    return $r
+}
+
+dump_all_ipc_stream()
+{
+    local file=$1
+
+    LTP_print_step_info "dumping all SYSV IPC objects of `id -un` in one stream in $file"
+    ipccheckpoint --all --user `id -u` - > $file
+    local r=$?
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL "Fail to checkpoint all SYSV IPC objects in a stream: $r"
+    fi
+
+    return $r
+}
+
+# the objects of other instances still exist and fail to be restored,
+# only the given "type id" objects must be
+restore_some_ipc_stream()
+{
+    local file=$1
+    local report=$file.report
+    shift
+
+    LTP_print_step_info "restoring the SYSV IPC objects of $file"
+    ipcrestart - < $file > $report
+    while [ $# -ge 2 ]; do
+	if ! grep -q "^$1 $2 -> [0-9]" $report; then
+	    tst_brkm TFAIL NULL "Fail to restart $1 $2 from $file: `grep "^$1 $2 " $report`"
+	    return 1
+	fi
+	shift 2
+    done
+
+    return 0
+}
+
+# Accept one connection on the unix socket path, and copy what is read from
+# it in file (way "in") or copy file to it (way "out")
+serve_unix_socket()
+{
+    local path=$1
+    local way=$2
+    local file=$3
+
+    perl -MIO::Socket::UNIX -e '
+	my ($path, $way, $file) = @ARGV;
+	my ($from, $to, $buf, $n);
+	my $srv = IO::Socket::UNIX->new(Local => $path, Listen => 1)
+	    or die "$path: $!\n";
+	my $conn = $srv->accept or die "$path: $!\n";
+	if ($way eq "in") {
+	    open($to, ">", $file) or die "$file: $!\n";
+	    $from = $conn;
+	} else {
+	    open($from, "<", $file) or die "$file: $!\n";
+	    $to = $conn;
+	}
+	while (($n = sysread($from, $buf, 65536)) > 0) {
+	    syswrite($to, $buf, $n) == $n or die "$path: $!\n";
+	}
+	close($to) or die "$path: $!\n";
+	unlink($path);' $path $way $file &
+    SERVER_PID=$!
+
+    local nr_try=0
+    while [ ! -S $path ] && [ $nr_try -lt 50 ]; do
+	sleep 0.1
+	nr_try=$[$nr_try+1]
+    done
+    if [ ! -S $path ]; then
+	tst_brkm TFAIL NULL "Fail to listen on unix socket $path"
+	kill $SERVER_PID 2> /dev/null
+	return 1
+    fi
+
+    return 0
+}
+
+dump_ipc_unix()
+{
+    local type=$1
+    local ipc_id=$2
+    local path=$3
+    local file=$4
+    local option
+
+    case $type in
+	msg) option=-q ;;
+	sem) option=-s ;;
+	shm) option=-m ;;
+    esac
+
+    serve_unix_socket $path in $file || return $?
+
+    LTP_print_step_info "dumping $type $ipc_id through unix socket $path"
+    ipccheckpoint $option $ipc_id unix:$path
+    local r=$?
+    if [ $r -ne 0 ]; then
+	# the server still waits for a connection
+	kill $SERVER_PID 2> /dev/null
+	wait $SERVER_PID
+    else
+	wait $SERVER_PID || r=$?
+    fi
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL "Fail to checkpoint $type $ipc_id through a unix socket: $r"
+    fi
+
+    return $r
+}
+
+restore_ipc_unix()
+{
+    local path=$1
+    local file=$2
+
+    serve_unix_socket $path out $file || return $?
+
+    LTP_print_step_info "restoring the SYSV IPC objects of $file through unix socket $path"
+    ipcrestart unix:$path
+    local r=$?
+    if [ $r -ne 0 ]; then
+	# the server still waits for a connection
+	kill $SERVER_PID 2> /dev/null
+	wait $SERVER_PID
+    else
+	wait $SERVER_PID || r=$?
+    fi
+    if [ $r -ne 0 ]; then
+	tst_brkm TFAIL NULL "Fail to restart the SYSV IPC objects through a unix socket: $r"
+    fi
+    return $r
+}
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -27,16 +28,29 @@ typedef enum {
 	CHECKPOINT,
 	FREEZE,
 	UNFREEZE,
+	ESTIMATE,
 } app_action_t;
 
 short from_appid = 0;
 short quiet = 0;
 short no_callbacks = 0;
+int callback_timeout = 0;
+short all_processes = 0;
 short interrupted_by_signal = 0;
 int sig = 0;
 int flags = 0;
 char * description = NULL;
 app_action_t action = ALL;
+char * drain_dir = NULL;
+unsigned long drain_bwlimit = 0;
+short drain_evict = 0;
+int nr_replicas = 0;
+char * replica_spec = NULL;
+char * storage_root = NULL;
+struct chkpt_roots roots;
+long placed_app_id = -1;
+struct checkpoint_info last_chkpt;
+unsigned int last_duration_ms;
 
 void version(char * program_name)
 {
@@ -59,24 +73,41 @@ void show_help(char * program_name)
 	       "  -u|--unfreeze [signal]  Unfreeze the application\n"
 	       "  -c|--ckpt-only          Checkpoint a frozen application\n"
 	       "  -k|--kill [signal]      Send a signal to the application, after checkpointing and before unfreezing\n"
+	       "  -e|--estimate           Estimate the size of the checkpoint and the time to write it\n"
 	       "\n"
 	       "General Options:\n"
 	       "  -h|--help               Display this information and exit\n"
 	       "  -v|--version            Display version informations and exit\n"
 	       "  -q|--quiet              Be less verbose\n"
 	       "  -b|--no-callbacks       Do not execute callbacks\n"
+	       "  -t|--callback-timeout <ms>\n"
+	       "                          Give up if checkpoint callbacks take longer than <ms>\n"
+	       "  -A|--all-processes      Execute callbacks in all the processes of the application at once\n"
 	       "  -d|--description        Associate a description with the checkpoint\n"
 	       "  -a|--appid              Use <pid> as an application identifier rather than a process identifier\n"
 	       "  -i|--ignore-unsupported-files\n"
-	       "                          Allow to checkpoint application with open files of unsupported type\n",
-	       program_name);
+	       "                          Allow to checkpoint application with open files of unsupported type\n"
+	       "\n"
+	       "Staging Options:\n"
+	       "  -D|--drain-to <dir>     Copy the checkpoint to <dir> in background once done\n"
+	       "  -B|--drain-bwlimit <KB/s>\n"
+	       "                          Limit the bandwidth used to copy the checkpoint\n"
+	       "  -E|--drain-evict        Replace the local checkpoint by a link to the copy\n"
+	       "  -R|--replicas <K>       Replicate the checkpoint to the stores of <K> other nodes\n"
+	       "  -T|--replica-transport <spec>\n"
+	       "                          How to reach node stores (default: %s)\n"
+	       "\n"
+	       "Storage Options:\n"
+	       "  -r|--root <dir>         Store the checkpoints of a new application under <dir>\n"
+	       "                          rather than on a root chosen using %s\n",
+	       program_name, CHKPT_REPLICA_DEFAULT, CHKPT_ROOTS_CONF);
 }
 
 void parse_args(int argc, char *argv[])
 {
 	char c;
 	int option_index = 0;
-	char * short_options= "hqacd:bfu::k::i";
+	char * short_options= "hqacd:bt:Afu::k::eiD:B:ER:T:r:";
 	static struct option long_options[] = {
 		{"help", no_argument, 0, 'h'},
 		{"version", no_argument, 0, 'v'},
@@ -85,10 +116,19 @@ void parse_args(int argc, char *argv[])
 		{"ckpt-only", no_argument, 0, 'c'},
 		{"description", required_argument, 0, 'd'},
 		{"no-callbacks", no_argument, 0, 'b'},
+		{"callback-timeout", required_argument, 0, 't'},
+		{"all-processes", no_argument, 0, 'A'},
 		{"freeze", no_argument, 0, 'f'},
 		{"unfreeze", optional_argument, 0, 'u'},
 		{"kill", optional_argument, 0, 'k'},
+		{"estimate", no_argument, 0, 'e'},
 		{"ignore-unsupported-files", no_argument, 0, 'i'},
+		{"drain-to", required_argument, 0, 'D'},
+		{"drain-bwlimit", required_argument, 0, 'B'},
+		{"drain-evict", no_argument, 0, 'E'},
+		{"replicas", required_argument, 0, 'R'},
+		{"replica-transport", required_argument, 0, 'T'},
+		{"root", required_argument, 0, 'r'},
 		{0, 0, 0, 0}
 	};
 
@@ -116,6 +156,12 @@ void parse_args(int argc, char *argv[])
 		case 'b':
 			no_callbacks = 1;
 			break;
+		case 't':
+			callback_timeout = atoi(optarg);
+			break;
+		case 'A':
+			all_processes = 1;
+			break;
 		case 'f':
 			action = FREEZE;
 			break;
@@ -130,9 +176,30 @@ void parse_args(int argc, char *argv[])
 			else
 				sig = 15;
 			break;
+		case 'e':
+			action = ESTIMATE;
+			break;
 		case 'i':
 			flags |= CKPT_W_UNSUPPORTED_FILE;
 			break;
+		case 'D':
+			drain_dir = optarg;
+			break;
+		case 'B':
+			drain_bwlimit = strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case 'E':
+			drain_evict = 1;
+			break;
+		case 'R':
+			nr_replicas = atoi(optarg);
+			break;
+		case 'T':
+			replica_spec = optarg;
+			break;
+		case 'r':
+			storage_root = optarg;
+			break;
 		default:
 			show_help(argv[0]);
 			exit(EXIT_FAILURE);
@@ -276,10 +343,110 @@ void clean_checkpoint_dir(struct checkpoint_info *info)
 	remove(path);
 }
 
+/*
+ * The kernel always writes in CHKPT_DIR/<appid>: placing an application
+ * on a storage root makes this directory a link to the root.
+ */
+int place_checkpoints(long app_id)
+{
+	if (storage_root && chkpt_roots_pin(&roots, app_id, storage_root)) {
+		perror(storage_root);
+		return -1;
+	}
+
+	if (!roots.nr_roots)
+		return 0;
+
+	if (chkpt_place_app(&roots, app_id)) {
+		fprintf(stderr, "checkpoint: fail to place application %ld on "
+			"a storage root: %s\n", app_id, strerror(errno));
+		return -1;
+	}
+
+	placed_app_id = app_id;
+	return 0;
+}
+
+/*
+ * Place the application before it is checkpointed, so that the kernel
+ * writes the version on its root directly. Given a process, the
+ * application identifier is the pid of the root process of the
+ * application.
+ */
+void place_app(long pid)
+{
+	long app_id = pid;
+
+	if (!from_appid) {
+		app_id = application_get_appid((pid_t)pid);
+		if (app_id < 0)
+			return;
+	}
+
+	place_checkpoints(app_id);
+}
+
+/*
+ * Record the throughput of the root the version was written in, for
+ * later estimations
+ */
+void record_throughput(struct checkpoint_info *info, unsigned int duration_ms)
+{
+	char dir[PATH_MAX], path[PATH_MAX], *root;
+	unsigned long long bytes = 0;
+	struct dirent *ent;
+	struct stat buf;
+	DIR *d;
+	int r;
+
+	if (chkpt_resolve_version(info->app_id, info->chkpt_sn, dir,
+				  sizeof(dir)))
+		return;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((ent = readdir(d)) != NULL) {
+		r = snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (r < 0 || r >= sizeof(path))
+			continue;
+		if (!stat(path, &buf) && S_ISREG(buf.st_mode))
+			bytes += buf.st_size;
+	}
+	closedir(d);
+
+	/* <root>/<app_id>/v<chkpt_sn> */
+	root = strrchr(dir, '/');
+	if (root)
+		*root = '\0';
+	root = strrchr(dir, '/');
+	if (!root)
+		return;
+	*root = '\0';
+
+	if (chkpt_throughput_record(dir, bytes, duration_ms))
+		perror("checkpoint: fail to record the throughput of the "
+		       "checkpoint");
+}
+
+/*
+ * Bookkeeping of a new version, done once the application runs again.
+ * The throughput is recorded before the version may be moved to another
+ * root by place_checkpoints().
+ */
+void record_checkpoint(struct checkpoint_info *info)
+{
+	record_throughput(info, last_duration_ms);
+
+	if (chkpt_index_add(info->app_id, info->chkpt_sn))
+		perror("checkpoint: fail to index the new version");
+}
+
 int checkpoint_app(long pid, int flags, short _quiet)
 {
 	int r;
 	struct checkpoint_info info;
+	struct timespec start, end;
 
 	if (interrupted_by_signal) {
 		fprintf(stderr,
@@ -293,19 +460,25 @@ int checkpoint_app(long pid, int flags, short _quiet)
 		if (!_quiet)
 			printf("Checkpointing application %ld...\n", pid);
 
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		info = application_checkpoint_from_appid(pid, flags);
 	} else {
 		if (!_quiet)
 			printf("Checkpointing application in which "
 			       "process %d is involved...\n", (pid_t)pid);
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		info = application_checkpoint_from_pid((pid_t)pid, flags);
 	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
 	r = info.result;
 
-	if (!r)
+	if (!r) {
 		write_description(description, &info, _quiet);
-	else {
+		last_chkpt = info;
+		last_duration_ms = (end.tv_sec - start.tv_sec) * 1000
+			+ (end.tv_nsec - start.tv_nsec) / 1000000;
+	} else {
 		show_error(errno);
 		clean_checkpoint_dir(&info);
 	}
@@ -314,8 +487,86 @@ err:
 	return r;
 }
 
+int execute_continue_callbacks(long pid)
+{
+	if (all_processes)
+		return cr_execute_app_continue_callbacks(pid, from_appid);
+
+	return cr_execute_continue_callbacks(pid, from_appid);
+}
+
+void show_callbacks(const struct cr_cb_result *result)
+{
+	if (!result->slowest_us)
+		return;
+
+	printf("Callbacks of process %d took %u ms, %.3f ms in callbacks, "
+	       "dominated by callback 0x%llx (%.3f ms, %u%%)\n", result->pid,
+	       result->elapsed_ms, result->callbacks_us / 1000.0,
+	       result->slowest_func, result->slowest_us / 1000.0,
+	       result->callbacks_us
+	       ? (unsigned int)(100ULL * result->slowest_us
+				/ result->callbacks_us) : 100);
+}
+
+/* lines reported by the callbacks, such as the memory they reclaimed */
+void show_report(const struct cr_cb_result *result)
+{
+	const char *line = result->report;
+	size_t len;
+
+	while (*line) {
+		len = strcspn(line, "\n");
+		printf("Process %d: %.*s\n", result->pid, (int)len, line);
+		line += len;
+		if (*line)
+			line++;
+	}
+}
+
+/*
+ * Report the processes whose callbacks failed and the slowest one
+ */
+int execute_app_chkpt_callbacks(long pid, short _quiet)
+{
+	struct cr_cb_result *results;
+	int i, nr, nr_failed = 0, slowest = 0;
+
+	nr = cr_execute_app_chkpt_callbacks(pid, from_appid, callback_timeout,
+					    &results);
+	if (nr < 0)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		if (results[i].elapsed_ms > results[slowest].elapsed_ms)
+			slowest = i;
+		if (!results[i].result)
+			continue;
+
+		nr_failed++;
+		fprintf(stderr, "checkpoint: callbacks of process %d failed "
+			"after %u ms: %s\n", results[i].pid,
+			results[i].elapsed_ms, results[i].error
+			? strerror(results[i].error) : "callback error");
+	}
+
+	if (!_quiet && nr) {
+		printf("Callbacks executed in %d processes, %d failed, "
+		       "slowest: process %d in %u ms\n", nr, nr_failed,
+		       results[slowest].pid, results[slowest].elapsed_ms);
+		show_callbacks(&results[slowest]);
+		for (i = 0; i < nr; i++)
+			show_report(&results[i]);
+	}
+
+	free(results);
+
+	return nr_failed ? -1 : 0;
+}
+
 int freeze_app(long pid, int _quiet)
 {
+	struct cr_cb_result result;
 	int r;
 
 	if (interrupted_by_signal) {
@@ -326,10 +577,34 @@ int freeze_app(long pid, int _quiet)
 	}
 
 	if (!no_callbacks) {
-		r = cr_execute_chkpt_callbacks(pid, from_appid);
+		if (all_processes) {
+			r = execute_app_chkpt_callbacks(pid, _quiet);
+		} else {
+			r = cr_execute_chkpt_callbacks_report(pid, from_appid,
+							      callback_timeout,
+							      &result);
+			if (!r && !_quiet) {
+				show_callbacks(&result);
+				show_report(&result);
+			} else if (r && errno == ETIMEDOUT)
+				fprintf(stderr, "checkpoint: callbacks did not "
+					"complete within %d ms\n",
+					callback_timeout);
+			else if (r)
+				fprintf(stderr, "checkpoint: error during "
+					"callback execution\n");
+		}
+
 		if (r) {
-			fprintf(stderr, "checkpoint: error during callback"
-				" execution\n");
+			/*
+			 * The application is not frozen yet: let it undo
+			 * what the callbacks which did run prepared.
+			 */
+			if (!quiet)
+				printf("Aborting, continuing application\n");
+			if (execute_continue_callbacks(pid))
+				fprintf(stderr, "checkpoint: error during "
+					"callback execution\n");
 			goto err;
 		}
 	}
@@ -372,7 +647,7 @@ int unfreeze_app(long pid, int signal, short _quiet)
 	}
 
 	if (!no_callbacks) {
-		r = cr_execute_continue_callbacks(pid, from_appid);
+		r = execute_continue_callbacks(pid);
 		if (r) {
 			fprintf(stderr, "checkpoint: error during callback"
 				" execution\n");
@@ -427,6 +702,144 @@ err_chkpt:
 }
 
 
+int replicate_checkpoint(struct checkpoint_info *info)
+{
+	struct chkpt_transport t;
+	int *nodes, nr_nodes, r;
+
+	if (chkpt_transport_init(&t, replica_spec ? replica_spec
+				 : CHKPT_REPLICA_DEFAULT)) {
+		fprintf(stderr, "checkpoint: invalid replica transport %s\n",
+			replica_spec);
+		return -1;
+	}
+
+	/* a replica server leaving is reported as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	nr_nodes = chkpt_select_replica_nodes(nr_replicas, &nodes);
+	if (nr_nodes < 0) {
+		perror("checkpoint: fail to select replica nodes");
+		return -1;
+	}
+
+	r = chkpt_replicate_version(&t, info->app_id, info->chkpt_sn,
+				    nodes, nr_nodes);
+	free(nodes);
+
+	if (r < nr_replicas) {
+		fprintf(stderr, "checkpoint: only %d of %d replicas of version "
+			"%d of application %ld are valid\n", r < 0 ? 0 : r,
+			nr_replicas, info->chkpt_sn, info->app_id);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The copies to other nodes and to the shared tier run in a detached
+ * process so that the application only waits for the local checkpoint.
+ * A version of an application that could not be placed beforehand is
+ * moved to its storage root there first, since the copies resolve it
+ * through the root.
+ * Replicas are made next since they do not depend on the shared tier
+ * and a drain with eviction removes the local copy.
+ */
+int drain_checkpoint(struct checkpoint_info *info, short _quiet)
+{
+	pid_t pid;
+	int r = 0;
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		perror("fork");
+		return -1;
+	case 0:
+		setsid();
+		if (info->app_id != placed_app_id)
+			place_checkpoints(info->app_id);
+		if (nr_replicas > 0 && replicate_checkpoint(info))
+			r = -1;
+		if (!drain_dir)
+			_exit(r ? EXIT_FAILURE : EXIT_SUCCESS);
+
+		r = chkpt_drain_version(info->app_id, info->chkpt_sn,
+					drain_dir, drain_bwlimit, drain_evict);
+		if (r)
+			fprintf(stderr, "checkpoint: fail to drain version %d "
+				"of application %ld to %s: %s\n",
+				info->chkpt_sn, info->app_id, drain_dir,
+				strerror(errno));
+		_exit(r ? EXIT_FAILURE : EXIT_SUCCESS);
+	default:
+		if (!_quiet && nr_replicas > 0)
+			printf("Replicating version %d to %d nodes in "
+			       "background (pid %d)\n", info->chkpt_sn,
+			       nr_replicas, pid);
+		if (!_quiet && drain_dir)
+			printf("Draining version %d to %s in background "
+			       "(pid %d)\n", info->chkpt_sn, drain_dir, pid);
+	}
+
+	return 0;
+}
+
+void show_duration(const char *root, unsigned long long bytes)
+{
+	unsigned long long bytes_per_s;
+
+	if (chkpt_throughput_get(root, &bytes_per_s) || !bytes_per_s) {
+		printf("Write time in %s: unknown, no checkpoint recorded\n",
+		       root);
+		return;
+	}
+
+	printf("Write time in %s: %llu ms at %llu KB/s\n", root,
+	       bytes * 1000 / bytes_per_s, bytes_per_s >> 10);
+}
+
+/*
+ * The image holds the private memory of the processes, but what they
+ * excluded. The write time follows from the throughput of the previous
+ * checkpoints on each storage root.
+ */
+int estimate_app(long pid)
+{
+	struct chkpt_estimate est;
+	int i;
+
+	if (from_appid) {
+		fprintf(stderr, "checkpoint: estimation needs a process "
+			"identifier\n");
+		return -1;
+	}
+
+	if (chkpt_estimate_app((pid_t)pid, &est)) {
+		perror("checkpoint: fail to estimate the checkpoint");
+		return -1;
+	}
+
+	printf("Processes: %d\n"
+	       "Resident memory: %llu bytes\n"
+	       "Private memory: %llu bytes, %llu bytes swapped out\n"
+	       "Excluded memory: %llu bytes\n"
+	       "Estimated image size: %llu bytes\n",
+	       est.nr_processes, est.memory.resident, est.memory.anonymous,
+	       est.memory.swap, est.memory.excluded, est.bytes);
+
+	if (storage_root)
+		show_duration(storage_root, est.bytes);
+	else if (!roots.nr_roots)
+		show_duration(CHKPT_DIR, est.bytes);
+
+	for (i = 0; !storage_root && i < roots.nr_roots; i++)
+		show_duration(roots.root[i], est.bytes);
+
+	return 0;
+}
+
 void handle_signal(int signum)
 {
 	interrupted_by_signal = 1;
@@ -449,6 +862,12 @@ int main(int argc, char *argv[])
 	/* Check environment */
 	check_environment();
 
+	if (chkpt_roots_load(&roots, NULL)) {
+		fprintf(stderr, "checkpoint: invalid storage roots (%s): %s\n",
+			CHKPT_ROOTS_CONF, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
 	/* get the pid */
 	pid = atol( argv[optind] );
 	if (pid < 2) {
@@ -468,6 +887,13 @@ int main(int argc, char *argv[])
 	if (r)
 		perror("sigaction");
 
+	/*
+	 * Not fatal: the checkpoint is then written in CHKPT_DIR. Done before
+	 * freezing since placing may move the previous versions.
+	 */
+	if (action == CHECKPOINT || action == ALL)
+		place_app(pid);
+
 	switch (action) {
 	case CHECKPOINT:
 		r = checkpoint_app(pid, flags, quiet);
@@ -481,8 +907,25 @@ int main(int argc, char *argv[])
 	case ALL:
 		r = freeze_checkpoint_unfreeze(pid, flags, sig, quiet);
 		break;
+	case ESTIMATE:
+		r = estimate_app(pid);
+		break;
 	}
 
+	if (last_chkpt.chkpt_sn)
+		record_checkpoint(&last_chkpt);
+
+	/*
+	 * The application could not be placed before its checkpoint: move
+	 * it to its root now, or in the drain process.
+	 */
+	if (!r && (drain_dir || nr_replicas > 0) && last_chkpt.chkpt_sn)
+		r = drain_checkpoint(&last_chkpt, quiet);
+	else if (last_chkpt.chkpt_sn && last_chkpt.app_id != placed_app_id)
+		place_checkpoints(last_chkpt.app_id);
+
+	chkpt_roots_free(&roots);
+
 exit:
 	if (r)
 		exit(EXIT_FAILURE);
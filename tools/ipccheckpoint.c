@@ -1,10 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <kerrighed.h>
 
 #include <config.h>
@@ -18,6 +23,19 @@ enum ipctype {
 
 enum ipctype ipc_type = UNDEF;
 int ipcid;
+short all = 0;
+uid_t user = (uid_t)-1;
+int nr_jobs = 0;
+
+struct chkpt_queue {
+	pthread_mutex_t lock;
+	const char *dir;
+	struct ipc_stream *stream;	/* rather than dir if set */
+	struct ipc_obj *objs;
+	int *done;
+	int nr_objs;
+	int next;
+};
 
 void version(char * program_name)
 {
@@ -31,26 +49,37 @@ warranty; not even for MERCHANBILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\
 
 void show_help(char * program_name)
 {
-	printf("Usage: %s [-h|--help] [-v|--version] {-q|-s|-m} <IPC ID> pathname\n"
+	printf("Usage: %s [-h|--help] [-v|--version] {-q|-s|-m} <IPC ID> pathname|stream\n"
+	       "       %s -a|--all [-u|--user <user>] [-j|--jobs <N>] directory|stream\n"
 	       "  -h|--help       Show this information and exit\n"
 	       "  -v|--version    Show version informations and exit\n"
 	       "  -q|--queue      for a message queue\n"
 	       "  -s|--semaphore  for a semaphore array\n"
-	       "  -m|--memory     for a shared memory segment\n",
-	       program_name);
+	       "  -m|--memory     for a shared memory segment\n"
+	       "  -a|--all        for all the objects, saved in directory with an index\n"
+	       "  -u|--user       only the objects owned by <user>\n"
+	       "  -j|--jobs       checkpoint <N> objects at once (default: number of CPUs)\n"
+	       "stream is - for the standard output, fd:<N> for file descriptor <N>,\n"
+	       "or unix:<path> for a unix socket\n",
+	       program_name, program_name);
 }
 
 void parse_args(int argc, char *argv[])
 {
 	char c;
 	int option_index = 0;
-	char * short_options= "hq:s:m:";
+	struct passwd *pw;
+	char *end;
+	char * short_options= "hq:s:m:au:j:";
 	static struct option long_options[] = {
 		{"help", no_argument, 0, 'h'},
 		{"version", no_argument, 0, 'v'},
 		{"queue", required_argument, 0, 'q'},
 		{"semaphore", required_argument, 0, 's'},
 		{"memory", required_argument, 0, 'm'},
+		{"all", no_argument, 0, 'a'},
+		{"user", required_argument, 0, 'u'},
+		{"jobs", required_argument, 0, 'j'},
 		{0, 0, 0, 0}
 	};
 
@@ -75,6 +104,24 @@ void parse_args(int argc, char *argv[])
 			ipc_type = SHM;
 			ipcid = atoi(optarg);
 			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'u':
+			pw = getpwnam(optarg);
+			if (pw) {
+				user = pw->pw_uid;
+				break;
+			}
+			user = strtoul(optarg, &end, 10);
+			if (*end || end == optarg) {
+				fprintf(stderr, "%s: unknown user\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
 		default:
 			show_help(argv[0]);
 			exit(EXIT_FAILURE);
@@ -122,18 +169,305 @@ int shm_checkpoint(int ipcid, int fd)
 	return r;
 }
 
+int checkpoint_obj(const char *dir, const struct ipc_obj *obj)
+{
+	char path[PATH_MAX];
+	int fd, r;
+
+	r = snprintf(path, sizeof(path), "%s/%s", dir, obj->file);
+	if (r < 0 || r >= sizeof(path)) {
+		fprintf(stderr, "%s/%s: %s\n", dir, obj->file,
+			strerror(ENAMETOOLONG));
+		return -1;
+	}
+
+	fd = open(path, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR|S_IWUSR);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	r = ipc_obj_checkpoint(obj, fd);
+	if (r)
+		fprintf(stderr, "%s %d: %s\n", ipc_obj_type_str(obj->type),
+			obj->id, strerror(errno));
+
+	if (close(fd))
+		r = -1;
+	if (r)
+		unlink(path);
+
+	return r;
+}
+
+int stream_obj(struct ipc_stream *stream, const struct ipc_obj *obj)
+{
+	int r;
+
+	r = ipc_stream_checkpoint(stream, obj);
+	if (r)
+		fprintf(stderr, "%s %d: %s\n", ipc_obj_type_str(obj->type),
+			obj->id, strerror(errno));
+
+	return r;
+}
+
+void *checkpoint_worker(void *arg)
+{
+	struct chkpt_queue *q = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->nr_objs)
+			break;
+
+		if (q->stream)
+			q->done[i] = !stream_obj(q->stream, &q->objs[i]);
+		else
+			q->done[i] = !checkpoint_obj(q->dir, &q->objs[i]);
+	}
+
+	return NULL;
+}
+
+/* Largest objects first, so that they do not end the run alone */
+int compare_objs(const void *a, const void *b)
+{
+	const struct ipc_obj *x = a, *y = b;
+
+	if (x->size != y->size)
+		return x->size < y->size ? 1 : -1;
+	if (x->type != y->type)
+		return x->type - y->type;
+	return x->id - y->id;
+}
+
+int list_all_objects(struct ipc_obj **objs)
+{
+	struct ipc_obj *array = NULL, *type_objs, *tmp;
+	int type, nr = 0, nr_type;
+
+	for (type = 0; type < IPC_OBJ_NR_TYPES; type++) {
+		nr_type = ipc_list_objects(type, user, &type_objs);
+		if (nr_type < 0) {
+			fprintf(stderr, "/proc/sysvipc/%s: %s\n",
+				ipc_obj_type_str(type), strerror(errno));
+			free(array);
+			return -1;
+		}
+
+		tmp = realloc(array, (nr + nr_type) * sizeof(*array));
+		if (nr_type && !tmp) {
+			free(type_objs);
+			free(array);
+			fprintf(stderr, "ipccheckpoint: %s\n",
+				strerror(ENOMEM));
+			return -1;
+		}
+		if (nr_type) {
+			array = tmp;
+			memcpy(array + nr, type_objs,
+			       nr_type * sizeof(*array));
+			nr += nr_type;
+		}
+		free(type_objs);
+	}
+
+	*objs = array;
+
+	return nr;
+}
+
+int open_stream(struct ipc_stream *stream, const char *target)
+{
+	if (ipc_stream_open(stream, target, 1)) {
+		fprintf(stderr, "%s: %s\n", target, strerror(errno));
+		return -1;
+	}
+
+	/* a closed reader is reported as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	return 0;
+}
+
+int close_stream(struct ipc_stream *stream, const char *target)
+{
+	if (ipc_stream_close(stream)) {
+		fprintf(stderr, "%s: %s\n", target, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Objects written at once are multiplexed in the stream */
+int checkpoint_all(const char *dir)
+{
+	struct ipc_stream stream;
+	struct chkpt_queue q;
+	char path[PATH_MAX];
+	pthread_t *threads;
+	int i, nr, nr_threads, nr_done = 0, r;
+
+	memset(&q, 0, sizeof(q));
+
+	if (ipc_stream_target(dir)) {
+		if (open_stream(&stream, dir))
+			return -1;
+		q.stream = &stream;
+	} else if (mkdir(dir, 0700) && errno != EEXIST) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	/* never mix the images of two checkpoints */
+	r = snprintf(path, sizeof(path), "%s/%s", dir, IPC_INDEX_FILE);
+	if (!q.stream
+	    && (r < 0 || r >= sizeof(path) || !access(path, F_OK))) {
+		fprintf(stderr, "%s: %s\n", dir, r < 0 || r >= sizeof(path)
+			? strerror(ENAMETOOLONG) : "already holds a checkpoint");
+		return -1;
+	}
+
+	nr = list_all_objects(&q.objs);
+	if (nr < 0) {
+		if (q.stream)
+			close_stream(q.stream, dir);
+		return -1;
+	}
+
+	qsort(q.objs, nr, sizeof(*q.objs), compare_objs);
+
+	q.done = calloc(nr ? nr : 1, sizeof(*q.done));
+	if (!q.done) {
+		fprintf(stderr, "ipccheckpoint: %s\n", strerror(ENOMEM));
+		free(q.objs);
+		if (q.stream)
+			close_stream(q.stream, dir);
+		return -1;
+	}
+
+	pthread_mutex_init(&q.lock, NULL);
+	q.dir = dir;
+	q.nr_objs = nr;
+
+	if (nr_jobs <= 0)
+		nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_jobs <= 0)
+		nr_jobs = 1;
+	if (nr_jobs > nr)
+		nr_jobs = nr;
+
+	threads = calloc(nr_jobs ? nr_jobs : 1, sizeof(*threads));
+	nr_threads = 0;
+	if (threads)
+		for (; nr_threads < nr_jobs; nr_threads++)
+			if (pthread_create(&threads[nr_threads], NULL,
+					   checkpoint_worker, &q))
+				break;
+
+	if (!nr_threads)
+		checkpoint_worker(&q);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&q.lock);
+
+	/* the index lists the images written */
+	for (i = 0; i < nr; i++)
+		if (q.done[i])
+			q.objs[nr_done++] = q.objs[i];
+
+	if (q.stream) {
+		/* failed objects are aborted in the stream */
+		r = close_stream(q.stream, dir);
+	} else {
+		r = ipc_index_write(dir, q.objs, nr_done);
+		if (r)
+			fprintf(stderr, "%s/%s: %s\n", dir, IPC_INDEX_FILE,
+				strerror(errno));
+	}
+
+	if (nr_done < nr) {
+		fprintf(stderr, "ipccheckpoint: %d of %d objects failed\n",
+			nr - nr_done, nr);
+		r = -1;
+	}
+
+	free(q.done);
+	free(q.objs);
+
+	return r;
+}
+
+/* The key tells the restored object when its id changes */
+int checkpoint_stream(const char *target)
+{
+	struct ipc_stream stream;
+	struct ipc_obj obj, *objs;
+	int i, nr, r;
+
+	memset(&obj, 0, sizeof(obj));
+	switch (ipc_type) {
+	case MSG:
+		obj.type = IPC_OBJ_MSG;
+		break;
+	case SEM:
+		obj.type = IPC_OBJ_SEM;
+		break;
+	default:
+		obj.type = IPC_OBJ_SHM;
+		break;
+	}
+	obj.id = ipcid;
+
+	nr = ipc_list_objects(obj.type, (uid_t)-1, &objs);
+	for (i = 0; i < nr; i++)
+		if (objs[i].id == ipcid)
+			obj = objs[i];
+	if (nr >= 0)
+		free(objs);
+
+	if (open_stream(&stream, target))
+		return -1;
+
+	r = stream_obj(&stream, &obj);
+	if (close_stream(&stream, target))
+		r = -1;
+
+	return r;
+}
+
 int main(int argc, char *argv[])
 {
 	int r, fd, _errno;
 
 	parse_args(argc, argv);
 
-	if (ipc_type == UNDEF
+	if (all && ipc_type == UNDEF && argc - optind == 1) {
+		if (checkpoint_all(argv[optind]))
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (ipc_type == UNDEF || all
 	    || argc - optind != 1) {
 		show_help(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
+	if (ipc_stream_target(argv[optind])) {
+		if (checkpoint_stream(argv[optind]))
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
 	fd = open(argv[optind], O_CREAT|O_EXCL|O_WRONLY, S_IRUSR|S_IWUSR);
 	if (fd == -1) {
 		_errno = errno;
@@ -1,10 +1,16 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/ipc.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <kerrighed.h>
 
 #include <config.h>
@@ -17,6 +23,17 @@ enum ipctype {
 };
 
 enum ipctype ipc_type = UNDEF;
+short all = 0;
+int nr_jobs = 0;
+
+struct restart_queue {
+	pthread_mutex_t lock;
+	const char *dir;
+	struct ipc_obj *objs;
+	int *errors;
+	int nr_objs;
+	int next;
+};
 
 void version(char * program_name)
 {
@@ -31,25 +48,33 @@ warranty; not even for MERCHANBILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\
 void show_help(char * program_name)
 {
 	printf("Usage: %s [-h|--help] [-v|--version] {-q|-s|-m} pathname\n"
+	       "       %s -a|--all [-j|--jobs <N>] directory\n"
+	       "       %s stream\n"
 	       "  -h|--help       Show this information and exit\n"
 	       "  -v|--version    Show version informations and exit\n"
 	       "  -q|--queue      for a message queue\n"
 	       "  -s|--semaphore  for a semaphore array\n"
-	       "  -m|--memory     for a shared memory segment\n",
-	       program_name);
+	       "  -m|--memory     for a shared memory segment\n"
+	       "  -a|--all        for all the objects of the index of directory\n"
+	       "  -j|--jobs       restore <N> objects at once (default: number of CPUs)\n"
+	       "stream is - for the standard input, fd:<N> for file descriptor <N>,\n"
+	       "or unix:<path> for a unix socket, and holds the objects and their types\n",
+	       program_name, program_name, program_name);
 }
 
 void parse_args(int argc, char *argv[])
 {
 	char c;
 	int option_index = 0;
-	char * short_options= "hqsm";
+	char * short_options= "hqsmaj:";
 	static struct option long_options[] = {
 		{"help", no_argument, 0, 'h'},
 		{"version", no_argument, 0, 'v'},
 		{"queue", no_argument, 0, 'q'},
 		{"semaphore", no_argument, 0, 's'},
 		{"memory", no_argument, 0, 'm'},
+		{"all", no_argument, 0, 'a'},
+		{"jobs", required_argument, 0, 'j'},
 		{0, 0, 0, 0}
 	};
 
@@ -71,6 +96,12 @@ void parse_args(int argc, char *argv[])
 		case 'm':
 			ipc_type = SHM;
 			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
 		default:
 			show_help(argv[0]);
 			exit(EXIT_FAILURE);
@@ -116,13 +147,284 @@ int shm_restart(int fd)
 	return r;
 }
 
+/* The image is read once: do not update its access time if possible */
+int open_image(const char *dir, const struct ipc_obj *obj)
+{
+	char path[PATH_MAX];
+	int fd, r;
+
+	r = snprintf(path, sizeof(path), "%s/%s", dir, obj->file);
+	if (r < 0 || r >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY|O_NOATIME);
+	/* O_NOATIME is only allowed to the owner */
+	if (fd == -1 && errno == EPERM)
+		fd = open(path, O_RDONLY);
+
+	return fd;
+}
+
+/*
+ * Start reading every image before the first restore, and sort the
+ * largest first
+ */
+void prefetch_images(const char *dir, struct ipc_obj *objs, int nr)
+{
+	struct stat buf;
+	int i, fd;
+
+	for (i = 0; i < nr; i++) {
+		fd = open_image(dir, &objs[i]);
+		if (fd == -1)
+			continue;
+
+		if (!fstat(fd, &buf))
+			objs[i].size = buf.st_size;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+int compare_objs(const void *a, const void *b)
+{
+	const struct ipc_obj *x = a, *y = b;
+
+	if (x->size != y->size)
+		return x->size < y->size ? 1 : -1;
+	if (x->type != y->type)
+		return x->type - y->type;
+	return x->id - y->id;
+}
+
+void *restart_worker(void *arg)
+{
+	struct restart_queue *q = arg;
+	int i, fd;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->nr_objs)
+			break;
+
+		fd = open_image(q->dir, &q->objs[i]);
+		if (fd == -1) {
+			q->errors[i] = errno;
+			continue;
+		}
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (ipc_obj_restart(q->objs[i].type, fd))
+			q->errors[i] = errno;
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the id of the restored object: found by key unless private,
+ * kept otherwise
+ */
+int restored_id(const struct ipc_obj *obj, struct ipc_obj **lists,
+		const int *nr_lists)
+{
+	const struct ipc_obj *list = lists[obj->type];
+	int i;
+
+	if (obj->key == IPC_PRIVATE)
+		return obj->id;
+
+	for (i = 0; i < nr_lists[obj->type]; i++)
+		if (list[i].key == obj->key)
+			return list[i].id;
+
+	return -1;
+}
+
+void report_restart(const struct restart_queue *q)
+{
+	struct ipc_obj *lists[IPC_OBJ_NR_TYPES];
+	int nr_lists[IPC_OBJ_NR_TYPES];
+	int i, id, nr_failed = 0;
+
+	for (i = 0; i < IPC_OBJ_NR_TYPES; i++) {
+		nr_lists[i] = ipc_list_objects(i, (uid_t)-1, &lists[i]);
+		if (nr_lists[i] < 0) {
+			nr_lists[i] = 0;
+			lists[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < q->nr_objs; i++) {
+		if (q->errors[i]) {
+			nr_failed++;
+			printf("%s %d -> failed: %s\n",
+			       ipc_obj_type_str(q->objs[i].type),
+			       q->objs[i].id, strerror(q->errors[i]));
+			continue;
+		}
+
+		id = restored_id(&q->objs[i], lists, nr_lists);
+		if (id < 0)
+			printf("%s %d -> unknown\n",
+			       ipc_obj_type_str(q->objs[i].type),
+			       q->objs[i].id);
+		else
+			printf("%s %d -> %d\n",
+			       ipc_obj_type_str(q->objs[i].type),
+			       q->objs[i].id, id);
+	}
+
+	printf("Restored %d of %d objects\n", q->nr_objs - nr_failed,
+	       q->nr_objs);
+
+	for (i = 0; i < IPC_OBJ_NR_TYPES; i++)
+		free(lists[i]);
+}
+
+/* SysV IPC objects do not depend on each other: restore them all at once */
+int restart_all(const char *dir)
+{
+	struct restart_queue q;
+	pthread_t *threads;
+	int i, nr, nr_threads, r = 0;
+
+	memset(&q, 0, sizeof(q));
+
+	nr = ipc_index_read(dir, &q.objs);
+	if (nr < 0) {
+		fprintf(stderr, "%s/%s: %s\n", dir, IPC_INDEX_FILE,
+			strerror(errno));
+		return -1;
+	}
+
+	q.errors = calloc(nr ? nr : 1, sizeof(*q.errors));
+	if (!q.errors) {
+		fprintf(stderr, "ipcrestart: %s\n", strerror(ENOMEM));
+		free(q.objs);
+		return -1;
+	}
+
+	prefetch_images(dir, q.objs, nr);
+	qsort(q.objs, nr, sizeof(*q.objs), compare_objs);
+
+	pthread_mutex_init(&q.lock, NULL);
+	q.dir = dir;
+	q.nr_objs = nr;
+
+	if (nr_jobs <= 0)
+		nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_jobs <= 0)
+		nr_jobs = 1;
+	if (nr_jobs > nr)
+		nr_jobs = nr;
+
+	threads = calloc(nr_jobs ? nr_jobs : 1, sizeof(*threads));
+	nr_threads = 0;
+	if (threads)
+		for (; nr_threads < nr_jobs; nr_threads++)
+			if (pthread_create(&threads[nr_threads], NULL,
+					   restart_worker, &q))
+				break;
+
+	if (!nr_threads)
+		restart_worker(&q);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&q.lock);
+
+	report_restart(&q);
+
+	for (i = 0; i < nr; i++)
+		if (q.errors[i])
+			r = -1;
+
+	free(q.errors);
+	free(q.objs);
+
+	return r;
+}
+
+void stream_report(const struct ipc_obj *obj, int error, void *arg)
+{
+	struct restart_queue *q = arg;
+	struct ipc_obj *objs;
+	int *errors;
+
+	objs = realloc(q->objs, (q->nr_objs + 1) * sizeof(*objs));
+	if (objs)
+		q->objs = objs;
+	errors = realloc(q->errors, (q->nr_objs + 1) * sizeof(*errors));
+	if (errors)
+		q->errors = errors;
+	if (!objs || !errors) {
+		fprintf(stderr, "%s %d: %s\n", ipc_obj_type_str(obj->type),
+			obj->id, error ? strerror(error) : "restored");
+		return;
+	}
+
+	q->objs[q->nr_objs] = *obj;
+	q->errors[q->nr_objs] = error;
+	q->nr_objs++;
+}
+
+/* The objects are restored as they arrive, at once if multiplexed */
+int restart_stream(const char *target)
+{
+	struct ipc_stream stream;
+	struct restart_queue q;
+	int r;
+
+	memset(&q, 0, sizeof(q));
+
+	if (ipc_stream_open(&stream, target, 0)) {
+		fprintf(stderr, "%s: %s\n", target, strerror(errno));
+		return -1;
+	}
+
+	/* failed restores stop reading their pipe */
+	signal(SIGPIPE, SIG_IGN);
+
+	r = ipc_stream_restart(&stream, stream_report, &q);
+	if (r < 0)
+		fprintf(stderr, "%s: %s\n", target, strerror(errno));
+	ipc_stream_close(&stream);
+
+	report_restart(&q);
+
+	free(q.errors);
+	free(q.objs);
+
+	return r ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int r, fd, _errno;
 
 	parse_args(argc, argv);
 
-	if (ipc_type == UNDEF
+	if (all && ipc_type == UNDEF && argc - optind == 1) {
+		if (restart_all(argv[optind]))
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (argc - optind == 1 && ipc_stream_target(argv[optind])) {
+		if (restart_stream(argv[optind]))
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (ipc_type == UNDEF || all
 	    || argc - optind != 1) {
 		show_help(argv[0]);
 		exit(EXIT_FAILURE);
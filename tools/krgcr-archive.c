@@ -0,0 +1,580 @@
+/*
+ *  Copyright (c) 2010, Kerlabs
+ *
+ * Single file archive of a checkpoint version, see krgcr-archive.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <kerrighed_tools.h>
+
+#include "krgcr-archive.h"
+
+/* Size of the chunks read or written at once */
+#define ARCHIVE_CHUNK (1 << 20)
+
+struct disk_header {
+	char magic[8];
+	int64_t app_id;
+	int32_t chkpt_sn;
+	uint32_t flags;
+};
+
+struct disk_member {
+	uint32_t magic;
+	uint32_t method;
+	uint64_t size;
+	uint64_t csize;
+	uint32_t crc;
+	uint32_t mode;
+	uint32_t name_len;
+	uint32_t reserved;
+};
+
+struct disk_index {
+	uint32_t magic;
+	uint32_t nr_members;
+};
+
+struct disk_entry {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t csize;
+	uint32_t crc;
+	uint32_t mode;
+	uint32_t method;
+	uint32_t name_len;
+};
+
+struct disk_trailer {
+	uint64_t index_offset;
+	uint64_t index_size;
+	uint32_t nr_members;
+	uint32_t index_crc;
+	char magic[8];
+};
+
+static int pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t r;
+	size_t done = 0;
+
+	while (done < len) {
+		r = pread(fd, (char *)buf + done, len - done, offset + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (!r)
+				errno = EIO;
+			return -1;
+		}
+		done += r;
+	}
+
+	return 0;
+}
+
+static int valid_name(const char *name)
+{
+	return name[0] && name[0] != '.' && !strchr(name, '/');
+}
+
+ssize_t archive_write_header(int fd, long app_id, int chkpt_sn)
+{
+	struct disk_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic));
+	hdr.app_id = htole64(app_id);
+	hdr.chkpt_sn = htole32(chkpt_sn);
+
+	if (krg_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+
+	return sizeof(hdr);
+}
+
+ssize_t archive_read_header(int fd, long *app_id, int *chkpt_sn)
+{
+	struct disk_header hdr;
+
+	if (krg_read_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+
+	if (memcmp(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*app_id = le64toh(hdr.app_id);
+	*chkpt_sn = le32toh(hdr.chkpt_sn);
+
+	return sizeof(hdr);
+}
+
+int archive_spill_file(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char path[PATH_MAX];
+	int fd, r;
+
+	if (!dir || !*dir)
+		dir = "/var/tmp";
+
+	r = snprintf(path, sizeof(path), "%s/krgcr-archive.XXXXXX", dir);
+	if (r < 0 || r >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return -1;
+	unlink(path);
+
+	return fd;
+}
+
+/* Stored members are copied from fd when written: only the crc is needed */
+static int crc_file(int fd, struct archive_member *m)
+{
+	unsigned char *buf;
+	uint64_t pos;
+	size_t len;
+	int r = 0;
+
+	buf = malloc(ARCHIVE_CHUNK);
+	if (!buf)
+		return -1;
+
+	for (pos = 0; pos < m->size; pos += len) {
+		len = m->size - pos < ARCHIVE_CHUNK ? m->size - pos
+						    : ARCHIVE_CHUNK;
+		if (pread_full(fd, buf, len, pos)) {
+			r = -1;
+			break;
+		}
+		m->crc = crc32(m->crc, buf, len);
+	}
+
+	free(buf);
+
+	return r;
+}
+
+int archive_pack(int fd, int level, struct archive_member *m, int data_fd)
+{
+	unsigned char *in = NULL, *out = NULL;
+	struct stat buf;
+	z_stream z;
+	uint64_t left;
+	size_t len, n;
+	int r = -1, zr = Z_OK;
+
+	if (fstat(fd, &buf))
+		return -1;
+
+	m->size = buf.st_size;
+	m->mode = buf.st_mode & 07777;
+	m->crc = crc32(0, Z_NULL, 0);
+
+	if (!level) {
+		if (crc_file(fd, m))
+			return -1;
+
+		m->method = ARCHIVE_STORED;
+		m->csize = m->size;
+
+		return 0;
+	}
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit(&z, level) != Z_OK) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	in = malloc(ARCHIVE_CHUNK);
+	out = malloc(ARCHIVE_CHUNK);
+	if (!in || !out)
+		goto out;
+
+	left = m->size;
+	do {
+		len = left < ARCHIVE_CHUNK ? left : ARCHIVE_CHUNK;
+		if (krg_read_full(fd, in, len) != len)
+			goto out;
+		left -= len;
+
+		m->crc = crc32(m->crc, in, len);
+		z.next_in = in;
+		z.avail_in = len;
+
+		/* until deflate leaves room in the output chunk */
+		do {
+			z.next_out = out;
+			z.avail_out = ARCHIVE_CHUNK;
+			zr = deflate(&z, left ? Z_NO_FLUSH : Z_FINISH);
+			if (zr == Z_STREAM_ERROR) {
+				errno = EIO;
+				goto out;
+			}
+
+			n = ARCHIVE_CHUNK - z.avail_out;
+			if (krg_write_full(data_fd, out, n) != n)
+				goto out;
+		} while (!z.avail_out);
+	} while (left);
+
+	if (zr != Z_STREAM_END) {
+		errno = EIO;
+		goto out;
+	}
+
+	m->method = ARCHIVE_DEFLATE;
+	m->csize = z.total_out;
+	r = 0;
+
+out:
+	deflateEnd(&z);
+	free(in);
+	free(out);
+	return r;
+}
+
+ssize_t archive_write_member(int fd, const struct archive_member *m,
+			     int data_fd)
+{
+	struct disk_member hdr;
+	size_t name_len = strlen(m->name);
+	unsigned char *buf;
+	uint64_t pos;
+	size_t len;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = htole32(ARCHIVE_MEMBER_MAGIC);
+	hdr.method = htole32(m->method);
+	hdr.size = htole64(m->size);
+	hdr.csize = htole64(m->csize);
+	hdr.crc = htole32(m->crc);
+	hdr.mode = htole32(m->mode);
+	hdr.name_len = htole32(name_len);
+
+	if (krg_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	    || krg_write_full(fd, m->name, name_len) != name_len)
+		return -1;
+
+	buf = malloc(ARCHIVE_CHUNK);
+	if (!buf)
+		return -1;
+
+	for (pos = 0; pos < m->csize; pos += len) {
+		len = m->csize - pos < ARCHIVE_CHUNK ? m->csize - pos
+						     : ARCHIVE_CHUNK;
+		if (pread_full(data_fd, buf, len, pos)
+		    || krg_write_full(fd, buf, len) != len) {
+			free(buf);
+			return -1;
+		}
+	}
+
+	free(buf);
+
+	return sizeof(hdr) + name_len + m->csize;
+}
+
+int archive_write_index(int fd, const struct archive_member *members, int nr,
+			uint64_t offset)
+{
+	struct disk_trailer trailer;
+	struct disk_index *idx;
+	struct disk_entry *entry;
+	size_t size, name_len;
+	char *buf, *ptr;
+	int i, r;
+
+	size = sizeof(*idx);
+	for (i = 0; i < nr; i++)
+		size += sizeof(*entry) + strlen(members[i].name);
+
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+
+	idx = (struct disk_index *)buf;
+	idx->magic = htole32(ARCHIVE_INDEX_MAGIC);
+	idx->nr_members = htole32(nr);
+
+	ptr = buf + sizeof(*idx);
+	for (i = 0; i < nr; i++) {
+		struct disk_entry e;
+
+		name_len = strlen(members[i].name);
+		e.offset = htole64(members[i].offset);
+		e.size = htole64(members[i].size);
+		e.csize = htole64(members[i].csize);
+		e.crc = htole32(members[i].crc);
+		e.mode = htole32(members[i].mode);
+		e.method = htole32(members[i].method);
+		e.name_len = htole32(name_len);
+
+		memcpy(ptr, &e, sizeof(e));
+		ptr += sizeof(e);
+		memcpy(ptr, members[i].name, name_len);
+		ptr += name_len;
+	}
+
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.index_offset = htole64(offset);
+	trailer.index_size = htole64(size);
+	trailer.nr_members = htole32(nr);
+	trailer.index_crc = htole32(crc32(crc32(0, Z_NULL, 0),
+					  (unsigned char *)buf, size));
+	memcpy(trailer.magic, ARCHIVE_TRAILER_MAGIC, sizeof(trailer.magic));
+
+	r = 0;
+	if (krg_write_full(fd, buf, size) != size
+	    || krg_write_full(fd, &trailer, sizeof(trailer)) != sizeof(trailer))
+		r = -1;
+
+	free(buf);
+
+	return r;
+}
+
+int archive_read_index(int fd, struct archive_member **members)
+{
+	struct disk_trailer trailer;
+	struct disk_index idx;
+	struct disk_entry e;
+	struct archive_member *array;
+	uint64_t size, name_len;
+	char *buf, *ptr, *end;
+	off_t file_size;
+	int i, nr;
+
+	file_size = lseek(fd, 0, SEEK_END);
+	if (file_size < (off_t)sizeof(trailer))
+		goto err_inval;
+
+	if (pread_full(fd, &trailer, sizeof(trailer),
+		       file_size - sizeof(trailer)))
+		return -1;
+
+	if (memcmp(trailer.magic, ARCHIVE_TRAILER_MAGIC, sizeof(trailer.magic)))
+		goto err_inval;
+
+	size = le64toh(trailer.index_size);
+	nr = le32toh(trailer.nr_members);
+	if (size < sizeof(idx) || size > file_size
+	    || le64toh(trailer.index_offset) > file_size - size)
+		goto err_inval;
+
+	buf = malloc(size);
+	array = calloc(nr ? nr : 1, sizeof(*array));
+	if (!buf || !array)
+		goto err_free;
+
+	if (pread_full(fd, buf, size, le64toh(trailer.index_offset)))
+		goto err_free;
+
+	if (crc32(crc32(0, Z_NULL, 0), (unsigned char *)buf, size)
+	    != le32toh(trailer.index_crc))
+		goto err_free_io;
+
+	memcpy(&idx, buf, sizeof(idx));
+	if (le32toh(idx.magic) != ARCHIVE_INDEX_MAGIC
+	    || le32toh(idx.nr_members) != nr)
+		goto err_free_io;
+
+	ptr = buf + sizeof(idx);
+	end = buf + size;
+	for (i = 0; i < nr; i++) {
+		if (end - ptr < sizeof(e))
+			goto err_free_io;
+		memcpy(&e, ptr, sizeof(e));
+		ptr += sizeof(e);
+
+		name_len = le32toh(e.name_len);
+		if (name_len > NAME_MAX || end - ptr < name_len)
+			goto err_free_io;
+		memcpy(array[i].name, ptr, name_len);
+		array[i].name[name_len] = '\0';
+		ptr += name_len;
+
+		if (!valid_name(array[i].name))
+			goto err_free_io;
+
+		array[i].offset = le64toh(e.offset);
+		array[i].size = le64toh(e.size);
+		array[i].csize = le64toh(e.csize);
+		array[i].crc = le32toh(e.crc);
+		array[i].mode = le32toh(e.mode);
+		array[i].method = le32toh(e.method);
+	}
+
+	free(buf);
+	*members = array;
+
+	return nr;
+
+err_free_io:
+	errno = EIO;
+err_free:
+	free(buf);
+	free(array);
+	return -1;
+
+err_inval:
+	errno = EINVAL;
+	return -1;
+}
+
+int archive_next_member(int fd, struct archive_member *m)
+{
+	struct disk_member hdr;
+	uint32_t name_len;
+
+	if (krg_read_full(fd, &hdr.magic, sizeof(hdr.magic))
+	    != sizeof(hdr.magic))
+		return -1;
+
+	if (le32toh(hdr.magic) == ARCHIVE_INDEX_MAGIC)
+		return 0;
+
+	if (le32toh(hdr.magic) != ARCHIVE_MEMBER_MAGIC) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (krg_read_full(fd, (char *)&hdr + sizeof(hdr.magic),
+			  sizeof(hdr) - sizeof(hdr.magic))
+	    != sizeof(hdr) - sizeof(hdr.magic))
+		return -1;
+
+	name_len = le32toh(hdr.name_len);
+	if (name_len > NAME_MAX) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (krg_read_full(fd, m->name, name_len) != name_len)
+		return -1;
+	m->name[name_len] = '\0';
+
+	if (!valid_name(m->name)) {
+		errno = EIO;
+		return -1;
+	}
+
+	m->offset = 0;
+	m->size = le64toh(hdr.size);
+	m->csize = le64toh(hdr.csize);
+	m->crc = le32toh(hdr.crc);
+	m->mode = le32toh(hdr.mode);
+	m->method = le32toh(hdr.method);
+
+	return 1;
+}
+
+int archive_unpack(int fd, int seekable, const struct archive_member *m,
+		   int out_fd)
+{
+	unsigned char *in, *out;
+	uint64_t left, written = 0;
+	uint32_t crc;
+	off_t pos;
+	z_stream z;
+	size_t len, n;
+	int r = -1, zr = Z_OK;
+
+	if (m->method != ARCHIVE_STORED && m->method != ARCHIVE_DEFLATE) {
+		errno = EIO;
+		return -1;
+	}
+
+	memset(&z, 0, sizeof(z));
+	if (m->method == ARCHIVE_DEFLATE && inflateInit(&z) != Z_OK) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	in = malloc(ARCHIVE_CHUNK);
+	out = malloc(ARCHIVE_CHUNK);
+	if (!in || !out)
+		goto out;
+
+	pos = m->offset + sizeof(struct disk_member) + strlen(m->name);
+	crc = crc32(0, Z_NULL, 0);
+
+	for (left = m->csize; left; left -= len) {
+		len = left < ARCHIVE_CHUNK ? left : ARCHIVE_CHUNK;
+		if (seekable ? pread_full(fd, in, len, pos)
+			     : krg_read_full(fd, in, len) != len)
+			goto out;
+		pos += len;
+
+		if (m->method == ARCHIVE_STORED) {
+			crc = crc32(crc, in, len);
+			if (krg_write_full(out_fd, in, len) != len)
+				goto out;
+			written += len;
+			continue;
+		}
+
+		z.next_in = in;
+		z.avail_in = len;
+		do {
+			z.next_out = out;
+			z.avail_out = ARCHIVE_CHUNK;
+			zr = inflate(&z, Z_NO_FLUSH);
+			if (zr != Z_OK && zr != Z_STREAM_END) {
+				errno = EIO;
+				goto out;
+			}
+
+			n = ARCHIVE_CHUNK - z.avail_out;
+			crc = crc32(crc, out, n);
+			if (krg_write_full(out_fd, out, n) != n)
+				goto out;
+			written += n;
+		} while (zr != Z_STREAM_END && (z.avail_in || !z.avail_out));
+	}
+
+	if (written != m->size || crc != m->crc
+	    || (m->method == ARCHIVE_DEFLATE && zr != Z_STREAM_END)) {
+		errno = EIO;
+		goto out;
+	}
+
+	r = 0;
+
+out:
+	if (m->method == ARCHIVE_DEFLATE)
+		inflateEnd(&z);
+	free(in);
+	free(out);
+	return r;
+}
+
+int archive_skip(int fd, const struct archive_member *m)
+{
+	char buf[65536];
+	uint64_t left;
+	size_t len;
+
+	for (left = m->csize; left; left -= len) {
+		len = left < sizeof(buf) ? left : sizeof(buf);
+		if (krg_read_full(fd, buf, len) != len)
+			return -1;
+	}
+
+	return 0;
+}
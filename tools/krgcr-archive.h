@@ -0,0 +1,140 @@
+/*
+ *  Copyright (c) 2010, Kerlabs
+ *
+ * Single file archive of a checkpoint version, shared by krgcr-export
+ * and krgcr-import.
+ *
+ * Layout (all integers little endian):
+ *
+ *   archive header
+ *   member header, name, data      (once per file of the version)
+ *   ...
+ *   index header, index entries    (one entry with name per member)
+ *   trailer
+ *
+ * Members may appear in any order: the index gives the offset of each
+ * one. An archive can be written to a pipe since nothing is rewritten,
+ * read from a pipe using member headers, or accessed randomly using the
+ * index found through the trailer.
+ */
+#ifndef KRGCR_ARCHIVE_H
+#define KRGCR_ARCHIVE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#define ARCHIVE_MAGIC		"KRGCRAR1"
+#define ARCHIVE_TRAILER_MAGIC	"KRGCREND"
+#define ARCHIVE_MEMBER_MAGIC	0x4d47524bU	/* "KRGM" */
+#define ARCHIVE_INDEX_MAGIC	0x4947524bU	/* "KRGI" */
+
+enum archive_method {
+	ARCHIVE_STORED,
+	ARCHIVE_DEFLATE,
+};
+
+struct archive_member {
+	char name[NAME_MAX + 1];
+	uint64_t offset;	/* of the member header */
+	uint64_t size;		/* of the file */
+	uint64_t csize;		/* of the data in the archive */
+	uint32_t crc;		/* crc32 of the file */
+	uint32_t mode;
+	uint32_t method;
+};
+
+/*
+ * archive_write_header / archive_read_header
+ *
+ * Return the number of bytes written/read, -1 on failure
+ */
+ssize_t archive_write_header(int fd, long app_id, int chkpt_sn);
+ssize_t archive_read_header(int fd, long *app_id, int *chkpt_sn);
+
+/*
+ * archive_spill_file
+ *
+ * Create an unlinked temporary file in $TMPDIR (default /var/tmp), to keep
+ * packed members out of memory until they are written
+ *
+ * Return its file descriptor, -1 on failure
+ */
+int archive_spill_file(void);
+
+/*
+ * archive_pack
+ *
+ * Read file fd and fill member m. At level 1 to 9, the content is deflated
+ * to data_fd, chunk by chunk. At level 0, it is stored: nothing is written
+ * and the data of the member is fd itself.
+ *
+ * Return 0 on success, -1 on failure
+ */
+int archive_pack(int fd, int level, struct archive_member *m, int data_fd);
+
+/*
+ * archive_write_member
+ *
+ * Write the header of member m, then its data, read from the start of
+ * data_fd
+ *
+ * Return the number of bytes written, -1 on failure
+ */
+ssize_t archive_write_member(int fd, const struct archive_member *m,
+			     int data_fd);
+
+/*
+ * archive_write_index
+ *
+ * Write the index of the nr members, written before offset, and the
+ * trailer
+ *
+ * Return 0 on success, -1 on failure
+ */
+int archive_write_index(int fd, const struct archive_member *members, int nr,
+			uint64_t offset);
+
+/*
+ * archive_read_index
+ *
+ * Fill *members with the index of seekable archive fd. *members must be
+ * freed by caller.
+ *
+ * Return the number of members, -1 on failure
+ */
+int archive_read_index(int fd, struct archive_member **members);
+
+/*
+ * archive_next_member
+ *
+ * Read the next member header of an archive read sequentially.
+ *
+ * Return 1 if a member has been read, 0 at the end of the members, -1 on
+ * failure
+ */
+int archive_next_member(int fd, struct archive_member *m);
+
+/*
+ * archive_unpack
+ *
+ * Write the content of member m to out_fd, checking its crc. If
+ * seekable is set, data is read at the offset given by the index,
+ * otherwise it is read from the current position, just after the
+ * member header.
+ *
+ * Return 0 on success, -1 on failure (errno is EIO if data is corrupted)
+ */
+int archive_unpack(int fd, int seekable, const struct archive_member *m,
+		   int out_fd);
+
+/*
+ * archive_skip
+ *
+ * Skip the data of member m in an archive read sequentially
+ *
+ * Return 0 on success, -1 on failure
+ */
+int archive_skip(int fd, const struct archive_member *m);
+
+#endif /* KRGCR_ARCHIVE_H */
@@ -0,0 +1,133 @@
+/*
+ *  Copyright (c) 2010, Kerlabs
+ *
+ * Monitor how fast an application dirties its memory.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <kerrighed.h>
+
+#include <config.h>
+
+unsigned int interval_ms = 1000;
+int nr_samples = 0;
+
+void show_version(char * program_name)
+{
+	printf("\
+%s %s\n\
+Copyright (C) 2010 Kerlabs.\n\
+This is free software; see source for copying conditions. There is NO\n\
+warranty; not even for MERCHANBILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\
+\n", program_name, VERSION);
+}
+
+void show_help(char * program_name)
+{
+	printf("Usage: %s [options] pid\n"
+	       "\n"
+	       "Print the memory dirtied by the application of process pid during\n"
+	       "each interval, which an incremental checkpoint would save.\n"
+	       "\n"
+	       "  -h|--help               Display this information and exit\n"
+	       "  -v|--version            Display version informations and exit\n"
+	       "  -i|--interval <ms>      Sample every <ms> milliseconds (default: 1000)\n"
+	       "  -n|--count <N>          Exit after <N> samples (default: until the application exits)\n",
+	       program_name);
+}
+
+void parse_args(int argc, char *argv[])
+{
+	char c;
+	int option_index = 0;
+	char * short_options= "hvi:n:";
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"version", no_argument, 0, 'v'},
+		{"interval", required_argument, 0, 'i'},
+		{"count", required_argument, 0, 'n'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'h':
+			show_help(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			show_version(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'n':
+			nr_samples = atoi(optarg);
+			break;
+		default:
+			show_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!interval_ms || nr_samples < 0) {
+		show_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct chkpt_dirty dirty;
+	struct timespec interval;
+	unsigned long long elapsed_ms = 0;
+	pid_t pid;
+	int i;
+
+	parse_args(argc, argv);
+
+	if (argc - optind != 1) {
+		show_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	pid = atoi(argv[optind]);
+	interval.tv_sec = interval_ms / 1000;
+	interval.tv_nsec = (interval_ms % 1000) * 1000000;
+
+	if (chkpt_dirty_start(pid, &dirty)) {
+		fprintf(stderr, "krgcr-dirty: %d: %s\n", pid,
+			errno == ENOTSUP ? "soft-dirty bits not supported "
+					   "by the kernel" : strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%10s %9s %12s %12s\n", "time(ms)", "processes", "dirty(kB)",
+	       "rate(kB/s)");
+
+	for (i = 0; !nr_samples || i < nr_samples; i++) {
+		nanosleep(&interval, NULL);
+
+		if (chkpt_dirty_sample(&dirty)) {
+			/* the application is over */
+			if (errno == ESRCH)
+				break;
+			perror("krgcr-dirty");
+			exit(EXIT_FAILURE);
+		}
+
+		elapsed_ms += dirty.interval_ms;
+		printf("%10llu %9d %12llu %12llu\n", elapsed_ms,
+		       dirty.nr_processes, dirty.bytes >> 10,
+		       dirty.bytes_per_s >> 10);
+		fflush(stdout);
+	}
+
+	exit(EXIT_SUCCESS);
+}
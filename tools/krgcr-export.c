@@ -0,0 +1,397 @@
+/*
+ *  Copyright (c) 2010, Kerlabs
+ *
+ * Pack a checkpoint version in a single file archive.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <kerrighed.h>
+
+#include <config.h>
+
+#include "krgcr-archive.h"
+
+char *output = NULL;
+int nr_jobs = 0;
+int level = 1;
+short quiet = 0;
+
+struct export_job {
+	struct archive_member m;
+	int data_fd;		/* spill file, or the file itself if stored */
+	int ready;
+	int written;
+};
+
+struct export_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const char *dir;
+	struct export_job *jobs;
+	int nr_jobs;
+	int next;
+	int nr_ready;
+	int max_ready;
+	int error;
+};
+
+void show_version(char * program_name)
+{
+	printf("\
+%s %s\n\
+Copyright (C) 2010 Kerlabs.\n\
+This is free software; see source for copying conditions. There is NO\n\
+warranty; not even for MERCHANBILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\
+\n", program_name, VERSION);
+}
+
+void show_help(char * program_name)
+{
+	printf("Usage: %s [options] appid version\n"
+	       "\n"
+	       "  -h|--help               Display this information and exit\n"
+	       "  -v|--version            Display version informations and exit\n"
+	       "  -q|--quiet              Be less verbose\n"
+	       "  -o|--output <file>      Write the archive to <file> (default: standard output)\n"
+	       "  -j|--jobs <N>           Compress <N> files at once (default: number of CPUs)\n"
+	       "  -l|--level <0-9>        Compression level, 0 to store files (default: 1)\n",
+	       program_name);
+}
+
+void parse_args(int argc, char *argv[])
+{
+	char c;
+	int option_index = 0;
+	char * short_options= "hvqo:j:l:";
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"version", no_argument, 0, 'v'},
+		{"quiet", no_argument, 0, 'q'},
+		{"output", required_argument, 0, 'o'},
+		{"jobs", required_argument, 0, 'j'},
+		{"level", required_argument, 0, 'l'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'h':
+			show_help(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			show_version(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'q':
+			quiet = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
+		case 'l':
+			level = atoi(optarg);
+			if (level < 0 || level > 9) {
+				show_help(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			show_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int list_members(const char *dir_path, struct export_job **jobs)
+{
+	struct export_job *array = NULL, *tmp;
+	char path[PATH_MAX];
+	struct dirent *ent;
+	struct stat buf;
+	DIR *dir;
+	int nr = 0;
+
+	dir = opendir(dir_path);
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+		if (ent->d_name[0] == '.' || stat(path, &buf)
+		    || !S_ISREG(buf.st_mode))
+			continue;
+
+		tmp = realloc(array, (nr + 1) * sizeof(*array));
+		if (!tmp) {
+			free(array);
+			closedir(dir);
+			return -1;
+		}
+		array = tmp;
+
+		memset(&array[nr], 0, sizeof(array[nr]));
+		strcpy(array[nr].m.name, ent->d_name);
+		array[nr].data_fd = -1;
+		nr++;
+	}
+	closedir(dir);
+
+	*jobs = array;
+
+	return nr;
+}
+
+void *compress_worker(void *arg)
+{
+	struct export_queue *q = arg;
+	struct export_job *job;
+	char path[PATH_MAX];
+	int fd, r, i;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		/* bound the spill files of members not written yet */
+		while (q->nr_ready >= q->max_ready && !q->error)
+			pthread_cond_wait(&q->cond, &q->lock);
+		i = q->next++;
+		if (q->error)
+			i = q->nr_jobs;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->nr_jobs)
+			break;
+
+		job = &q->jobs[i];
+		snprintf(path, sizeof(path), "%s/%s", q->dir, job->m.name);
+
+		r = -1;
+		fd = open(path, O_RDONLY);
+		if (fd != -1 && !level) {
+			r = archive_pack(fd, level, &job->m, -1);
+			job->data_fd = fd;
+		} else if (fd != -1) {
+			job->data_fd = archive_spill_file();
+			if (job->data_fd != -1)
+				r = archive_pack(fd, level, &job->m,
+						 job->data_fd);
+			else
+				strcpy(path, "temporary file");
+			close(fd);
+		}
+		if (r)
+			fprintf(stderr, "krgcr-export: %s: %s\n", path,
+				strerror(errno));
+
+		pthread_mutex_lock(&q->lock);
+		if (r)
+			q->error = 1;
+		job->ready = 1;
+		q->nr_ready++;
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Members are written as soon as they are packed, whatever their order:
+ * the index at the end of the archive tells where each one is.
+ */
+int write_members(int fd, struct export_queue *q, uint64_t *offset)
+{
+	struct export_job *job = NULL;
+	ssize_t r;
+	int i, nr_written;
+
+	for (nr_written = 0; nr_written < q->nr_jobs; nr_written++) {
+		pthread_mutex_lock(&q->lock);
+		for (;;) {
+			i = q->nr_jobs;
+			if (q->error)
+				break;
+			for (i = 0; i < q->nr_jobs; i++)
+				if (q->jobs[i].ready && !q->jobs[i].written)
+					break;
+			if (i < q->nr_jobs)
+				break;
+			pthread_cond_wait(&q->cond, &q->lock);
+		}
+		pthread_mutex_unlock(&q->lock);
+
+		if (i == q->nr_jobs)
+			return -1;
+
+		job = &q->jobs[i];
+		job->m.offset = *offset;
+		r = archive_write_member(fd, &job->m, job->data_fd);
+
+		pthread_mutex_lock(&q->lock);
+		close(job->data_fd);
+		job->data_fd = -1;
+		job->written = 1;
+		q->nr_ready--;
+		if (r < 0)
+			q->error = 1;
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+
+		if (r < 0) {
+			perror("krgcr-export");
+			return -1;
+		}
+		*offset += r;
+	}
+
+	return 0;
+}
+
+int export_version(int fd, long app_id, int chkpt_sn)
+{
+	struct export_queue q;
+	struct archive_member *members;
+	pthread_t *threads;
+	char dir[PATH_MAX];
+	uint64_t offset, size = 0;
+	ssize_t len;
+	int i, nr_threads, r = -1;
+
+	if (chkpt_version_dir(dir, sizeof(dir), app_id, chkpt_sn))
+		return -1;
+
+	memset(&q, 0, sizeof(q));
+	q.dir = dir;
+	q.nr_jobs = list_members(dir, &q.jobs);
+	if (q.nr_jobs < 0) {
+		perror(dir);
+		return -1;
+	}
+
+	len = archive_write_header(fd, app_id, chkpt_sn);
+	if (len < 0) {
+		perror("krgcr-export");
+		goto out_jobs;
+	}
+	offset = len;
+
+	if (nr_jobs <= 0)
+		nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_jobs <= 0)
+		nr_jobs = 1;
+	q.max_ready = nr_jobs;
+
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+
+	threads = calloc(nr_jobs, sizeof(*threads));
+	if (!threads)
+		goto out_lock;
+
+	for (nr_threads = 0; nr_threads < nr_jobs; nr_threads++)
+		if (pthread_create(&threads[nr_threads], NULL,
+				   compress_worker, &q))
+			break;
+	if (!nr_threads) {
+		perror("pthread_create");
+		goto out_threads;
+	}
+
+	r = write_members(fd, &q, &offset);
+
+	pthread_mutex_lock(&q.lock);
+	if (r)
+		q.error = 1;
+	pthread_cond_broadcast(&q.cond);
+	pthread_mutex_unlock(&q.lock);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (r)
+		goto out_threads;
+
+	members = malloc((q.nr_jobs ? q.nr_jobs : 1) * sizeof(*members));
+	if (!members) {
+		r = -1;
+		goto out_threads;
+	}
+	for (i = 0; i < q.nr_jobs; i++) {
+		members[i] = q.jobs[i].m;
+		size += members[i].size;
+	}
+
+	r = archive_write_index(fd, members, q.nr_jobs, offset);
+	if (r)
+		perror("krgcr-export");
+	else if (!quiet)
+		fprintf(stderr, "Exported version %d of application %ld: "
+			"%d files, %llu bytes in %llu bytes\n", chkpt_sn,
+			app_id, q.nr_jobs, (unsigned long long)size,
+			(unsigned long long)offset);
+
+	free(members);
+
+out_threads:
+	free(threads);
+out_lock:
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+out_jobs:
+	for (i = 0; i < q.nr_jobs; i++)
+		if (q.jobs[i].data_fd != -1)
+			close(q.jobs[i].data_fd);
+	free(q.jobs);
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, r;
+
+	parse_args(argc, argv);
+
+	if (argc - optind != 2) {
+		show_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!output || !strcmp(output, "-")) {
+		fd = STDOUT_FILENO;
+		if (isatty(fd)) {
+			fprintf(stderr, "krgcr-export: refusing to write an "
+				"archive to a terminal\n");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		fd = open(output, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		if (fd == -1) {
+			perror(output);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	r = export_version(fd, atol(argv[optind]), atoi(argv[optind + 1]));
+
+	if (close(fd))
+		r = -1;
+
+	if (r) {
+		if (output && strcmp(output, "-"))
+			unlink(output);
+		exit(EXIT_FAILURE);
+	}
+
+	exit(EXIT_SUCCESS);
+}
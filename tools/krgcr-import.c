@@ -0,0 +1,404 @@
+/*
+ *  Copyright (c) 2010, Kerlabs
+ *
+ * Unpack a checkpoint version from a single file archive.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <kerrighed.h>
+
+#include <config.h>
+
+#include "krgcr-archive.h"
+
+typedef enum {
+	EXTRACT,
+	LIST,
+	EXTRACT_MEMBER,
+} import_action_t;
+
+import_action_t action = EXTRACT;
+char *input = NULL;
+char *member = NULL;
+int nr_jobs = 0;
+short quiet = 0;
+
+struct import_queue {
+	pthread_mutex_t lock;
+	int fd;
+	const char *dir;
+	const struct archive_member *members;
+	int nr_members;
+	int next;
+	int error;
+};
+
+void show_version(char * program_name)
+{
+	printf("\
+%s %s\n\
+Copyright (C) 2010 Kerlabs.\n\
+This is free software; see source for copying conditions. There is NO\n\
+warranty; not even for MERCHANBILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\
+\n", program_name, VERSION);
+}
+
+void show_help(char * program_name)
+{
+	printf("Usage: %s [options] [appid version]\n"
+	       "\n"
+	       "Unpack the archive as version of application appid, as recorded in\n"
+	       "the archive by default.\n"
+	       "\n"
+	       "  -h|--help               Display this information and exit\n"
+	       "  -v|--version            Display version informations and exit\n"
+	       "  -q|--quiet              Be less verbose\n"
+	       "  -i|--input <file>       Read the archive from <file> (default: standard input)\n"
+	       "  -j|--jobs <N>           Uncompress <N> files at once (default: number of CPUs)\n"
+	       "  -l|--list               List the files of the archive\n"
+	       "  -x|--extract <name>     Write file <name> of the archive to standard output\n",
+	       program_name);
+}
+
+void parse_args(int argc, char *argv[])
+{
+	char c;
+	int option_index = 0;
+	char * short_options= "hvqi:j:lx:";
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"version", no_argument, 0, 'v'},
+		{"quiet", no_argument, 0, 'q'},
+		{"input", required_argument, 0, 'i'},
+		{"jobs", required_argument, 0, 'j'},
+		{"list", no_argument, 0, 'l'},
+		{"extract", required_argument, 0, 'x'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'h':
+			show_help(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			show_version(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'q':
+			quiet = 1;
+			break;
+		case 'i':
+			input = optarg;
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
+		case 'l':
+			action = LIST;
+			break;
+		case 'x':
+			action = EXTRACT_MEMBER;
+			member = optarg;
+			break;
+		default:
+			show_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void print_member(const struct archive_member *m)
+{
+	printf("%12llu %12llu %04o %s\n", (unsigned long long)m->size,
+	       (unsigned long long)m->csize, m->mode, m->name);
+}
+
+int unpack_file(int fd, int seekable, const char *dir,
+		const struct archive_member *m)
+{
+	char path[PATH_MAX];
+	int out_fd, r;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, m->name);
+
+	out_fd = open(path, O_WRONLY|O_CREAT|O_EXCL, m->mode & 0777);
+	if (out_fd == -1) {
+		perror(path);
+		return -1;
+	}
+
+	r = archive_unpack(fd, seekable, m, out_fd);
+	if (!r)
+		r = fsync(out_fd);
+	if (close(out_fd))
+		r = -1;
+
+	if (r)
+		fprintf(stderr, "krgcr-import: %s: %s\n", m->name,
+			errno == EIO ? "corrupted data" : strerror(errno));
+
+	return r;
+}
+
+void *unpack_worker(void *arg)
+{
+	struct import_queue *q = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i = q->error ? q->nr_members : q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->nr_members)
+			break;
+
+		if (unpack_file(q->fd, 1, q->dir, &q->members[i])) {
+			pthread_mutex_lock(&q->lock);
+			q->error = 1;
+			pthread_mutex_unlock(&q->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* Random access: members are read concurrently at their offsets */
+int unpack_seekable(int fd, const char *dir, const struct archive_member *m,
+		    int nr)
+{
+	struct import_queue q;
+	pthread_t *threads;
+	int i, nr_threads;
+
+	memset(&q, 0, sizeof(q));
+	pthread_mutex_init(&q.lock, NULL);
+	q.fd = fd;
+	q.dir = dir;
+	q.members = m;
+	q.nr_members = nr;
+
+	if (nr_jobs <= 0)
+		nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_jobs <= 0)
+		nr_jobs = 1;
+
+	threads = calloc(nr_jobs, sizeof(*threads));
+	if (!threads) {
+		q.error = 1;
+		goto out;
+	}
+
+	for (nr_threads = 0; nr_threads < nr_jobs; nr_threads++)
+		if (pthread_create(&threads[nr_threads], NULL,
+				   unpack_worker, &q))
+			break;
+
+	if (!nr_threads)
+		unpack_worker(&q);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+out:
+	pthread_mutex_destroy(&q.lock);
+
+	return q.error ? -1 : 0;
+}
+
+int unpack_stream(int fd, const char *dir)
+{
+	struct archive_member m;
+	int r;
+
+	while ((r = archive_next_member(fd, &m)) > 0)
+		if (unpack_file(fd, 0, dir, &m))
+			return -1;
+
+	if (r)
+		perror("krgcr-import");
+
+	return r;
+}
+
+int import_version(int fd, int seekable, const struct archive_member *members,
+		   int nr, long app_id, int chkpt_sn)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct stat buf;
+	int r;
+
+	snprintf(path, sizeof(path), "%s/%ld", CHKPT_DIR, app_id);
+	if (mkdir(path, 0700) && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+
+	if (chkpt_version_dir(path, sizeof(path), app_id, chkpt_sn))
+		return -1;
+
+	if (!lstat(path, &buf)) {
+		fprintf(stderr, "krgcr-import: version %d of application %ld "
+			"already exists\n", chkpt_sn, app_id);
+		return -1;
+	}
+
+	/* the version appears only once complete */
+	r = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (r < 0 || r >= sizeof(tmp)) {
+		fprintf(stderr, "krgcr-import: %s: %s\n", path,
+			strerror(ENAMETOOLONG));
+		return -1;
+	}
+	chkpt_remove_dir(tmp);
+	if (mkdir(tmp, 0700)) {
+		perror(tmp);
+		return -1;
+	}
+
+	if (seekable)
+		r = unpack_seekable(fd, tmp, members, nr);
+	else
+		r = unpack_stream(fd, tmp);
+
+	if (!r) {
+		r = rename(tmp, path);
+		if (r)
+			perror(path);
+	}
+
+	if (!r && chkpt_index_add(app_id, chkpt_sn))
+		perror("krgcr-import: fail to index the new version");
+
+	if (r)
+		chkpt_remove_dir(tmp);
+	else if (!quiet)
+		fprintf(stderr, "Imported version %d of application %ld\n",
+			chkpt_sn, app_id);
+
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	struct archive_member *members = NULL, m;
+	long app_id;
+	int fd, chkpt_sn, seekable, i, nr = 0, r = -1;
+	ssize_t offset;
+
+	parse_args(argc, argv);
+
+	if (argc - optind != 0 && argc - optind != 2) {
+		show_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!input || !strcmp(input, "-")) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(input, O_RDONLY);
+		if (fd == -1) {
+			perror(input);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	offset = archive_read_header(fd, &app_id, &chkpt_sn);
+	if (offset < 0) {
+		fprintf(stderr, "krgcr-import: not a checkpoint archive\n");
+		goto out;
+	}
+
+	if (argc - optind == 2) {
+		app_id = atol(argv[optind]);
+		chkpt_sn = atoi(argv[optind + 1]);
+	}
+
+	/* pipes are read sequentially using member headers */
+	seekable = lseek(fd, 0, SEEK_CUR) != -1;
+	if (seekable) {
+		nr = archive_read_index(fd, &members);
+		if (nr < 0) {
+			fprintf(stderr, "krgcr-import: invalid archive index: "
+				"%s\n", strerror(errno));
+			goto out;
+		}
+		/* back after the header for sequential reads */
+		lseek(fd, offset, SEEK_SET);
+	}
+
+	switch (action) {
+	case LIST:
+		printf("application %ld version %d\n", app_id, chkpt_sn);
+		if (seekable) {
+			for (i = 0; i < nr; i++)
+				print_member(&members[i]);
+			r = 0;
+			break;
+		}
+		while ((r = archive_next_member(fd, &m)) > 0) {
+			print_member(&m);
+			if (archive_skip(fd, &m)) {
+				r = -1;
+				break;
+			}
+		}
+		if (r)
+			perror("krgcr-import");
+		break;
+	case EXTRACT_MEMBER:
+		if (seekable) {
+			for (i = 0; i < nr; i++)
+				if (!strcmp(members[i].name, member))
+					break;
+			if (i < nr)
+				r = archive_unpack(fd, 1, &members[i],
+						   STDOUT_FILENO);
+			else
+				errno = ENOENT;
+		} else {
+			while ((r = archive_next_member(fd, &m)) > 0) {
+				if (!strcmp(m.name, member))
+					break;
+				if (archive_skip(fd, &m)) {
+					r = -1;
+					break;
+				}
+			}
+			if (r > 0)
+				r = archive_unpack(fd, 0, &m, STDOUT_FILENO);
+			else if (!r) {
+				errno = ENOENT;
+				r = -1;
+			}
+		}
+		if (r)
+			fprintf(stderr, "krgcr-import: %s: %s\n", member,
+				errno == EIO ? "corrupted data"
+					     : strerror(errno));
+		break;
+	case EXTRACT:
+		r = import_version(fd, seekable, members, nr, app_id,
+				   chkpt_sn);
+		break;
+	}
+
+out:
+	free(members);
+	close(fd);
+
+	if (r)
+		exit(EXIT_FAILURE);
+
+	exit(EXIT_SUCCESS);
+}
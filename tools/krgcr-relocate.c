@@ -0,0 +1,485 @@
+/*
+ *  Copyright (c) 2010, Kerlabs
+ *
+ * Relocate an application: checkpoint it, kill it and restart it on other
+ * nodes in a single step.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <kerrighed.h>
+#include <libkrgcb.h>
+
+#include <config.h>
+
+/* Time given to the checkpointed processes to exit */
+#define EXIT_TIMEOUT_MS 10000
+
+enum relocate_stage {
+	STAGE_CALLBACKS,
+	STAGE_FREEZE,
+	STAGE_CHECKPOINT,
+	STAGE_KILL,
+	STAGE_RESTART,
+	STAGE_MIGRATE,
+	STAGE_RESTART_CALLBACKS,
+	STAGE_UNFREEZE,
+	NR_STAGES
+};
+
+static const char *stage_names[NR_STAGES] = {
+	"callbacks",
+	"freeze",
+	"checkpoint",
+	"kill",
+	"restart",
+	"migrate",
+	"restart callbacks",
+	"unfreeze",
+};
+
+short from_appid = 0;
+short quiet = 0;
+short no_callbacks = 0;
+int callback_timeout = 0;
+int chkpt_flags = 0;
+int restart_flags = 0;
+struct krg_placement placement = { PLACEMENT_NONE, 0, NULL };
+
+struct timespec stage_start;
+double stage_ms[NR_STAGES];
+
+void show_version(char * program_name)
+{
+	printf("\
+%s %s\n\
+Copyright (C) 2010 Kerlabs.\n\
+This is free software; see source for copying conditions. There is NO\n\
+warranty; not even for MERCHANBILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\
+\n", program_name, VERSION);
+}
+
+void show_help(char * program_name)
+{
+	printf("Usage: %s [options] -P policy <pid>\n"
+	       "\n"
+	       "Freeze and checkpoint the application, kill it, restart it frozen,\n"
+	       "migrate its processes according to policy and unfreeze it.\n"
+	       "\n"
+	       "  -h|--help               Display this information and exit\n"
+	       "  -v|--version            Display version informations and exit\n"
+	       "  -q|--quiet              Be less verbose\n"
+	       "  -a|--from-appid         Use <pid> as an application identifier rather than a process identifier\n"
+	       "  -b|--no-callbacks       Do not execute callbacks\n"
+	       "  -t|--callback-timeout <ms>\n"
+	       "                          Give up if checkpoint callbacks take longer than <ms>\n"
+	       "  -i|--ignore-unsupported-files\n"
+	       "                          Allow to checkpoint application with open files of unsupported type\n"
+	       "  -p|--pids               Replace application orphan pgrp and sid by the ones of krgcr-relocate\n"
+	       "  -P|--placement policy   Where to move the processes:\n"
+	       "                             pack[:nodes]   all processes on one node\n"
+	       "                             spread[:nodes] round-robin over online nodes\n"
+	       "                             nodes          round-robin over given nodes\n"
+	       "                           nodes is a list such as 1,3,5-7\n",
+	       program_name);
+}
+
+void parse_args(int argc, char *argv[])
+{
+	char c;
+	int option_index = 0;
+	char * short_options= "hvqabt:ipP:";
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"version", no_argument, 0, 'v'},
+		{"quiet", no_argument, 0, 'q'},
+		{"from-appid", no_argument, 0, 'a'},
+		{"no-callbacks", no_argument, 0, 'b'},
+		{"callback-timeout", required_argument, 0, 't'},
+		{"ignore-unsupported-files", no_argument, 0, 'i'},
+		{"pids", no_argument, 0, 'p'},
+		{"placement", required_argument, 0, 'P'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'h':
+			show_help(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			show_version(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'q':
+			quiet = 1;
+			break;
+		case 'a':
+			from_appid = 1;
+			break;
+		case 'b':
+			no_callbacks = 1;
+			break;
+		case 't':
+			callback_timeout = atoi(optarg);
+			break;
+		case 'i':
+			chkpt_flags |= CKPT_W_UNSUPPORTED_FILE;
+			break;
+		case 'p':
+			restart_flags |= APP_REPLACE_PGRP_SID;
+			break;
+		case 'P':
+			if (krg_placement_parse(optarg, &placement)) {
+				fprintf(stderr, "krgcr-relocate: invalid "
+					"placement %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			show_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 1 || placement.policy == PLACEMENT_NONE) {
+		show_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void check_environment(void)
+{
+	struct stat buffer;
+
+	/* is Kerrighed launched ? */
+	if (krg_check_hotplug()) {
+		perror("Kerrighed is not started");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Does /var/chkpt exist ? */
+	if (stat(CHKPT_DIR, &buffer)) {
+		perror(CHKPT_DIR);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static double elapsed_ms(const struct timespec *start,
+			 const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3
+		+ (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+void begin_stage(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &stage_start);
+}
+
+void end_stage(enum relocate_stage stage)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stage_ms[stage] = elapsed_ms(&stage_start, &now);
+}
+
+/* Let the application undo what its checkpoint callbacks prepared */
+void continue_app(long id)
+{
+	if (!no_callbacks && cr_execute_continue_callbacks(id, from_appid))
+		fprintf(stderr, "krgcr-relocate: error during callback "
+			"execution\n");
+}
+
+int freeze_checkpoint(long id, struct checkpoint_info *info)
+{
+	struct cr_cb_result result;
+	int r;
+
+	begin_stage();
+	if (!no_callbacks) {
+		r = cr_execute_chkpt_callbacks_report(id, from_appid,
+						      callback_timeout,
+						      &result);
+		if (r) {
+			fprintf(stderr, "krgcr-relocate: checkpoint callbacks "
+				"failed: %s\n", strerror(errno));
+			continue_app(id);
+			return -1;
+		}
+	}
+	end_stage(STAGE_CALLBACKS);
+
+	/* the application stops serving from now on */
+	begin_stage();
+	if (from_appid)
+		r = application_freeze_from_appid(id);
+	else
+		r = application_freeze_from_pid((pid_t)id);
+	end_stage(STAGE_FREEZE);
+	if (r) {
+		perror("krgcr-relocate: fail to freeze the application");
+		continue_app(id);
+		return -1;
+	}
+
+	begin_stage();
+	if (from_appid)
+		*info = application_checkpoint_from_appid(id, chkpt_flags);
+	else
+		*info = application_checkpoint_from_pid((pid_t)id,
+							 chkpt_flags);
+	end_stage(STAGE_CHECKPOINT);
+	if (info->result) {
+		perror("krgcr-relocate: fail to checkpoint the application");
+		goto err_unfreeze;
+	}
+
+	if (chkpt_index_add(info->app_id, info->chkpt_sn))
+		perror("krgcr-relocate: fail to index the new version");
+
+	return 0;
+
+err_unfreeze:
+	continue_app(id);
+	if (from_appid)
+		r = application_unfreeze_from_appid(id, 0);
+	else
+		r = application_unfreeze_from_pid((pid_t)id, 0);
+	if (r)
+		perror("krgcr-relocate: fail to unfreeze the application");
+	else if (!quiet)
+		printf("Application left running where it was\n");
+
+	return -1;
+}
+
+/*
+ * Start reading the image while the old processes exit, so that the
+ * restart finds it in the page cache.
+ */
+void prefetch_version(long app_id, int chkpt_sn)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	struct dirent *ent;
+	DIR *d;
+	int fd, r;
+
+	if (chkpt_resolve_version(app_id, chkpt_sn, dir, sizeof(dir)))
+		return;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		r = snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (r < 0 || r >= sizeof(path))
+			continue;
+
+		fd = open(path, O_RDONLY|O_NOATIME);
+		if (fd == -1)
+			fd = open(path, O_RDONLY);
+		if (fd == -1)
+			continue;
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+
+	closedir(d);
+}
+
+/* The pids must be free again before the application is restarted */
+int wait_processes_exit(const pid_t *pids, int nr_pids)
+{
+	struct timespec start, now, delay = { 0, 1000000 };
+	int i = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (i < nr_pids) {
+		if (kill(pids[i], 0) && errno == ESRCH) {
+			i++;
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (elapsed_ms(&start, &now) > EXIT_TIMEOUT_MS) {
+			fprintf(stderr, "krgcr-relocate: process %d did not "
+				"exit (not reaped by its parent?)\n", pids[i]);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		nanosleep(&delay, NULL);
+	}
+
+	return 0;
+}
+
+int kill_app(const struct checkpoint_info *info)
+{
+	pid_t *pids;
+	int nr_pids, r;
+
+	begin_stage();
+
+	/* before the processes exit, while the version lists them */
+	nr_pids = application_get_chkpt_pids(info->app_id, info->chkpt_sn,
+					     &pids);
+	if (nr_pids < 0) {
+		perror("krgcr-relocate: fail to list the processes");
+		return -1;
+	}
+
+	/* SIGKILL is delivered as the processes are unfrozen */
+	r = application_unfreeze_from_appid(info->app_id, SIGKILL);
+	if (r) {
+		perror("krgcr-relocate: fail to kill the application");
+		goto out;
+	}
+
+	prefetch_version(info->app_id, info->chkpt_sn);
+
+	r = wait_processes_exit(pids, nr_pids);
+
+out:
+	free(pids);
+	end_stage(STAGE_KILL);
+
+	return r;
+}
+
+void show_restart_hint(const struct checkpoint_info *info)
+{
+	fprintf(stderr, "krgcr-relocate: application %ld may be restarted "
+		"with: restart %ld %d\n", info->app_id, info->app_id,
+		info->chkpt_sn);
+}
+
+int restart_app(const struct checkpoint_info *info)
+{
+	struct cr_subst_files_array substitution = { 0, NULL };
+	pid_t *pids;
+	int nr_pids, r;
+
+	begin_stage();
+	r = application_restart(info->app_id, info->chkpt_sn, restart_flags,
+				&substitution);
+	end_stage(STAGE_RESTART);
+	if (r < 0) {
+		perror("krgcr-relocate: fail to restart the application");
+		show_restart_hint(info);
+		return -1;
+	}
+
+	/* still frozen: processes start running on their target node */
+	begin_stage();
+	nr_pids = application_get_chkpt_pids(info->app_id, info->chkpt_sn,
+					     &pids);
+	if (nr_pids < 0) {
+		perror("krgcr-relocate: fail to list the processes");
+	} else {
+		r = application_place(pids, nr_pids, &placement);
+		if (r < 0)
+			perror("krgcr-relocate: fail to migrate the "
+			       "application");
+		else if (r)
+			fprintf(stderr, "krgcr-relocate: fail to migrate %d "
+				"of %d process(es)\n", r, nr_pids);
+		free(pids);
+	}
+	end_stage(STAGE_MIGRATE);
+
+	begin_stage();
+	r = cr_execute_restart_callbacks(info->app_id);
+	end_stage(STAGE_RESTART_CALLBACKS);
+	if (r) {
+		fprintf(stderr, "krgcr-relocate: error during restart callback "
+			"execution\n");
+		return -1;
+	}
+
+	begin_stage();
+	r = application_unfreeze_from_appid(info->app_id, 0);
+	end_stage(STAGE_UNFREEZE);
+	if (r) {
+		perror("krgcr-relocate: fail to unfreeze the application");
+		return -1;
+	}
+
+	return 0;
+}
+
+void show_stages(long app_id)
+{
+	double downtime = 0;
+	int i;
+
+	for (i = STAGE_FREEZE; i < NR_STAGES; i++)
+		downtime += stage_ms[i];
+
+	printf("Application %ld relocated, downtime %.3f ms\n", app_id,
+	       downtime);
+	for (i = 0; i < NR_STAGES; i++)
+		printf("  %-18s %10.3f ms\n", stage_names[i], stage_ms[i]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct checkpoint_info info;
+	long id;
+	int r;
+
+	parse_args(argc, argv);
+
+	check_environment();
+
+	id = atol(argv[optind]);
+	if (id < 2) {
+		show_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	r = freeze_checkpoint(id, &info);
+	if (r)
+		goto out;
+
+	if (!quiet)
+		printf("Application %ld checkpointed as version %d\n",
+		       info.app_id, info.chkpt_sn);
+
+	r = kill_app(&info);
+	if (r) {
+		show_restart_hint(&info);
+		goto out;
+	}
+
+	r = restart_app(&info);
+	if (!r && !quiet)
+		show_stages(info.app_id);
+
+out:
+	free(placement.nodes);
+
+	if (r)
+		exit(EXIT_FAILURE);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,297 @@
+/*
+ *  Copyright (c) 2010, Kerlabs
+ *
+ * Replicate checkpoints to the stores of other nodes, fetch them back,
+ * or serve the store of the local node.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <kerrighed.h>
+
+#include <config.h>
+
+typedef enum {
+	PUSH,
+	FETCH,
+	SERVE,
+} replicate_action_t;
+
+replicate_action_t action = PUSH;
+int nr_replicas = 1;
+int *nodes = NULL;
+int nr_nodes = 0;
+int node_id = -1;
+char *spec = CHKPT_REPLICA_DEFAULT;
+char *root = NULL;
+short quiet = 0;
+
+void show_version(char * program_name)
+{
+	printf("\
+%s %s\n\
+Copyright (C) 2010 Kerlabs.\n\
+This is free software; see source for copying conditions. There is NO\n\
+warranty; not even for MERCHANBILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\
+\n", program_name, VERSION);
+}
+
+void show_help(char * program_name)
+{
+	printf("Usage: %s [options] appid version\n"
+	       "       %s -F [options] appid version\n"
+	       "       %s -S -r root [options]\n"
+	       "\n"
+	       "  -h|--help               Display this information and exit\n"
+	       "  -v|--version            Display version informations and exit\n"
+	       "  -q|--quiet              Be less verbose\n"
+	       "  -T|--transport <spec>   How to reach node stores (default: %s)\n"
+	       "\n"
+	       "Push Options:\n"
+	       "  -R|--replicas <K>       Number of replicas (default: 1)\n"
+	       "  -n|--nodes <n1,n2...>   Replicate to these nodes rather than the nearest ones\n"
+	       "\n"
+	       "Fetch Options:\n"
+	       "  -F|--fetch              Copy the version back from the nearest valid replica\n"
+	       "\n"
+	       "Serve Options:\n"
+	       "  -S|--serve              Serve the store of this node (unix transport)\n"
+	       "  -r|--root <dir>         Directory holding the store\n"
+	       "  -N|--node <node>        Serve as node <node> (default: local node)\n",
+	       program_name, program_name, program_name,
+	       CHKPT_REPLICA_DEFAULT);
+}
+
+int parse_nodes(const char *str)
+{
+	char *end;
+	int *tmp;
+	long node;
+
+	do {
+		node = strtol(str, &end, 10);
+		if (end == str || node < 0 || (*end && *end != ','))
+			return -EINVAL;
+
+		tmp = realloc(nodes, (nr_nodes + 1) * sizeof(int));
+		if (!tmp)
+			return -ENOMEM;
+		nodes = tmp;
+		nodes[nr_nodes++] = node;
+
+		str = end + 1;
+	} while (*end);
+
+	return 0;
+}
+
+void parse_args(int argc, char *argv[])
+{
+	char c;
+	int r = 0, option_index = 0;
+	char * short_options= "hvqT:R:n:FSr:N:";
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{"version", no_argument, 0, 'v'},
+		{"quiet", no_argument, 0, 'q'},
+		{"transport", required_argument, 0, 'T'},
+		{"replicas", required_argument, 0, 'R'},
+		{"nodes", required_argument, 0, 'n'},
+		{"fetch", no_argument, 0, 'F'},
+		{"serve", no_argument, 0, 'S'},
+		{"root", required_argument, 0, 'r'},
+		{"node", required_argument, 0, 'N'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'h':
+			show_help(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			show_version(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'q':
+			quiet = 1;
+			break;
+		case 'T':
+			spec = optarg;
+			break;
+		case 'R':
+			nr_replicas = atoi(optarg);
+			break;
+		case 'n':
+			r = parse_nodes(optarg);
+			break;
+		case 'F':
+			action = FETCH;
+			break;
+		case 'S':
+			action = SERVE;
+			break;
+		case 'r':
+			root = optarg;
+			break;
+		case 'N':
+			node_id = atoi(optarg);
+			break;
+		default:
+			show_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		if (r) {
+			fprintf(stderr, "krgcr-replicate: fail to parse args: "
+				"%s\n", strerror(-r));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int push(struct chkpt_transport *t, long app_id, int chkpt_sn)
+{
+	int r;
+
+	if (!nr_nodes) {
+		nr_nodes = chkpt_select_replica_nodes(nr_replicas, &nodes);
+		if (nr_nodes < 0) {
+			perror("krgcr-replicate: fail to select nodes");
+			return -1;
+		}
+	}
+
+	r = chkpt_replicate_version(t, app_id, chkpt_sn, nodes, nr_nodes);
+	if (r < 0) {
+		perror("krgcr-replicate");
+		return -1;
+	}
+
+	if (!quiet)
+		printf("%d of %d replicas of version %d of application %ld "
+		       "are valid\n", r, nr_nodes, chkpt_sn, app_id);
+
+	return r == nr_nodes ? 0 : -1;
+}
+
+int fetch(struct chkpt_transport *t, long app_id, int chkpt_sn)
+{
+	int node;
+
+	node = chkpt_fetch_replica(t, app_id, chkpt_sn);
+	if (node < 0) {
+		fprintf(stderr, "krgcr-replicate: no valid replica of version "
+			"%d of application %ld: %s\n", chkpt_sn, app_id,
+			strerror(errno));
+		return -1;
+	}
+
+	if (!quiet)
+		printf("Fetched version %d of application %ld from node %d\n",
+		       chkpt_sn, app_id, node);
+
+	return 0;
+}
+
+int serve(struct chkpt_transport *t)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strcmp(t->ops->type, "unix")) {
+		fprintf(stderr, "krgcr-replicate: only unix transport can "
+			"be served\n");
+		return -1;
+	}
+
+	if (node_id == -1)
+		node_id = get_node_id();
+	if (node_id < 0) {
+		perror("krgcr-replicate: fail to get node id");
+		return -1;
+	}
+
+	if (mkdir(root, 0700) && errno != EEXIST) {
+		perror(root);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), t->address, node_id);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	unlink(addr.sun_path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))
+	    || listen(sock, 16)) {
+		perror(addr.sun_path);
+		close(sock);
+		return -1;
+	}
+
+	if (!quiet)
+		printf("Serving store %s on %s\n", root, addr.sun_path);
+
+	chkpt_replica_serve(sock, root);
+	perror("krgcr-replicate");
+	close(sock);
+
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct chkpt_transport t;
+	int r;
+
+	parse_args(argc, argv);
+
+	if ((action == SERVE && (argc != optind || !root))
+	    || (action != SERVE && argc - optind != 2)) {
+		show_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (chkpt_transport_init(&t, spec)) {
+		fprintf(stderr, "krgcr-replicate: invalid transport %s\n",
+			spec);
+		exit(EXIT_FAILURE);
+	}
+
+	/* a peer leaving is reported as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	switch (action) {
+	case PUSH:
+		r = push(&t, atol(argv[optind]), atoi(argv[optind + 1]));
+		break;
+	case FETCH:
+		r = fetch(&t, atol(argv[optind]), atoi(argv[optind + 1]));
+		break;
+	case SERVE:
+	default:
+		r = serve(&t);
+		break;
+	}
+
+	free(nodes);
+
+	if (r)
+		exit(EXIT_FAILURE);
+
+	exit(EXIT_SUCCESS);
+}
@@ -13,9 +13,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <getopt.h>
 #include <time.h>
+#include <sys/time.h>
 #include <kerrighed.h>
 #include <libkrgcb.h>
 
@@ -31,10 +33,15 @@ int options = 0;
 #define QUIET		4
 #define DEBUG		8
 #define NOUNFREEZE	16
+#define LATEST		32
 
 struct cr_subst_files_array substitution;
+struct krg_placement placement = { PLACEMENT_NONE, 0, NULL };
+char *replica_spec = CHKPT_REPLICA_DEFAULT;
 
 int array_size = 0;
+/* substitutions given with -s, kept from one attempt to the next */
+unsigned int nr_user_substitutions = 0;
 const int ARRAY_SIZE_INC = 32;
 
 void show_version(char * program_name)
@@ -51,17 +58,28 @@ warranty; not even for MERCHANBILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\
 void show_help(char * program_name)
 {
 	printf ("Usage: %s [options] appid version\n"
+		"       %s [options] --latest appid\n"
 		"\n"
 		"Options:\n"
 		"  -h|--help                Display this information and exit\n"
 		"  -v|--version             Display version information\n"
+		"  -l|--latest              Restart the newest valid version, falling back to\n"
+		"                           older ones if a version is damaged or incomplete\n"
 		"  -U|--no-unfreeze         Leave the application frozen after the restart\n"
 		"  -t|--replace-tty         Replace application original terminal by the current one\n"
 		"  -f|--foreground          Restart the application in foreground\n"
 		"  -p|--pids                Replace application orphan pgrp and sid by the ones of restart\n"
 		"  -s|--substitute-file file_id,fd\n"
-		"                           Substitute application open files by restart parent fd\n",
-		program_name);
+		"                           Substitute application open files by restart parent fd\n"
+		"  -P|--placement policy    Place the processes before unfreezing them:\n"
+		"                             pack[:nodes]   all processes on one node\n"
+		"                             spread[:nodes] round-robin over online nodes\n"
+		"                             nodes          round-robin over given nodes\n"
+		"                           nodes is a list such as 1,3,5-7\n"
+		"  -T|--replica-transport spec\n"
+		"                           Where to look for a replica if the checkpoint\n"
+		"                           is not available locally (default: %s)\n",
+		program_name, program_name, CHKPT_REPLICA_DEFAULT);
 }
 
 char *__get_returned_word(const char *toexec)
@@ -178,6 +196,17 @@ error:
 	return r;
 }
 
+/* forget the substitutions computed for a previous attempt */
+void reset_file_substitution(void)
+{
+	unsigned int i;
+
+	for (i = nr_user_substitutions; i < substitution.nr; i++)
+		free(substitution.files[i].file_id);
+
+	substitution.nr = nr_user_substitutions;
+}
+
 void clean_file_substitution(struct cr_subst_files_array *subst_array)
 {
 	unsigned int i;
@@ -266,12 +295,76 @@ out:
 	return r;
 }
 
+int place_application(long appid, int version)
+{
+	pid_t *pids;
+	int r, nr_pids;
+
+	nr_pids = application_get_chkpt_pids(appid, version, &pids);
+	if (nr_pids < 0) {
+		fprintf(stderr, "restart: fail to list processes of "
+			"application %ld: %s\n", appid, strerror(errno));
+		return -1;
+	}
+
+	if (options & DEBUG)
+		printf("DEBUG: placing %d process(es)\n", nr_pids);
+
+	r = application_place(pids, nr_pids, &placement);
+	if (r < 0)
+		fprintf(stderr, "restart: fail to place application %ld: "
+			"%s\n", appid, strerror(errno));
+	else if (r)
+		fprintf(stderr, "restart: fail to migrate %d of %d "
+			"process(es) of application %ld\n", r, nr_pids, appid);
+
+	free(pids);
+
+	return r;
+}
+
+/*
+ * The node which took the checkpoint may be gone: get the version from
+ * the nearest node still holding a valid replica.
+ */
+int fetch_replica(long appid, int version)
+{
+	struct chkpt_transport t;
+	int node;
+
+	if (chkpt_get_location(appid, version, NULL, 0)
+	    != CHKPT_LOCATION_UNKNOWN)
+		return 0;
+
+	if (chkpt_transport_init(&t, replica_spec)) {
+		fprintf(stderr, "restart: invalid replica transport %s\n",
+			replica_spec);
+		return -1;
+	}
+
+	/* a replica server leaving is reported as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	node = chkpt_fetch_replica(&t, appid, version);
+	if (node < 0) {
+		fprintf(stderr, "restart: no valid replica of version %d of "
+			"application %ld: %s\n", version, appid,
+			strerror(errno));
+		return -1;
+	}
+
+	if (!(options & QUIET))
+		printf("Fetched version %d of application %ld from node %d\n",
+		       version, appid, node);
+
+	return 0;
+}
+
 int parse_args(int argc, char *argv[])
 {
-	char *checkpoint_dir;
 	char c;
 	int r, option_index = 0;
-	char * short_options= "hvftps:Uqd";
+	char * short_options= "hvftps:UqdP:T:l";
 	static struct option long_options[] =
 		{
 			{"help", no_argument, 0, 'h'},
@@ -283,6 +376,9 @@ int parse_args(int argc, char *argv[])
 			{"no-unfreeze", no_argument, 0, 'U'},
 			{"quiet", no_argument, 0, 'q'},
 			{"debug", no_argument, 0, 'd'},
+			{"placement", required_argument, 0, 'P'},
+			{"replica-transport", required_argument, 0, 'T'},
+			{"latest", no_argument, 0, 'l'},
 			{0, 0, 0, 0}
 		};
 
@@ -319,6 +415,15 @@ int parse_args(int argc, char *argv[])
 		case 'U':
 			options |= NOUNFREEZE;
 			break;
+		case 'P':
+			r = krg_placement_parse(optarg, &placement) ? -errno : 0;
+			break;
+		case 'T':
+			replica_spec = optarg;
+			break;
+		case 'l':
+			options |= LATEST;
+			break;
 		default:
 			show_help(argv[0]);
 			exit(EXIT_FAILURE);
@@ -333,19 +438,14 @@ int parse_args(int argc, char *argv[])
 		}
 	}
 
-	if (argc - optind != 2) {
+	if (argc - optind != ((options & LATEST) ? 1 : 2)) {
 		show_help(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
 	appid = atol(argv[optind]);
-	version = atoi(argv[optind+1]);
-	asprintf(&checkpoint_dir, CHKPT_DIR "/%ld/v%d/", appid, version);
-
-	if (options & STDIN_OUT_ERR)
-		r = replace_stdin_stdout_stderr(checkpoint_dir);
-
-	free(checkpoint_dir);
+	if (!(options & LATEST))
+		version = atoi(argv[optind+1]);
 
 	return r;
 }
@@ -370,6 +470,107 @@ void show_error(int _errno)
 	}
 }
 
+const char *restart_strerror(int _errno)
+{
+	switch (_errno) {
+	case E_CR_APPBUSY:
+		return "appid already in use";
+	case E_CR_PIDBUSY:
+		return "PID already in use";
+	case E_CR_BADDATA:
+		return "invalid checkpoint files";
+	default:
+		return strerror(_errno);
+	}
+}
+
+/* A damaged or incomplete version does not prevent older ones to restart */
+int can_fall_back(int _errno)
+{
+	return _errno == E_CR_BADDATA || _errno == ENOENT;
+}
+
+/* Return 0, or a negative error if a file of the version is missing */
+int prepare_restart(int _version)
+{
+	char path[PATH_MAX], *checkpoint_dir;
+	int r = 0;
+
+	fetch_replica(appid, _version);
+
+	if ((options & DEBUG)
+	    && !chkpt_resolve_version(appid, _version, path, sizeof(path)))
+		printf("DEBUG: version %d stored in %s\n", _version, path);
+
+	if (options & STDIN_OUT_ERR) {
+		reset_file_substitution();
+
+		if (asprintf(&checkpoint_dir, CHKPT_DIR "/%ld/v%d/", appid,
+			     _version) == -1)
+			return -ENOMEM;
+
+		r = replace_stdin_stdout_stderr(checkpoint_dir);
+		free(checkpoint_dir);
+	}
+
+	return r;
+}
+
+/*
+ * Try the given versions in turn. Other errors than a damaged or
+ * incomplete version (appid or PID in use...) would fail the same way
+ * with every version and stop the chain.
+ *
+ * Return the pid of the application root process, -1 on failure
+ */
+int restart_versions(const int *versions, int nr_versions)
+{
+	struct timeval start, end;
+	double elapsed;
+	int i, r = -1, _errno = ENOENT;
+
+	nr_user_substitutions = substitution.nr;
+
+	for (i = 0; i < nr_versions; i++) {
+		gettimeofday(&start, NULL);
+
+		r = prepare_restart(versions[i]);
+		if (r) {
+			_errno = -r;
+			r = -1;
+		} else {
+			r = application_restart(appid, versions[i], flags,
+						&substitution);
+			_errno = errno;
+			if (r < 0 && !(options & LATEST))
+				show_error(_errno);
+		}
+
+		gettimeofday(&end, NULL);
+		elapsed = (end.tv_sec - start.tv_sec)
+			+ (end.tv_usec - start.tv_usec) / 1000000.0;
+
+		if (r >= 0) {
+			if ((options & LATEST) && !(options & QUIET))
+				printf("Attempt %d: version %d restarted in "
+				       "%.3fs\n", i + 1, versions[i], elapsed);
+			version = versions[i];
+			return r;
+		}
+
+		if (options & LATEST)
+			fprintf(stderr, "restart: attempt %d: version %d failed "
+				"after %.3fs: %s\n", i + 1, versions[i],
+				elapsed, restart_strerror(_errno));
+
+		if (!can_fall_back(_errno))
+			break;
+	}
+
+	errno = _errno;
+	return -1;
+}
+
 void relay_signal(int signum)
 {
 	if (root_pid)
@@ -426,7 +627,8 @@ void check_environment(void)
 
 int main(int argc, char *argv[])
 {
-	int r = 0;
+	int *versions = NULL;
+	int r = 0, nr_versions;
 
 	/* Manage options with getopt */
 	r = parse_args(argc, argv);
@@ -436,18 +638,45 @@ int main(int argc, char *argv[])
 	/* Check environment */
 	check_environment();
 
-	if (!(options & QUIET))
-		printf("Restarting application %ld (v%d) ...\n",
-		       appid, version);
+	if (options & LATEST) {
+		nr_versions = chkpt_index_versions(appid, &versions);
+		if (nr_versions <= 0) {
+			fprintf(stderr, "restart: no checkpoint of application "
+				"%ld\n", appid);
+			r = -1;
+			goto exit;
+		}
 
-	r = application_restart(appid, version, flags, &substitution);
-	if (r < 0) {
-		show_error(errno);
-		goto exit;
+		if (!(options & QUIET))
+			printf("Restarting application %ld (latest of %d "
+			       "versions) ...\n", appid, nr_versions);
+
+		r = restart_versions(versions, nr_versions);
+		if (r < 0) {
+			fprintf(stderr, "restart: no version of application "
+				"%ld could be restarted\n", appid);
+			goto exit;
+		}
+	} else {
+		if (!(options & QUIET))
+			printf("Restarting application %ld (v%d) ...\n",
+			       appid, version);
+
+		r = restart_versions(&version, 1);
+		if (r < 0)
+			goto exit;
 	}
 
 	root_pid = r;
 
+	/*
+	 * Restored processes are still frozen: move them to their target
+	 * node before they start running. A failed placement is not fatal,
+	 * the application just runs where it has been restored.
+	 */
+	if (placement.policy != PLACEMENT_NONE)
+		place_application(appid, version);
+
 	r = cr_execute_restart_callbacks(appid);
 	if (r) {
 		fprintf(stderr, "restart: error during callback execution"
@@ -479,6 +708,8 @@ int main(int argc, char *argv[])
 
 exit:
 	clean_file_substitution(&substitution);
+	free(placement.nodes);
+	free(versions);
 
 	if (r)
 		exit(EXIT_FAILURE);